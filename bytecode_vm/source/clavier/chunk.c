@@ -8,15 +8,18 @@ void initChunk(Chunk* chunk) {
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
 	chunk->lines = NULL;
 	initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
-	initChunk(chunk);
+	// A chunk loaded from an image uses code and lines in place and has no capacity. See loadImage().
+	if (chunk->capacity > 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	if (chunk->lineCapacity > 0) FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
 	freeValueArray(&chunk->constants);
+	initChunk(chunk);
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -24,13 +27,38 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-		// #todo: Run Length Encoding
-		chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
 	chunk->count++;
+
+	// Consecutive bytes mostly belong to the same line, so only record where a new line starts.
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+		return;
+	}
+	if (chunk->lineCapacity < chunk->lineCount + 1) {
+		int oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+	}
+	LineStart* lineStart = &(chunk->lines[chunk->lineCount++]);
+	lineStart->offset = chunk->count - 1;
+	lineStart->line = line;
+}
+
+int getLine(Chunk* chunk, int offset) {
+	// Binary search for the last LineStart at or before the offset.
+	int low = 0;
+	int high = chunk->lineCount - 1;
+	while (low < high) {
+		int mid = low + (high - low + 1) / 2;
+		if (chunk->lines[mid].offset <= offset) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
 }
 
 int addConstant(VM* vm, Chunk* chunk, Value value) {
@@ -39,3 +67,41 @@ int addConstant(VM* vm, Chunk* chunk, Value value) {
 	pop(vm);
 	return chunk->constants.count - 1;
 }
+
+int instructionLength(Chunk* chunk, int offset) {
+	switch (chunk->code[offset]) {
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_CALL:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_PEEK:
+		case OP_POP_UNDER:
+		case OP_IMPORT:
+			return 2;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_ADD_PROFILED:
+		case OP_CHECK_INLINED:
+			return 3;
+		case OP_CLOSURE: {
+			// Each upvalue is encoded as (isLocal, index) pair.
+			ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+			return 2 + 2 * function->upvalueCount;
+		}
+		default:
+			return 1;
+	}
+}
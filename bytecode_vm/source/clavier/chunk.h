@@ -45,18 +45,35 @@ typedef enum {
 	OP_RETURN,
 	OP_CLASS,
 	OP_INHERIT,
-	OP_METHOD
+	OP_METHOD,
+	// Emitted only for inlined function bodies. See inlineCall() in compiler.c
+	OP_PEEK,      // Push a copy of the value at the given distance from the stack top.
+	OP_POP_UNDER, // Pop the given number of values beneath the stack top, keeping the top.
+	OP_IMPORT,    // Run the module at the path in the constant unless it ran already. Pushes nil either way.
+	OP_ADD_NUMBER,   // OP_ADD where the profile saw only numbers. Checks for numbers first.
+	OP_ADD_PROFILED, // OP_ADD recording its operand types into the entry of VM.recording with the given 2-byte index.
+	OP_CHECK_INLINED // Push whether the callee beneath the given number of arguments is still a closure of the function in the constant. See inlineCall().
 } OpCode;
 
+// Run-length encoded line number. Instructions from offset to the next LineStart are in the same line.
+typedef struct {
+	int offset;
+	int line;
+} LineStart;
+
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t* code;
-	int* lines; // Store line number.
+	int lineCount;
+	int lineCapacity;
+	LineStart* lines;
 	ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+int getLine(Chunk* chunk, int offset); // Returns the line number of the byte at the offset.
 int addConstant(VM* vm, Chunk* chunk, Value value); // Returns linear index of the constant in a constant array.
+int instructionLength(Chunk* chunk, int offset); // Returns the size of the instruction in bytes, including operands.
@@ -11,8 +11,39 @@
 #define DEBUG_STRESS_GC       0
 #define DEBUG_LOG_GC          0
 
+// Max bytecode size of a leaf function body that the compiler inlines at call sites.
+// 0 disables inlining.
+#define INLINE_THRESHOLD      32
+// Function bodies shorter than this (in bytes of source) are compiled at declaration
+// even when lazy compilation is on.
+#define LAZY_COMPILE_MIN_BODY 256
+// Sources shorter than this (in bytes) are scanned on the compiling thread
+// even when VM.scanThread is on. Starting a thread costs more than scanning them.
+#define SCAN_THREAD_MIN_SOURCE (64 * 1024)
+
+// Hash function of strings. See hashString().
+#define STRING_HASH_FNV1A     0 // A byte at a time
+#define STRING_HASH_WYHASH    1 // 8 bytes at a time
+#define STRING_HASH           STRING_HASH_WYHASH
+// readFile() maps files at least this large (in bytes) into memory rather than copying them.
+#define MAPPED_STRING_MIN     (64 * 1024)
+// Slices of strings at least this long (in bytes) are views of them rather than copies. See text.h.
+#define STRING_VIEW_MIN       32
+// Compiled patterns a VM keeps for reuse. The cache is emptied when it's full.
+#define REGEX_CACHE_MAX       64
+// Initial buffer size of a file reader in bytes. It grows to hold the longest line or chunk read.
+#define READER_BUFFER_SIZE    (64 * 1024)
+
 #define UINT8_COUNT           (UINT8_MAX + 1)
 
+#if defined(__cplusplus)
+#define THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #ifdef __cplusplus
 #define CPLUSPLUS_BEGIN extern "C" {
 #define CPLUSPLUS_END   }
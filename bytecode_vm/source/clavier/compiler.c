@@ -1,7 +1,12 @@
 #include "compiler.h"
 #include "memory.h"
+#include "number.h"
 #include "common.h"
+#include "image.h"
+#include "optimizer.h"
+#include "profile.h"
 #include "scanner.h"
+#include "scanthread.h"
 #if DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
@@ -38,13 +43,16 @@ typedef enum {
 
 typedef struct {
 	Token name;
+	uint32_t hash; // hashName() of name
 	int depth; // 0 = global scope, 1 = top level block, ...
 	bool isCaptured; // Captured by a closure
+	int shadowed; // Index of the outer local with the same name, or -1
 } Local;
 
 typedef struct {
 	uint8_t index;
 	bool isLocal;
+	Token name; // Used to find the upvalue again when the function is compiled lazily.
 } Upvalue;
 
 typedef enum {
@@ -54,6 +62,15 @@ typedef enum {
 	TYPE_SCRIPT
 } FunctionType;
 
+// Twice the max number of constants in a chunk, so load factor is at most 0.5.
+#define CONSTANT_SLOT_COUNT (UINT8_COUNT * 2)
+
+// Same for locals. Deleted slots count as used, so the table is rebuilt when too many are used.
+#define LOCAL_SLOT_COUNT (UINT8_COUNT * 2)
+#define LOCAL_SLOT_MAX_USED (LOCAL_SLOT_COUNT * 3 / 4)
+#define LOCAL_SLOT_EMPTY -1
+#define LOCAL_SLOT_DELETED -2
+
 typedef struct Compiler {
 	struct Compiler* enclosing;
 	ObjFunction* function;
@@ -61,8 +78,22 @@ typedef struct Compiler {
 
 	Local locals[UINT8_COUNT]; // #todo: Support more than 256 local variables
 	int localCount;
+	// Open addressing hash table from a name to the index of the innermost local with the name.
+	int16_t localSlots[LOCAL_SLOT_COUNT];
+	int localSlotsUsed;
+
 	Upvalue upvalues[UINT8_COUNT];
+	// Upvalue index for each local and upvalue of the enclosing function, or -1 if not captured yet.
+	int16_t capturedLocals[UINT8_COUNT];
+	int16_t capturedUpvalues[UINT8_COUNT];
 	int scopeDepth;
+	// Compiling the body of a lazy function. Its enclosing compilers are gone,
+	// so names captured at declaration are found in upvalues by name instead.
+	bool lazy;
+
+	// Open addressing hash set of constant indices, to reuse a slot when the same value is added again.
+	// Keys are looked up from the chunk's constant table. -1 for empty slot.
+	int16_t constantSlots[CONSTANT_SLOT_COUNT];
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -70,17 +101,58 @@ typedef struct ClassCompiler {
 	bool hasSuperclass;
 } ClassCompiler;
 
+// Function body that is skipped at declaration and compiled on the first call.
+struct LazyFunction {
+	const char* source; // '(' of the parameter list. The VM keeps the source alive.
+	const char* sourceEnd;
+	const char* sourceStart; // See Context.
+	uint64_t sourceHash;
+	int line;
+	FunctionType type;
+	bool inClass;
+	bool hasSuperclass;
+	Token* upvalueNames; // Free variables found by the pre-scan, in upvalue order.
+	int upvalueCount;
+};
+
+// How a name is used across the whole source. Built lazily by scanNameUsages().
+typedef struct {
+	const char* start; // NULL if the slot is empty.
+	int length;
+	int declarations; // Number of var, fun and class declarations with this name.
+	bool assigned;    // Appears as an assignment target somewhere.
+	// Global function with this name whose body will be copied into call sites.
+	// It's also a constant of the script chunk, so GC won't collect it while compiling.
+	ObjFunction* inlineFunction;
+} NameUsage;
+
 // #todo-gc: Temp var for GC. Don't use for other purpose.
-static Compiler* g_currentCompiler = NULL;
+static THREAD_LOCAL Compiler* g_currentCompiler = NULL;
 
 // Used in compile() to pass parameters.
 typedef struct {
 	Scanner* scanner;
+	// Not NULL if the source is scanned on another thread.
+	// Then scanner is only kept at the position after parser->current, for looking ahead.
+	ScanThread* scanThread;
 	Compiler* compiler;
 	ClassCompiler* currentClass;
 	VM* vm;
 	Parser* parser;
 	Chunk* currentChunk;
+
+	// For inlining
+	const char* source;
+	NameUsage* nameUsages;
+	int nameUsageCount;
+	int nameUsageCapacity;
+	bool nameUsagesScanned;
+	bool importsModules; // The source has an import statement. Set by scanNameUsages().
+
+	// For profiles. Keys are offsets from sourceStart in the source with sourceHash.
+	// sourceHash is 0 unless VM.profile or VM.recording is set.
+	const char* sourceStart;
+	uint64_t sourceHash;
 } Context;
 
 typedef void (*ParseFn)(Context* ctx, bool canAssign);
@@ -122,7 +194,11 @@ static void advance(Context* ctx) {
 	parser->previous = parser->current;
 
 	for (;;) {
-		parser->current = scanToken(ctx->scanner);
+		if (ctx->scanThread != NULL) {
+			parser->current = nextScannedToken(ctx->scanThread, ctx->scanner);
+		} else {
+			parser->current = scanToken(ctx->scanner);
+		}
 		if (parser->current.type != TOKEN_ERROR) break;
 
 		errorAtCurrent(parser, parser->current.start);
@@ -188,12 +264,50 @@ static void emitReturn(Context* ctx) {
 	emitByte(ctx, OP_RETURN);
 }
 
+static uint32_t hashValue(Value value) {
+#if NAN_BOXING
+	uint64_t bits = value;
+#else
+	uint64_t bits = 0;
+	switch (value.type) {
+		case VAL_BOOL:   bits = AS_BOOL(value); break;
+		case VAL_NIL:    bits = 0; break;
+		case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+		case VAL_OBJ:    bits = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+	}
+	bits ^= (uint64_t)value.type << 56;
+#endif
+	// Mix upper bits into lower bits as we only use lower bits for indexing.
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+// Returns the slot where the value is, or the empty slot where it should be inserted.
+static int16_t* findConstantSlot(Compiler* compiler, Value value) {
+	ValueArray* constants = &(compiler->function->chunk.constants);
+	uint32_t index = hashValue(value) & (CONSTANT_SLOT_COUNT - 1);
+	for (;;) {
+		int16_t* slot = &(compiler->constantSlots[index]);
+		if (*slot == -1 || valuesIdentical(constants->values[*slot], value)) {
+			return slot;
+		}
+		index = (index + 1) & (CONSTANT_SLOT_COUNT - 1);
+	}
+}
+
 static uint8_t makeConstant(Context* ctx, Value value) {
+	// Every mention of the same identifier or number shares one constant.
+	int16_t* slot = findConstantSlot(ctx->compiler, value);
+	if (*slot != -1) return (uint8_t)*slot;
+
 	int constant = addConstant(ctx->vm, ctx->currentChunk, value);
 	if (constant > UINT8_MAX) {
 		error(ctx->parser, "Too many constants in one chunk.");
 		return 0;
 	}
+	*slot = (int16_t)constant;
 	return (uint8_t)constant;
 }
 
@@ -216,7 +330,90 @@ static void patchJump(Context* ctx, int offset) {
 	currentChunk->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Context* ctx, Compiler* compiler, FunctionType type) {
+static uint32_t hashName(const char* chars, int length) {
+	// FNV-1a hash
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; ++i) {
+		hash ^= (uint8_t)chars[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static bool identifiersEqual(Token* a, Token* b) {
+	if (a->length != b->length) return false;
+	return 0 == memcmp(a->start, b->start, a->length);
+}
+
+// Returns the index of the innermost local with the name, or -1.
+static int findLocal(Compiler* compiler, Token* name, uint32_t hash) {
+	uint32_t index = hash & (LOCAL_SLOT_COUNT - 1);
+	for (;;) {
+		int slot = compiler->localSlots[index];
+		if (slot == LOCAL_SLOT_EMPTY) return -1;
+		if (slot != LOCAL_SLOT_DELETED) {
+			Local* local = &(compiler->locals[slot]);
+			if (local->hash == hash && identifiersEqual(name, &(local->name))) return slot;
+		}
+		index = (index + 1) & (LOCAL_SLOT_COUNT - 1);
+	}
+}
+
+static void rebuildLocalSlots(Compiler* compiler);
+
+// Makes locals[slot] the innermost local with its name.
+static void insertLocalSlot(Compiler* compiler, int slot) {
+	Local* local = &(compiler->locals[slot]);
+	uint32_t index = local->hash & (LOCAL_SLOT_COUNT - 1);
+	int deleted = -1;
+
+	for (;;) {
+		int entry = compiler->localSlots[index];
+		if (entry == LOCAL_SLOT_EMPTY) break;
+		if (entry == LOCAL_SLOT_DELETED) {
+			if (deleted == -1) deleted = (int)index;
+		} else if (compiler->locals[entry].hash == local->hash && identifiersEqual(&(local->name), &(compiler->locals[entry].name))) {
+			local->shadowed = entry;
+			compiler->localSlots[index] = (int16_t)slot;
+			return;
+		}
+		index = (index + 1) & (LOCAL_SLOT_COUNT - 1);
+	}
+
+	local->shadowed = -1;
+	if (deleted != -1) {
+		compiler->localSlots[deleted] = (int16_t)slot;
+		return;
+	}
+	compiler->localSlots[index] = (int16_t)slot;
+	if (++compiler->localSlotsUsed > LOCAL_SLOT_MAX_USED) {
+		rebuildLocalSlots(compiler);
+	}
+}
+
+// locals[slot] must be the innermost local with its name. The outer one becomes visible again.
+static void removeLocalSlot(Compiler* compiler, int slot) {
+	Local* local = &(compiler->locals[slot]);
+	uint32_t index = local->hash & (LOCAL_SLOT_COUNT - 1);
+	while (compiler->localSlots[index] != slot) {
+		index = (index + 1) & (LOCAL_SLOT_COUNT - 1);
+	}
+	compiler->localSlots[index] = (int16_t)(local->shadowed != -1 ? local->shadowed : LOCAL_SLOT_DELETED);
+}
+
+// Drops deleted slots. There are at most UINT8_COUNT locals, so this never triggers itself.
+static void rebuildLocalSlots(Compiler* compiler) {
+	for (int i = 0; i < LOCAL_SLOT_COUNT; ++i) {
+		compiler->localSlots[i] = LOCAL_SLOT_EMPTY;
+	}
+	compiler->localSlotsUsed = 0;
+	for (int i = 0; i < compiler->localCount; ++i) {
+		insertLocalSlot(compiler, i);
+	}
+}
+
+// Pass function to fill an existing function object. (Lazy compilation)
+static void initCompiler(Context* ctx, Compiler* compiler, FunctionType type, ObjFunction* function) {
 	g_currentCompiler = compiler;
 
 	compiler->enclosing = ctx->compiler;
@@ -224,12 +421,24 @@ static void initCompiler(Context* ctx, Compiler* compiler, FunctionType type) {
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
-	compiler->function = newFunction(ctx->vm);
+	compiler->lazy = false;
+	for (int i = 0; i < CONSTANT_SLOT_COUNT; ++i) {
+		compiler->constantSlots[i] = -1;
+	}
+	for (int i = 0; i < LOCAL_SLOT_COUNT; ++i) {
+		compiler->localSlots[i] = LOCAL_SLOT_EMPTY;
+	}
+	compiler->localSlotsUsed = 0;
+	for (int i = 0; i < UINT8_COUNT; ++i) {
+		compiler->capturedLocals[i] = -1;
+		compiler->capturedUpvalues[i] = -1;
+	}
+	compiler->function = function != NULL ? function : newFunction(ctx->vm);
 
 	ctx->compiler = compiler;
 	ctx->currentChunk = &(compiler->function->chunk);
 
-	if (type != TYPE_SCRIPT) {
+	if (type != TYPE_SCRIPT && function == NULL) {
 		// This function object will live longer than the source code so copy the string.
 		compiler->function->name = copyString(ctx->vm, ctx->parser->previous.start, ctx->parser->previous.length);
 	}
@@ -245,21 +454,30 @@ static void initCompiler(Context* ctx, Compiler* compiler, FunctionType type) {
 		local->name.start = "";
 		local->name.length = 0;
 	}
+	local->hash = hashName(local->name.start, local->name.length);
+	insertLocalSlot(compiler, 0);
+}
+
+static void leaveCompiler(Context* ctx) {
+	g_currentCompiler = g_currentCompiler->enclosing;
+	ctx->compiler = ctx->compiler->enclosing;
+	if (ctx->compiler != NULL) {
+		ctx->currentChunk = &(ctx->compiler->function->chunk);
+	}
 }
 
 static ObjFunction* endCompiler(Context* ctx) {
 	emitReturn(ctx);
 	ObjFunction* function = ctx->compiler->function;
+	if (!ctx->parser->hadError) {
+		optimizeChunk(ctx->vm, ctx->currentChunk);
+	}
 #if DEBUG_PRINT_CODE
 	if (!ctx->parser->hadError) {
 		disassembleChunk(ctx->currentChunk, function->name != NULL ? function->name->chars : "<script>");
 	}
 #endif
-	g_currentCompiler = g_currentCompiler->enclosing;
-	ctx->compiler = ctx->compiler->enclosing;
-	if (ctx->compiler != NULL) {
-		ctx->currentChunk = &(ctx->compiler->function->chunk);
-	}
+	leaveCompiler(ctx);
 	return function;
 }
 
@@ -279,6 +497,7 @@ static void endScope(Context* ctx) {
 		} else {
 			emitByte(ctx, OP_POP);
 		}
+		removeLocalSlot(current, current->localCount - 1);
 		current->localCount--;
 	}
 }
@@ -293,35 +512,25 @@ static uint8_t identifierConstant(Context* ctx, Token* name) {
 	return makeConstant(ctx, OBJ_VAL(copyString(ctx->vm, name->start, name->length)));
 }
 
-static bool identifiersEqual(Token* a, Token* b) {
-	if (a->length != b->length) return false;
-	return 0 == memcmp(a->start, b->start, a->length);
+static int resolveLocalHashed(Parser* parser, Compiler* compiler, Token* name, uint32_t hash) {
+	int slot = findLocal(compiler, name, hash);
+	if (slot != -1 && compiler->locals[slot].depth == -1) {
+		// The variable is declared but not defined yet. (see addLocal and defineVariable functions)
+		error(parser, "Can't read local variable in its own initializer.");
+	}
+	return slot;
 }
 
 static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
-	// #todo: Compiler needs to linear search a variable every time. Better way?
-	// Traverse in reverse for shadowing.
-	for (int i = compiler->localCount - 1; i >= 0; --i) {
-		Local* local = &compiler->locals[i];
-		if (identifiersEqual(name, &local->name)) {
-			if (local->depth == -1) {
-				// The variable is declared but not defined yet. (see addLocal and defineVariable functions)
-				error(parser, "Can't read local variable in its own initializer.");
-			}
-			return i;
-		}
-	}
-	return -1;
+	return resolveLocalHashed(parser, compiler, name, hashName(name->start, name->length));
 }
 
-static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool isLocal, Token* name) {
 	int upvalueCount = compiler->function->upvalueCount;
 
-	for (int i = 0; i < upvalueCount; ++i) {
-		Upvalue* upvalue = &(compiler->upvalues[i]);
-		if (upvalue->index == index && upvalue->isLocal == isLocal) {
-			return i;
-		}
+	int16_t* captured = isLocal ? compiler->capturedLocals : compiler->capturedUpvalues;
+	if (captured[index] != -1) {
+		return captured[index];
 	}
 	if (upvalueCount == UINT8_COUNT) {
 		error(parser, "Too many closure variables in function.");
@@ -330,27 +539,41 @@ static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool is
 
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
 	compiler->upvalues[upvalueCount].index = index;
+	compiler->upvalues[upvalueCount].name = *name;
+	captured[index] = (int16_t)upvalueCount;
 	return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
+static int resolveUpvalueHashed(Parser* parser, Compiler* compiler, Token* name, uint32_t hash) {
+	if (compiler->lazy) {
+		for (int i = 0; i < compiler->function->upvalueCount; ++i) {
+			if (identifiersEqual(name, &(compiler->upvalues[i].name))) {
+				return i;
+			}
+		}
+		return -1;
+	}
 	if (compiler->enclosing == NULL) return -1;
 
-	int local = resolveLocal(parser, compiler->enclosing, name);
+	int local = resolveLocalHashed(parser, compiler->enclosing, name, hash);
 	if (local != -1) {
 		compiler->enclosing->locals[local].isCaptured = true;
-		return addUpvalue(parser, compiler, (uint8_t)local, true);
+		return addUpvalue(parser, compiler, (uint8_t)local, true, name);
 	}
 
-	int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
+	int upvalue = resolveUpvalueHashed(parser, compiler->enclosing, name, hash);
 	if (upvalue != -1) {
-		return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
+		return addUpvalue(parser, compiler, (uint8_t)upvalue, false, name);
 	}
 
 	// Global variable (or undefined variable, but Runtime don't know if so)
 	return -1;
 }
 
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
+	return resolveUpvalueHashed(parser, compiler, name, hashName(name->start, name->length));
+}
+
 static void addLocal(Context* ctx, Token name) {
 	if (ctx->compiler->localCount == UINT8_COUNT) {
 		error(ctx->parser, "Too many local variables in function.");
@@ -359,22 +582,22 @@ static void addLocal(Context* ctx, Token name) {
 
 	Local* local = &ctx->compiler->locals[ctx->compiler->localCount++];
 	local->name = name;
+	local->hash = hashName(name.start, name.length);
 	local->depth = -1; // Variable is declared but not defined yet. Will be initialized in defineVariable().
 	local->isCaptured = false;
+	insertLocalSlot(ctx->compiler, ctx->compiler->localCount - 1);
 }
 
 static void declareVariable(Context* ctx) {
 	Compiler* compiler = ctx->compiler;
 	if (compiler->scopeDepth == 0) return;
 
+	// Locals of the current scope are innermost, so only the innermost one with the name matters.
 	Token* name = &ctx->parser->previous;
-	for (int i = (int)(compiler->localCount) - 1; i >= 0; --i) {
-		Local* local = &compiler->locals[i];
-		if (local->depth != -1 && local->depth < compiler->scopeDepth) {
-			break;
-		}
-
-		if (identifiersEqual(name, &local->name)) {
+	int slot = findLocal(compiler, name, hashName(name->start, name->length));
+	if (slot != -1) {
+		Local* local = &compiler->locals[slot];
+		if (local->depth == -1 || local->depth >= compiler->scopeDepth) {
 			error(ctx->parser, "A variable with this name already exists in this scope.");
 		}
 	}
@@ -429,8 +652,38 @@ static void and_(Context* ctx, bool canAssign) {
 	patchJump(ctx, endJump);
 }
 
+static uint64_t sourceKey(Context* ctx, const char* position) {
+	return profileKey(ctx->sourceHash, (size_t)(position - ctx->sourceStart));
+}
+
+// Additions are specialized by the operand types the profile saw, or instrumented to record them.
+static void emitAdd(Context* ctx, const char* operator) {
+	Profile* profile = ctx->vm->profile;
+	Profile* recording = ctx->vm->recording;
+	if (profile == NULL && recording == NULL) {
+		emitByte(ctx, OP_ADD);
+		return;
+	}
+
+	uint64_t key = sourceKey(ctx, operator);
+	if (recording != NULL) {
+		int site = profileSite(recording, key);
+		if (site <= UINT16_MAX) {
+			emitByte(ctx, OP_ADD_PROFILED);
+			emitBytes(ctx, (site >> 8) & 0xff, site & 0xff);
+			return;
+		}
+	}
+	if (profile != NULL && profileCount(profile, key) == PROFILE_NUMBERS) {
+		emitByte(ctx, OP_ADD_NUMBER);
+	} else {
+		emitByte(ctx, OP_ADD);
+	}
+}
+
 static void binary(Context* ctx, bool canAssign) {
 	TokenType operatorType = ctx->parser->previous.type;
+	const char* operator = ctx->parser->previous.start;
 	ParseRule* rule = getRule(operatorType);
 	parsePrecedence(ctx, (Precedence)(rule->precedence + 1));
 
@@ -441,7 +694,7 @@ static void binary(Context* ctx, bool canAssign) {
 		case TOKEN_GREATER_EQUAL: emitBytes(ctx, OP_LESS, OP_NOT); break;
 		case TOKEN_LESS: emitByte(ctx, OP_LESS); break;
 		case TOKEN_LESS_EQUAL: emitBytes(ctx, OP_GREATER, OP_NOT); break;
-		case TOKEN_PLUS:  emitByte(ctx, OP_ADD); break;
+		case TOKEN_PLUS:  emitAdd(ctx, operator); break;
 		case TOKEN_MINUS: emitByte(ctx, OP_SUBTRACT); break;
 		case TOKEN_STAR:  emitByte(ctx, OP_MULTIPLY); break;
 		case TOKEN_SLASH: emitByte(ctx, OP_DIVIDE); break;
@@ -486,7 +739,7 @@ static void grouping(Context* ctx, bool canAssign) {
 }
 
 static void number(Context* ctx, bool canAssign) {
-	double value = strtod(ctx->parser->previous.start, NULL);
+	double value = parseNumber(ctx->parser->previous.start, ctx->parser->previous.length);
 	emitConstant(ctx, NUMBER_VAL(value));
 }
 
@@ -507,6 +760,260 @@ static void string(Context* ctx, bool canAssign) {
 	emitConstant(ctx, OBJ_VAL(copyString(vm, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
+//
+// Inlining
+// Calls to small leaf functions are replaced by copies of their bodies.
+// A function is inlined if it's declared once in global scope and never reassigned in the source,
+// and its body is a single return of an expression without calls, jumps, or upvalues.
+// Modules share the globals with the scripts importing them, and any of them can redefine a function,
+// so nothing is inlined in a source that imports modules or in a module.
+// Arguments stay on the stack and the inlined body reads them by OP_PEEK instead of OP_GET_LOCAL.
+// A later compile() on the same VM (the next REPL line, or a script run on a restored snapshot or a clone)
+// can still redefine the function, so the callee is loaded as for a call, and the call is made
+// instead of the inlined body if it's no longer a closure of the inlined function.
+//
+
+// #todo: Hash load factor is duplicated with table.c
+#define NAME_USAGE_MAX_LOAD 0.75
+
+static NameUsage* findNameUsage(NameUsage* entries, int capacity, const char* start, int length) {
+	uint32_t index = hashName(start, length) & (capacity - 1);
+	for (;;) {
+		NameUsage* usage = &entries[index];
+		if (usage->start == NULL) return usage;
+		if (usage->length == length && memcmp(usage->start, start, length) == 0) return usage;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static NameUsage* addNameUsage(Context* ctx, Token* name) {
+	if (ctx->nameUsageCount + 1 > ctx->nameUsageCapacity * NAME_USAGE_MAX_LOAD) {
+		int capacity = GROW_CAPACITY(ctx->nameUsageCapacity);
+		NameUsage* entries = ALLOCATE(NameUsage, capacity);
+		for (int i = 0; i < capacity; ++i) {
+			entries[i].start = NULL;
+		}
+		for (int i = 0; i < ctx->nameUsageCapacity; ++i) {
+			NameUsage* usage = &ctx->nameUsages[i];
+			if (usage->start == NULL) continue;
+			*findNameUsage(entries, capacity, usage->start, usage->length) = *usage;
+		}
+		FREE_ARRAY(NameUsage, ctx->nameUsages, ctx->nameUsageCapacity);
+		ctx->nameUsages = entries;
+		ctx->nameUsageCapacity = capacity;
+	}
+
+	NameUsage* usage = findNameUsage(ctx->nameUsages, ctx->nameUsageCapacity, name->start, name->length);
+	if (usage->start == NULL) {
+		usage->start = name->start;
+		usage->length = name->length;
+		usage->declarations = 0;
+		usage->assigned = false;
+		usage->inlineFunction = NULL;
+		ctx->nameUsageCount++;
+	}
+	return usage;
+}
+
+// Single pass compiler can't see the code after current token,
+// so scan the whole source once to find out which names are redeclared or reassigned.
+static void scanNameUsages(Context* ctx) {
+	ctx->nameUsagesScanned = true;
+
+	Scanner scanner;
+	initScanner(&scanner, ctx->source, ctx->scanner->end - ctx->source);
+
+	Token previous;
+	previous.type = TOKEN_EOF;
+	for (;;) {
+		Token token = scanToken(&scanner);
+		if (token.type == TOKEN_EOF) break;
+
+		if (token.type == TOKEN_IDENTIFIER) {
+			if (previous.type == TOKEN_VAR || previous.type == TOKEN_FUN || previous.type == TOKEN_CLASS) {
+				addNameUsage(ctx, &token)->declarations++;
+			}
+		} else if (token.type == TOKEN_IMPORT) {
+			ctx->importsModules = true;
+		} else if (token.type == TOKEN_EQUAL && previous.type == TOKEN_IDENTIFIER) {
+			// Also catches property assignments; being conservative is fine.
+			addNameUsage(ctx, &previous)->assigned = true;
+		}
+		previous = token;
+	}
+}
+
+// Returns true if the function body only computes an expression from its parameters.
+static bool isInlinable(ObjFunction* function) {
+	if (function->upvalueCount > 0) return false;
+
+	Chunk* chunk = &function->chunk;
+	int depth = 0; // Number of values pushed on top of the arguments.
+	int maxDepth = 0;
+	for (int offset = 0; offset < chunk->count;) {
+		uint8_t instruction = chunk->code[offset];
+		switch (instruction) {
+			case OP_CONSTANT:
+			case OP_GET_GLOBAL:
+				depth++;
+				offset += 2;
+				break;
+			case OP_GET_LOCAL: {
+				// Slot 0 is reserved for VM.
+				uint8_t slot = chunk->code[offset + 1];
+				if (slot == 0 || slot > function->arity) return false;
+				depth++;
+				offset += 2;
+				break;
+			}
+			case OP_GET_PROPERTY:
+				offset += 2;
+				break;
+			case OP_NIL:
+			case OP_TRUE:
+			case OP_FALSE:
+				depth++;
+				offset += 1;
+				break;
+			case OP_EQUAL:
+			case OP_GREATER:
+			case OP_LESS:
+			case OP_ADD:
+			case OP_ADD_NUMBER:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+				depth--;
+				offset += 1;
+				break;
+			case OP_ADD_PROFILED:
+				depth--;
+				offset += 3;
+				break;
+			case OP_NOT:
+			case OP_NEGATE:
+				offset += 1;
+				break;
+			case OP_RETURN:
+				// Everything after the first return is unreachable as there is no jump.
+				return depth == 1 && offset <= INLINE_THRESHOLD && maxDepth + function->arity <= UINT8_MAX;
+			default:
+				return false;
+		}
+		if (depth > maxDepth) maxDepth = depth;
+	}
+	return false;
+}
+
+static void addInlineCandidate(Context* ctx, Token* name, ObjFunction* function) {
+	if (!isInlinable(function)) return;
+
+	if (!ctx->nameUsagesScanned) scanNameUsages(ctx);
+	if (ctx->importsModules || ctx->vm->compilingModule) return;
+	NameUsage* usage = addNameUsage(ctx, name);
+	if (usage->declarations == 1 && !usage->assigned) {
+		usage->inlineFunction = function;
+	}
+}
+
+static ObjFunction* findInlineFunction(Context* ctx, Token* name) {
+	if (ctx->nameUsageCount == 0) return NULL;
+	NameUsage* usage = findNameUsage(ctx->nameUsages, ctx->nameUsageCapacity, name->start, name->length);
+	return usage->start != NULL ? usage->inlineFunction : NULL;
+}
+
+// Count arguments of a call without consuming tokens. Current token should be '('.
+static int countArguments(Context* ctx) {
+	Scanner lookahead = *(ctx->scanner);
+	int depth = 1;
+	int commas = 0;
+	bool empty = true;
+	for (;;) {
+		Token token = scanToken(&lookahead);
+		switch (token.type) {
+			case TOKEN_LEFT_PAREN: depth++; break;
+			case TOKEN_RIGHT_PAREN:
+				if (--depth == 0) return empty ? 0 : commas + 1;
+				break;
+			case TOKEN_COMMA:
+				if (depth == 1) commas++;
+				break;
+			case TOKEN_EOF: return -1;
+			default: break;
+		}
+		empty = false;
+	}
+}
+
+static void inlineCall(Context* ctx, Token* name, ObjFunction* function) {
+	emitBytes(ctx, OP_GET_GLOBAL, identifierConstant(ctx, name));
+	consume(ctx, TOKEN_LEFT_PAREN, "Expect '(' before arguments.");
+	argumentList(ctx);
+	emitBytes(ctx, OP_CHECK_INLINED, makeConstant(ctx, OBJ_VAL(function)));
+	emitByte(ctx, (uint8_t)function->arity);
+	int callJump = emitJump(ctx, OP_JUMP_IF_FALSE);
+	emitByte(ctx, OP_POP);
+
+	// Copy the body with the line of the call site, so runtime errors point to the caller.
+	Chunk* chunk = &function->chunk;
+	int depth = 0;
+	for (int offset = 0; chunk->code[offset] != OP_RETURN;) {
+		uint8_t instruction = chunk->code[offset];
+		switch (instruction) {
+			case OP_CONSTANT:
+			case OP_GET_GLOBAL:
+			case OP_GET_PROPERTY: {
+				Value constant = chunk->constants.values[chunk->code[offset + 1]];
+				emitBytes(ctx, instruction, makeConstant(ctx, constant));
+				if (instruction != OP_GET_PROPERTY) depth++;
+				offset += 2;
+				break;
+			}
+			case OP_GET_LOCAL: {
+				uint8_t slot = chunk->code[offset + 1];
+				emitBytes(ctx, OP_PEEK, (uint8_t)(depth + function->arity - slot));
+				depth++;
+				offset += 2;
+				break;
+			}
+			case OP_NIL:
+			case OP_TRUE:
+			case OP_FALSE:
+				emitByte(ctx, instruction);
+				depth++;
+				offset += 1;
+				break;
+			case OP_NOT:
+			case OP_NEGATE:
+				emitByte(ctx, instruction);
+				offset += 1;
+				break;
+			case OP_ADD_PROFILED:
+				// Sites are indices into VM.recording, so the copy records into the same one.
+				emitByte(ctx, instruction);
+				emitBytes(ctx, chunk->code[offset + 1], chunk->code[offset + 2]);
+				depth--;
+				offset += 3;
+				break;
+			default:
+				// Binary operators. isInlinable() has filtered out anything else.
+				emitByte(ctx, instruction);
+				depth--;
+				offset += 1;
+				break;
+		}
+	}
+
+	// Drop the arguments and the callee beneath the result.
+	emitBytes(ctx, OP_POP_UNDER, (uint8_t)(function->arity + 1));
+	int endJump = emitJump(ctx, OP_JUMP);
+
+	patchJump(ctx, callJump);
+	emitByte(ctx, OP_POP);
+	emitBytes(ctx, OP_CALL, (uint8_t)function->arity);
+	patchJump(ctx, endJump);
+}
+
 // #todo: Support const var?
 static void namedVariable(Context* ctx, Token name, bool canAssign) {
 	uint8_t getOp, setOp;
@@ -518,6 +1025,11 @@ static void namedVariable(Context* ctx, Token name, bool canAssign) {
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
 	} else {
+		ObjFunction* inlined = findInlineFunction(ctx, &name);
+		if (inlined != NULL && check(ctx->parser, TOKEN_LEFT_PAREN) && countArguments(ctx) == inlined->arity) {
+			inlineCall(ctx, &name, inlined);
+			return;
+		}
 		arg = identifierConstant(ctx, &name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
@@ -620,6 +1132,7 @@ ParseRule rules[] = {
 	[TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_IMPORT]        = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
 	[TOKEN_OR]            = {NULL,     or_,    PREC_OR},
 	[TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
@@ -674,11 +1187,7 @@ static void block(Context* ctx) {
 	consume(ctx, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(Context* ctx, FunctionType type) {
-	Compiler compiler;
-	initCompiler(ctx, &compiler, type);
-	beginScope(&compiler);
-
+static void parameters(Context* ctx) {
 	consume(ctx, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 	if (!check(ctx->parser, TOKEN_RIGHT_PAREN)) {
 		do {
@@ -691,16 +1200,116 @@ static void function(Context* ctx, FunctionType type) {
 		} while (match(ctx, TOKEN_COMMA));
 	}
 	consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+}
+
+// Looks ahead from the first token of a function body without consuming it.
+static bool isShortBody(Context* ctx) {
+	Scanner lookahead = *(ctx->scanner);
+	const char* bodyStart = ctx->parser->previous.start;
+	Token token = ctx->parser->current;
+	int depth = 1;
+
+	for (;;) {
+		if (token.start - bodyStart >= LAZY_COMPILE_MIN_BODY) return false;
+		if (token.type == TOKEN_EOF) return true;
+		if (token.type == TOKEN_LEFT_BRACE) {
+			depth++;
+		} else if (token.type == TOKEN_RIGHT_BRACE && --depth == 0) {
+			return true;
+		}
+		token = scanToken(&lookahead);
+	}
+}
+
+// Consumes a function body without generating code.
+// Every name that resolves to a variable of an enclosing function is captured now,
+// because the enclosing compilers are gone when the body is compiled.
+// Names the body declares itself may be captured needlessly, which is harmless.
+static void skipBody(Context* ctx) {
+	Parser* parser = ctx->parser;
+	int depth = 1;
+
+	while (!check(parser, TOKEN_EOF)) {
+		Token* token = &(parser->current);
+		if (token->type == TOKEN_LEFT_BRACE) {
+			depth++;
+		} else if (token->type == TOKEN_RIGHT_BRACE) {
+			if (--depth == 0) break;
+		} else if (token->type == TOKEN_IDENTIFIER || token->type == TOKEN_THIS || token->type == TOKEN_SUPER) {
+			// Property names are not variables.
+			if (parser->previous.type != TOKEN_DOT && resolveLocal(parser, ctx->compiler, token) == -1) {
+				resolveUpvalue(parser, ctx->compiler, token);
+			}
+		}
+		advance(ctx);
+	}
+	consume(ctx, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static LazyFunction* newLazyFunction(Context* ctx, FunctionType type, const char* source, int line) {
+	Compiler* compiler = ctx->compiler;
+
+	LazyFunction* lazy = ALLOCATE(LazyFunction, 1);
+	lazy->source = source;
+	lazy->sourceEnd = ctx->scanner->end;
+	lazy->sourceStart = ctx->sourceStart;
+	lazy->sourceHash = ctx->sourceHash;
+	lazy->line = line;
+	lazy->type = type;
+	lazy->inClass = ctx->currentClass != NULL;
+	lazy->hasSuperclass = ctx->currentClass != NULL && ctx->currentClass->hasSuperclass;
+	lazy->upvalueCount = 0;
+	lazy->upvalueNames = ALLOCATE(Token, compiler->function->upvalueCount);
+	for (int i = 0; i < compiler->function->upvalueCount; ++i) {
+		lazy->upvalueNames[i] = compiler->upvalues[i].name;
+	}
+	lazy->upvalueCount = compiler->function->upvalueCount;
+	return lazy;
+}
+
+void freeLazyFunction(LazyFunction* lazy) {
+	if (lazy == NULL) return;
+	FREE_ARRAY(Token, lazy->upvalueNames, lazy->upvalueCount);
+	FREE(LazyFunction, lazy);
+}
+
+static ObjFunction* function(Context* ctx, FunctionType type) {
+	Compiler compiler;
+	initCompiler(ctx, &compiler, type, NULL);
+	beginScope(&compiler);
+
+	const char* source = ctx->parser->current.start;
+	int line = ctx->parser->current.line;
+	// Functions called in the profiled run are compiled now, so they don't stall the first call.
+	bool hot = false;
+	if (ctx->vm->profile != NULL || ctx->vm->recording != NULL) {
+		uint64_t key = sourceKey(ctx, source);
+		hot = ctx->vm->profile != NULL && profileCount(ctx->vm->profile, key) > 0;
+		if (ctx->vm->recording != NULL) {
+			compiler.function->profileSite = profileSite(ctx->vm->recording, key);
+		}
+	}
+	parameters(ctx);
 	consume(ctx, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-	block(ctx);
 
-	ObjFunction* fun = endCompiler(ctx);
+	ObjFunction* fun = NULL;
+	if (ctx->vm->lazyCompile && !hot && !isShortBody(ctx)) {
+		// Short bodies are compiled anyway so the inliner can still see them.
+		skipBody(ctx);
+		fun = compiler.function;
+		fun->lazy = newLazyFunction(ctx, type, source, line);
+		leaveCompiler(ctx);
+	} else {
+		block(ctx);
+		fun = endCompiler(ctx);
+	}
 	emitBytes(ctx, OP_CLOSURE, makeConstant(ctx, OBJ_VAL(fun)));
 
 	for (int i = 0; i < fun->upvalueCount; ++i) {
 		emitByte(ctx, compiler.upvalues[i].isLocal ? 1 : 0);
 		emitByte(ctx, compiler.upvalues[i].index);
 	}
+	return fun;
 }
 
 static void method(Context* ctx) {
@@ -765,9 +1374,14 @@ static void classDeclaration(Context* ctx) {
 
 static void funDeclaration(Context* ctx) {
 	uint8_t global = parseVariable(ctx, "Expect function name.");
+	Token name = ctx->parser->previous;
 	markInitialized(ctx->compiler);
-	function(ctx, TYPE_FUNCTION);
+	ObjFunction* fun = function(ctx, TYPE_FUNCTION);
 	defineVariable(ctx, global);
+
+	if (ctx->compiler->type == TYPE_SCRIPT && ctx->compiler->scopeDepth == 0) {
+		addInlineCandidate(ctx, &name, fun);
+	}
 }
 
 static void varDeclaration(Context* ctx) {
@@ -860,6 +1474,15 @@ static void printStatement(Context* ctx) {
 	emitByte(ctx, OP_PRINT);
 }
 
+static void importStatement(Context* ctx) {
+	consume(ctx, TOKEN_STRING, "Expect module path after 'import'.");
+	Token path = ctx->parser->previous;
+	uint8_t constant = makeConstant(ctx, OBJ_VAL(copyString(ctx->vm, path.start + 1, path.length - 2)));
+	consume(ctx, TOKEN_SEMICOLON, "Expect ';' after module path.");
+	emitBytes(ctx, OP_IMPORT, constant);
+	emitByte(ctx, OP_POP);
+}
+
 static void returnStatement(Context* ctx) {
 	if (ctx->compiler->type == TYPE_SCRIPT) {
 		error(ctx->parser, "Can't return from top-level code.");
@@ -906,6 +1529,7 @@ static void synchronize(Context* ctx) {
 			case TOKEN_WHILE:
 			case TOKEN_PRINT:
 			case TOKEN_RETURN:
+			case TOKEN_IMPORT:
 				return;
 			default:
 				; // Do nothing
@@ -938,6 +1562,8 @@ static void statement(Context* ctx) {
 		ifStatement(ctx);
 	} else if (match(ctx, TOKEN_RETURN)) {
 		returnStatement(ctx);
+	} else if (match(ctx, TOKEN_IMPORT)) {
+		importStatement(ctx);
 	} else if (match(ctx, TOKEN_WHILE)) {
 		whileStatement(ctx);
 	} else if (match(ctx, TOKEN_LEFT_BRACE)) {
@@ -949,25 +1575,47 @@ static void statement(Context* ctx) {
 	}
 }
 
+static void initContext(Context* ctx, VM* vm, Scanner* scanner, Parser* parser, const char* source) {
+	parser->hadError = false;
+	parser->panicMode = false;
+
+	ctx->scanner = scanner;
+	ctx->scanThread = NULL;
+	ctx->vm = vm;
+	ctx->parser = parser;
+	ctx->currentClass = NULL;
+	ctx->source = source;
+	ctx->nameUsages = NULL;
+	ctx->nameUsageCount = 0;
+	ctx->nameUsageCapacity = 0;
+	ctx->nameUsagesScanned = false;
+	ctx->importsModules = false;
+	ctx->sourceStart = source;
+	ctx->sourceHash = 0;
+	// A little trick to initialize ctx->compiler
+	// 1. Initialize later than ctx->vm
+	// 2. This null will be assigned to ctx->compiler->enclosing immediately
+	// 3. Then initCompiler() assigns the first compiler to ctx->compiler
+	ctx->compiler = NULL;
+}
+
 ObjFunction* compile(VM* vm, const char* source) {
 	Parser parser;
 
+	size_t length = strlen(source);
 	Scanner scanner;
-	initScanner(&scanner, source);
-
-	parser.hadError = false;
-	parser.panicMode = false;
+	initScanner(&scanner, source, length);
 
 	Context ctx;
-	ctx.scanner = &scanner;
-	ctx.vm = vm;
-	ctx.parser = &parser;
-	ctx.currentClass = NULL;
-	// A little trick to initialize ctx.compiler
-	// 1. Initialize later than ctx.vm
-	ctx.compiler = NULL; // 2. This null will be assigned to ctx->compiler->enclosing immediately
-	Compiler compiler; // 3. This object will be assigned to ctx->compiler immediately
-	initCompiler(&ctx, &compiler, TYPE_SCRIPT);
+	initContext(&ctx, vm, &scanner, &parser, source);
+	if (vm->profile != NULL || vm->recording != NULL) {
+		ctx.sourceHash = hashBytes(source, length);
+	}
+	if (vm->scanThread && length >= SCAN_THREAD_MIN_SOURCE) {
+		ctx.scanThread = startScanThread(source, length);
+	}
+	Compiler compiler;
+	initCompiler(&ctx, &compiler, TYPE_SCRIPT, NULL);
 	// ctx.currentChunk is also initialized in initCompiler().
 
 	advance(&ctx);
@@ -977,9 +1625,59 @@ ObjFunction* compile(VM* vm, const char* source) {
 	}
 
 	ObjFunction* function = endCompiler(&ctx);
+	FREE_ARRAY(NameUsage, ctx.nameUsages, ctx.nameUsageCapacity);
+	if (ctx.scanThread != NULL) {
+		stopScanThread(ctx.scanThread);
+	}
 	return parser.hadError ? NULL : function;
 }
 
+bool compileLazyFunction(VM* vm, ObjFunction* function) {
+	LazyFunction* lazy = function->lazy;
+
+	Parser parser;
+
+	Scanner scanner;
+	initScanner(&scanner, lazy->source, lazy->sourceEnd - lazy->source);
+	scanner.line = lazy->line;
+
+	Context ctx;
+	initContext(&ctx, vm, &scanner, &parser, lazy->source);
+	ctx.sourceStart = lazy->sourceStart;
+	ctx.sourceHash = lazy->sourceHash;
+
+	// Only whether there's a class (and a superclass) matters to the body.
+	ClassCompiler classCompiler;
+	if (lazy->inClass) {
+		classCompiler.enclosing = NULL;
+		classCompiler.hasSuperclass = lazy->hasSuperclass;
+		ctx.currentClass = &classCompiler;
+	}
+
+	Compiler compiler;
+	initCompiler(&ctx, &compiler, lazy->type, function);
+	compiler.lazy = true;
+	for (int i = 0; i < lazy->upvalueCount; ++i) {
+		compiler.upvalues[i].name = lazy->upvalueNames[i];
+	}
+	beginScope(&compiler);
+
+	advance(&ctx);
+	function->arity = 0; // Counted again by parameters()
+	parameters(&ctx);
+	consume(&ctx, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	block(&ctx);
+	endCompiler(&ctx);
+
+	if (parser.hadError) {
+		freeChunk(&function->chunk);
+		return false;
+	}
+	function->lazy = NULL;
+	freeLazyFunction(lazy);
+	return true;
+}
+
 void markCompilerRoots() {
 	Compiler* compiler = g_currentCompiler;
 	VM* vm = g_vm;
@@ -1,7 +1,16 @@
 #pragma once
 
+#include "common.h"
+CPLUSPLUS_BEGIN
+
 #include "object.h"
 #include "vm.h"
 
 ObjFunction* compile(VM* vm, const char* source);
+// Compiles the body of a function declared while vm->lazyCompile is on.
+// Returns false and leaves the function lazy if the body has a compile error.
+bool compileLazyFunction(VM* vm, ObjFunction* function);
+void freeLazyFunction(LazyFunction* lazy);
 void markCompilerRoots();
+
+CPLUSPLUS_END
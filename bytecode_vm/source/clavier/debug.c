@@ -31,6 +31,12 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 2;
 }
 
+static int shortInstruction(const char* name, Chunk* chunk, int offset) {
+	uint16_t operand = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	printf("%-16s %4d\n", name, operand);
+	return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= chunk->code[offset + 2];
@@ -48,10 +54,11 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 int disassembleInstruction(Chunk* chunk, int offset) {
 	printf("%04d ", offset);
 
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	int line = getLine(chunk, offset);
+	if (offset > 0 && line == getLine(chunk, offset - 1)) {
 		printf("   | ");
 	} else {
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	uint8_t instruction = chunk->code[offset];
@@ -144,6 +151,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 			return simpleInstruction("OP_INHERIT", offset);
 		case OP_METHOD:
 			return constantInstruction("OP_METHOD", chunk, offset);
+		case OP_PEEK:
+			return byteInstruction("OP_PEEK", chunk, offset);
+		case OP_POP_UNDER:
+			return byteInstruction("OP_POP_UNDER", chunk, offset);
+		case OP_IMPORT:
+			return constantInstruction("OP_IMPORT", chunk, offset);
+		case OP_ADD_NUMBER:
+			return simpleInstruction("OP_ADD_NUMBER", offset);
+		case OP_ADD_PROFILED:
+			return shortInstruction("OP_ADD_PROFILED", chunk, offset);
+		case OP_CHECK_INLINED:
+			return invokeInstruction("OP_CHECK_INLINED", chunk, offset);
 		default:
 			printf("Unknown opcode %d\n", instruction);
 			return offset + 1;
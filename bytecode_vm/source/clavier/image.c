@@ -0,0 +1,1366 @@
+#include "image.h"
+#include "compiler.h"
+#include "memory.h"
+#include "regex.h"
+#include "table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Layout of an image. Offsets are from the start of the file.
+//   ImageHeader
+//   ImageFunction[functionCount]
+//   ImageString[stringCount]
+//   ImageObject[objectCount]
+//   String chars, then constants, line table and code of each function
+//   Values of each object
+//   ImageValue[globalCount * 2] (name and value pairs)
+// In a script image, function 0 is the script and there are no objects or globals.
+// A snapshot has no script. Everything in it is reached from its globals.
+// Numbers are in the byte order of the machine that wrote the image.
+
+#define IMAGE_MAGIC   "LBC\x1a"
+// Bump when the opcodes or the layout change.
+#define IMAGE_VERSION 9
+// Build settings an image depends on. A VM only loads images written by the same configuration.
+#define IMAGE_CONFIG  ((uint32_t)NAN_BOXING | ((uint32_t)sizeof(void*) << 8))
+
+typedef enum {
+	IMAGE_SCRIPT,
+	IMAGE_SNAPSHOT,
+} ImageKind;
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t config;
+	uint32_t size; // Size of the whole image in bytes.
+	uint64_t checksum; // hashBytes() of everything after the header.
+	uint64_t sourceHash; // hashBytes() of the source. 0 if unknown.
+	uint32_t kind; // ImageKind
+	uint32_t functionCount;
+	uint32_t functionsOffset;
+	uint32_t stringCount;
+	uint32_t stringsOffset;
+	uint32_t objectCount;
+	uint32_t objectsOffset;
+	uint32_t globalCount;
+	uint32_t globalsOffset;
+} ImageHeader;
+
+typedef struct {
+	int32_t arity;
+	int32_t upvalueCount;
+	int32_t name; // String index, -1 for the script.
+	uint32_t codeOffset;
+	uint32_t codeCount;
+	uint32_t linesOffset; // LineStart[lineCount]
+	uint32_t lineCount;
+	uint32_t constantsOffset; // ImageValue[constantCount]
+	uint32_t constantCount;
+} ImageFunction;
+
+typedef struct {
+	uint32_t offset; // chars followed by '\0'
+	uint32_t length;
+} ImageString;
+
+typedef enum {
+	VALUE_NIL,
+	VALUE_FALSE,
+	VALUE_TRUE,
+	VALUE_NUMBER,
+	VALUE_STRING,
+	VALUE_FUNCTION,
+	VALUE_OBJECT,
+	VALUE_SHORT_STRING,
+} ImageValueType;
+
+typedef struct {
+	uint32_t type; // ImageValueType
+	uint32_t index; // String, function or object index, or the length of a short string
+	union {
+		double number;
+		char chars[8]; // Characters of a short string
+	};
+} ImageValue;
+
+// Objects other than strings and functions. The fields used depend on the type:
+//   OBJ_BOUND_METHOD  values: receiver, method closure
+//   OBJ_CLASS         index: name string, values: method name and closure pairs
+//   OBJ_CLOSURE       index: function, values: upvalues
+//   OBJ_INSTANCE      values: class, then field name and value pairs
+//   OBJ_NATIVE        index: name string. Relinked to the VM's native of that name on load.
+//   OBJ_REGEX         index: pattern string. Compiled again on load.
+//   OBJ_UPVALUE       values: closed value
+typedef struct {
+	uint32_t type; // ObjType
+	uint32_t index;
+	uint32_t valuesOffset; // ImageValue[valueCount]
+	uint32_t valueCount;
+} ImageObject;
+
+typedef struct LoadedImage {
+	struct LoadedImage* next;
+	const uint8_t* bytes;
+	size_t size;
+} LoadedImage;
+
+// Hashes 8 bytes at a time. Only used to tell contents apart, not for hash tables.
+uint64_t hashBytes(const void* data, size_t length) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint64_t hash = 14695981039346656037u ^ length;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+		hash ^= hash >> 32;
+	}
+	for (; i < length; ++i) {
+		hash = (hash ^ bytes[i]) * 1099511628211u;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53u;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Writer //
+
+typedef struct {
+	Obj* object;
+	int index;
+} ObjectSlot;
+
+// Object -> index. Open addressing, capacity is a power of 2.
+typedef struct {
+	int count;
+	int capacity;
+	ObjectSlot* slots;
+} ObjectIndex;
+
+typedef struct {
+	int count;
+	int capacity;
+	Obj** items;
+} ObjectList;
+
+typedef struct {
+	VM* vm;
+
+	uint8_t* bytes;
+	size_t count;
+	size_t capacity;
+
+	// Everything to write, in the order found. An object's index is its position in its list.
+	ObjectList functions;
+	ObjectList strings;
+	ObjectList objects; // Any other type
+	ObjectIndex indices;
+} ImageWriter;
+
+static ObjectSlot* findObjectSlot(ObjectSlot* slots, int capacity, Obj* object) {
+	uint32_t index = (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) & (capacity - 1);
+	while (slots[index].object != NULL && slots[index].object != object) {
+		index = (index + 1) & (capacity - 1);
+	}
+	return &slots[index];
+}
+
+static int findIndex(ImageWriter* writer, Obj* object) {
+	ObjectIndex* indices = &writer->indices;
+	if (indices->capacity == 0) return -1;
+	ObjectSlot* slot = findObjectSlot(indices->slots, indices->capacity, object);
+	return slot->object != NULL ? slot->index : -1;
+}
+
+// Appends the object to the list and records its index.
+static void addToList(ImageWriter* writer, ObjectList* list, Obj* object) {
+	if (list->capacity < list->count + 1) {
+		int oldCapacity = list->capacity;
+		list->capacity = GROW_CAPACITY(oldCapacity);
+		list->items = GROW_ARRAY(Obj*, list->items, oldCapacity, list->capacity);
+	}
+	list->items[list->count++] = object;
+
+	ObjectIndex* indices = &writer->indices;
+	// Keep the load factor at most 0.5.
+	if (indices->capacity < (indices->count + 1) * 2) {
+		int capacity = GROW_CAPACITY(indices->capacity);
+		ObjectSlot* slots = ALLOCATE(ObjectSlot, capacity);
+		for (int i = 0; i < capacity; ++i) {
+			slots[i].object = NULL;
+		}
+		for (int i = 0; i < indices->capacity; ++i) {
+			if (indices->slots[i].object == NULL) continue;
+			*findObjectSlot(slots, capacity, indices->slots[i].object) = indices->slots[i];
+		}
+		FREE_ARRAY(ObjectSlot, indices->slots, indices->capacity);
+		indices->slots = slots;
+		indices->capacity = capacity;
+	}
+	ObjectSlot* slot = findObjectSlot(indices->slots, indices->capacity, object);
+	slot->object = object;
+	slot->index = list->count - 1;
+	indices->count++;
+}
+
+static void initWriter(ImageWriter* writer, VM* vm) {
+	writer->vm = vm;
+	writer->bytes = NULL;
+	writer->count = 0;
+	writer->capacity = 0;
+	ObjectList empty = { 0, 0, NULL };
+	writer->functions = empty;
+	writer->strings = empty;
+	writer->objects = empty;
+	writer->indices.count = 0;
+	writer->indices.capacity = 0;
+	writer->indices.slots = NULL;
+}
+
+static void freeWriter(ImageWriter* writer) {
+	FREE_ARRAY(uint8_t, writer->bytes, writer->capacity);
+	FREE_ARRAY(Obj*, writer->functions.items, writer->functions.capacity);
+	FREE_ARRAY(Obj*, writer->strings.items, writer->strings.capacity);
+	FREE_ARRAY(Obj*, writer->objects.items, writer->objects.capacity);
+	FREE_ARRAY(ObjectSlot, writer->indices.slots, writer->indices.capacity);
+}
+
+// Appends zeroed bytes and returns their offset.
+static size_t reserve(ImageWriter* writer, size_t size, size_t alignment) {
+	size_t offset = (writer->count + alignment - 1) & ~(alignment - 1);
+	if (writer->capacity < offset + size) {
+		size_t oldCapacity = writer->capacity;
+		size_t capacity = oldCapacity;
+		while (capacity < offset + size) {
+			capacity = GROW_CAPACITY(capacity);
+		}
+		writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, capacity);
+		writer->capacity = capacity;
+	}
+	memset(writer->bytes + writer->count, 0, offset + size - writer->count);
+	writer->count = offset + size;
+	return offset;
+}
+
+static void addString(ImageWriter* writer, ObjString* string) {
+	if (findIndex(writer, (Obj*)string) == -1) {
+		addToList(writer, &writer->strings, (Obj*)string);
+	}
+}
+
+static bool addValue(ImageWriter* writer, Value value);
+
+// Adds the function and, depth first, the functions in its constants.
+static bool addFunction(ImageWriter* writer, ObjFunction* function) {
+	if (findIndex(writer, (Obj*)function) != -1) return true;
+
+	if (function->lazy != NULL && !compileLazyFunction(writer->vm, function)) {
+		fprintf_s(stderr, "Could not compile function '%s'.\n", function->name->chars);
+		return false;
+	}
+	addToList(writer, &writer->functions, (Obj*)function);
+	if (function->name != NULL) addString(writer, function->name);
+
+	ValueArray* constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; ++i) {
+		if (!addValue(writer, constants->values[i])) return false;
+	}
+	return true;
+}
+
+static bool addValue(ImageWriter* writer, Value value) {
+	if (!IS_OBJ(value)) return true;
+
+	Obj* object = AS_OBJ(value);
+	switch (object->type) {
+		case OBJ_ROPE:
+			// Images have no ropes. writeImageValue() writes the flattened string instead.
+			addString(writer, flattenRope(writer->vm, (ObjRope*)object));
+			return true;
+		case OBJ_STRING:
+			addString(writer, (ObjString*)object);
+			return true;
+		case OBJ_READER:
+			return true; // Written as nil. See writeImageValue().
+		case OBJ_MAPPED_STRING:
+		case OBJ_STRING_VIEW:
+			// Written and loaded like other strings.
+			if (findIndex(writer, object) == -1) {
+				addToList(writer, &writer->strings, object);
+			}
+			return true;
+		case OBJ_FUNCTION:
+			return addFunction(writer, (ObjFunction*)object);
+		default:
+			// Visited later by addObjects(), so long chains of objects don't recurse.
+			if (findIndex(writer, object) == -1) {
+				addToList(writer, &writer->objects, object);
+			}
+			return true;
+	}
+}
+
+static bool addTable(ImageWriter* writer, Table* table) {
+	for (int i = 0; i < table->capacity; ++i) {
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
+		addString(writer, entry->key);
+		if (!addValue(writer, entry->value)) return false;
+	}
+	return true;
+}
+
+// Adds what the objects found so far refer to, until nothing new is found.
+static bool addObjects(ImageWriter* writer) {
+	for (int i = 0; i < writer->objects.count; ++i) {
+		Obj* object = writer->objects.items[i];
+		bool added = true;
+		switch (object->type) {
+			case OBJ_BOUND_METHOD: {
+				ObjBoundMethod* bound = (ObjBoundMethod*)object;
+				added = addValue(writer, bound->receiver) && addValue(writer, OBJ_VAL(bound->method));
+				break;
+			}
+			case OBJ_CLASS: {
+				ObjClass* klass = (ObjClass*)object;
+				addString(writer, klass->name);
+				added = addTable(writer, &klass->methods);
+				break;
+			}
+			case OBJ_CLOSURE: {
+				ObjClosure* closure = (ObjClosure*)object;
+				added = addFunction(writer, closure->function);
+				for (int k = 0; added && k < closure->upvalueCount; ++k) {
+					added = addValue(writer, OBJ_VAL(closure->upvalues[k]));
+				}
+				break;
+			}
+			case OBJ_INSTANCE: {
+				ObjInstance* instance = (ObjInstance*)object;
+				added = addValue(writer, OBJ_VAL(instance->klass)) && addTable(writer, &instance->fields);
+				break;
+			}
+			case OBJ_NATIVE:
+				addString(writer, ((ObjNative*)object)->name);
+				break;
+			case OBJ_REGEX:
+				addString(writer, ((ObjRegex*)object)->pattern);
+				break;
+			case OBJ_UPVALUE:
+				added = addValue(writer, *((ObjUpvalue*)object)->location);
+				break;
+			default:
+				break; // Strings and functions are in their own lists.
+		}
+		if (!added) return false;
+	}
+	return true;
+}
+
+static int liveEntryCount(Table* table) {
+	int count = 0;
+	for (int i = 0; i < table->capacity; ++i) {
+		if (table->entries[i].key != NULL) count++;
+	}
+	return count;
+}
+
+static void writeImageValue(ImageWriter* writer, size_t offset, int index, Value value) {
+	ImageValue* entry = (ImageValue*)(writer->bytes + offset) + index;
+	// Open files don't outlive the process.
+	if (IS_NIL(value) || IS_READER(value)) {
+		entry->type = VALUE_NIL;
+	} else if (IS_BOOL(value)) {
+		entry->type = AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE;
+	} else if (IS_NUMBER(value)) {
+		entry->type = VALUE_NUMBER;
+		entry->number = AS_NUMBER(value);
+	} else if (IS_SHORT_STRING(value)) {
+		entry->type = VALUE_SHORT_STRING;
+		entry->index = (uint32_t)shortStringChars(value, entry->chars);
+	} else {
+		if (IS_ROPE(value)) value = OBJ_VAL(AS_ROPE(value)->string);
+		ObjType type = OBJ_TYPE(value);
+		bool isString = type == OBJ_STRING || type == OBJ_MAPPED_STRING || type == OBJ_STRING_VIEW;
+		entry->type = isString ? VALUE_STRING : type == OBJ_FUNCTION ? VALUE_FUNCTION : VALUE_OBJECT;
+		entry->index = (uint32_t)findIndex(writer, AS_OBJ(value));
+	}
+}
+
+// Writes the live entries as name and value pairs, from the index-th value on.
+static void writeTable(ImageWriter* writer, size_t offset, int index, Table* table) {
+	for (int i = 0; i < table->capacity; ++i) {
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
+		writeImageValue(writer, offset, index++, OBJ_VAL(entry->key));
+		writeImageValue(writer, offset, index++, entry->value);
+	}
+}
+
+static size_t reserveValues(ImageWriter* writer, int count) {
+	return reserve(writer, sizeof(ImageValue) * count, 8);
+}
+
+static void writeImageObject(ImageWriter* writer, size_t objectsOffset, int i) {
+	Obj* object = writer->objects.items[i];
+	uint32_t index = 0;
+	size_t offset = 0;
+	int count = 0;
+
+	switch (object->type) {
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod* bound = (ObjBoundMethod*)object;
+			count = 2;
+			offset = reserveValues(writer, count);
+			writeImageValue(writer, offset, 0, bound->receiver);
+			writeImageValue(writer, offset, 1, OBJ_VAL(bound->method));
+			break;
+		}
+		case OBJ_CLASS: {
+			ObjClass* klass = (ObjClass*)object;
+			index = (uint32_t)findIndex(writer, (Obj*)klass->name);
+			count = liveEntryCount(&klass->methods) * 2;
+			offset = reserveValues(writer, count);
+			writeTable(writer, offset, 0, &klass->methods);
+			break;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			index = (uint32_t)findIndex(writer, (Obj*)closure->function);
+			count = closure->upvalueCount;
+			offset = reserveValues(writer, count);
+			for (int k = 0; k < count; ++k) {
+				writeImageValue(writer, offset, k, OBJ_VAL(closure->upvalues[k]));
+			}
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance* instance = (ObjInstance*)object;
+			count = 1 + liveEntryCount(&instance->fields) * 2;
+			offset = reserveValues(writer, count);
+			writeImageValue(writer, offset, 0, OBJ_VAL(instance->klass));
+			writeTable(writer, offset, 1, &instance->fields);
+			break;
+		}
+		case OBJ_NATIVE:
+			index = (uint32_t)findIndex(writer, (Obj*)((ObjNative*)object)->name);
+			break;
+		case OBJ_REGEX:
+			index = (uint32_t)findIndex(writer, (Obj*)((ObjRegex*)object)->pattern);
+			break;
+		case OBJ_UPVALUE:
+			count = 1;
+			offset = reserveValues(writer, count);
+			writeImageValue(writer, offset, 0, *((ObjUpvalue*)object)->location);
+			break;
+		default:
+			break;
+	}
+
+	ImageObject* entry = (ImageObject*)(writer->bytes + objectsOffset) + i;
+	entry->type = (uint32_t)object->type;
+	entry->index = index;
+	entry->valuesOffset = (uint32_t)offset;
+	entry->valueCount = (uint32_t)count;
+}
+
+// Lays out everything added to the writer. Returns false if the image would be too large.
+static bool layoutImage(ImageWriter* writer, ImageKind kind, uint64_t sourceHash, Table* globals) {
+	// reserve() may move the buffer, so pointers into it are taken after each call.
+	size_t headerOffset = reserve(writer, sizeof(ImageHeader), 8);
+	size_t functionsOffset = reserve(writer, sizeof(ImageFunction) * writer->functions.count, 8);
+	size_t stringsOffset = reserve(writer, sizeof(ImageString) * writer->strings.count, 8);
+	size_t objectsOffset = reserve(writer, sizeof(ImageObject) * writer->objects.count, 8);
+
+	for (int i = 0; i < writer->strings.count; ++i) {
+		Obj* string = writer->strings.items[i];
+		const char* chars;
+		size_t length;
+		if (string->type == OBJ_STRING) {
+			chars = ((ObjString*)string)->chars;
+			length = (size_t)((ObjString*)string)->length;
+		} else if (string->type == OBJ_MAPPED_STRING) {
+			chars = ((ObjMappedString*)string)->chars;
+			length = ((ObjMappedString*)string)->length;
+		} else {
+			chars = ((ObjStringView*)string)->chars;
+			length = ((ObjStringView*)string)->length;
+		}
+		if (length > INT32_MAX - 1) {
+			fprintf_s(stderr, "Image is too large.\n");
+			return false;
+		}
+		// reserve() zeroes the terminating null.
+		size_t offset = reserve(writer, length + 1, 1);
+		memcpy_s(writer->bytes + offset, length, chars, length);
+
+		ImageString* entry = (ImageString*)(writer->bytes + stringsOffset) + i;
+		entry->offset = (uint32_t)offset;
+		entry->length = (uint32_t)length;
+	}
+
+	for (int i = 0; i < writer->functions.count; ++i) {
+		ObjFunction* function = (ObjFunction*)writer->functions.items[i];
+		Chunk* chunk = &function->chunk;
+
+		size_t constantsOffset = reserveValues(writer, chunk->constants.count);
+		for (int k = 0; k < chunk->constants.count; ++k) {
+			writeImageValue(writer, constantsOffset, k, chunk->constants.values[k]);
+		}
+
+		size_t linesOffset = reserve(writer, sizeof(LineStart) * chunk->lineCount, 4);
+		memcpy_s(writer->bytes + linesOffset, sizeof(LineStart) * chunk->lineCount, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+		size_t codeOffset = reserve(writer, chunk->count, 1);
+		memcpy_s(writer->bytes + codeOffset, chunk->count, chunk->code, chunk->count);
+
+		ImageFunction* entry = (ImageFunction*)(writer->bytes + functionsOffset) + i;
+		entry->arity = function->arity;
+		entry->upvalueCount = function->upvalueCount;
+		entry->name = function->name != NULL ? findIndex(writer, (Obj*)function->name) : -1;
+		entry->codeOffset = (uint32_t)codeOffset;
+		entry->codeCount = (uint32_t)chunk->count;
+		entry->linesOffset = (uint32_t)linesOffset;
+		entry->lineCount = (uint32_t)chunk->lineCount;
+		entry->constantsOffset = (uint32_t)constantsOffset;
+		entry->constantCount = (uint32_t)chunk->constants.count;
+	}
+
+	for (int i = 0; i < writer->objects.count; ++i) {
+		writeImageObject(writer, objectsOffset, i);
+	}
+
+	int globalCount = globals != NULL ? liveEntryCount(globals) : 0;
+	size_t globalsOffset = reserveValues(writer, globalCount * 2);
+	if (globals != NULL) {
+		writeTable(writer, globalsOffset, 0, globals);
+	}
+
+	if (writer->count > UINT32_MAX) {
+		fprintf_s(stderr, "Image is too large.\n");
+		return false;
+	}
+
+	ImageHeader* header = (ImageHeader*)(writer->bytes + headerOffset);
+	memcpy_s(header->magic, sizeof(header->magic), IMAGE_MAGIC, sizeof(header->magic));
+	header->version = IMAGE_VERSION;
+	header->config = IMAGE_CONFIG;
+	header->size = (uint32_t)writer->count;
+	header->sourceHash = sourceHash;
+	header->kind = kind;
+	header->functionCount = (uint32_t)writer->functions.count;
+	header->functionsOffset = (uint32_t)functionsOffset;
+	header->stringCount = (uint32_t)writer->strings.count;
+	header->stringsOffset = (uint32_t)stringsOffset;
+	header->objectCount = (uint32_t)writer->objects.count;
+	header->objectsOffset = (uint32_t)objectsOffset;
+	header->globalCount = (uint32_t)globalCount;
+	header->globalsOffset = (uint32_t)globalsOffset;
+	header->checksum = hashBytes(writer->bytes + sizeof(ImageHeader), writer->count - sizeof(ImageHeader));
+	return true;
+}
+
+static bool writeFile(const char* path, const uint8_t* bytes, size_t size) {
+	FILE* file;
+	if (fopen_s(&file, path, "wb") != 0) return false;
+	size_t written = fwrite(bytes, 1, size, file);
+	bool closed = fclose(file) == 0;
+	return written == size && closed;
+}
+
+// Returns false if the image can't be built. I/O errors are returned in written.
+static bool writeImageFile(VM* vm, ObjFunction* script, uint64_t sourceHash, const char* path, bool* written) {
+	push(vm, OBJ_VAL(script)); // Compiling lazy functions and growing the buffer may trigger GC.
+
+	ImageWriter writer;
+	initWriter(&writer, vm);
+	bool built = addFunction(&writer, script) && layoutImage(&writer, IMAGE_SCRIPT, sourceHash, NULL);
+	*written = built && writeFile(path, writer.bytes, writer.count);
+	freeWriter(&writer);
+
+	pop(vm);
+	return built;
+}
+
+bool writeImage(VM* vm, ObjFunction* script, const char* path) {
+	bool written;
+	if (!writeImageFile(vm, script, 0, path, &written)) return false;
+	if (!written) {
+		fprintf_s(stderr, "Could not write file \"%s\".\n", path);
+	}
+	return written;
+}
+
+bool writeSnapshot(VM* vm, const char* path) {
+	ImageWriter writer;
+	initWriter(&writer, vm);
+	bool built = addTable(&writer, &vm->globals) && addObjects(&writer)
+		&& layoutImage(&writer, IMAGE_SNAPSHOT, 0, &vm->globals);
+	bool written = built && writeFile(path, writer.bytes, writer.count);
+	if (built && !written) {
+		fprintf_s(stderr, "Could not write file \"%s\".\n", path);
+	}
+	freeWriter(&writer);
+	return written;
+}
+
+// Loader //
+
+const uint8_t* mapFile(const char* path, size_t* size) {
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return NULL;
+	// The view keeps the mapping alive.
+	const uint8_t* bytes = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	*size = (size_t)fileSize.QuadPart;
+	return bytes;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat status;
+	if (fstat(fd, &status) != 0 || status.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	void* bytes = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (bytes == MAP_FAILED) return NULL;
+	*size = (size_t)status.st_size;
+	return (const uint8_t*)bytes;
+#endif
+}
+
+void unmapFile(const uint8_t* bytes, size_t size) {
+#if defined(_WIN32)
+	UnmapViewOfFile(bytes);
+#else
+	munmap((void*)bytes, size);
+#endif
+}
+
+static bool inBounds(size_t size, uint32_t offset, uint64_t length) {
+	return offset <= size && length <= size - offset;
+}
+
+static bool validValue(const ImageHeader* header, const ImageValue* value) {
+	switch (value->type) {
+		case VALUE_NIL:
+		case VALUE_FALSE:
+		case VALUE_TRUE:
+		case VALUE_NUMBER:
+			return true;
+		case VALUE_STRING: return value->index < header->stringCount;
+		// Builds without NaN boxing can't load them.
+		case VALUE_SHORT_STRING: return FITS_SHORT_STRING(value->index);
+		case VALUE_FUNCTION: return value->index < header->functionCount;
+		case VALUE_OBJECT: return value->index < header->objectCount;
+		default:
+			return false;
+	}
+}
+
+static bool isObject(const ImageHeader* header, const ImageObject* objects, const ImageValue* value, ObjType type) {
+	return value->type == VALUE_OBJECT && value->index < header->objectCount && objects[value->index].type == (uint32_t)type;
+}
+
+// Name and value pairs. Values of methods are closures.
+static bool validPairs(const ImageHeader* header, const ImageObject* objects, const ImageValue* pairs, uint32_t count, bool methods) {
+	if (count % 2 != 0) return false;
+	for (uint32_t i = 0; i < count; i += 2) {
+		if (pairs[i].type != VALUE_STRING || pairs[i].index >= header->stringCount) return false;
+		bool valid = methods ? isObject(header, objects, &pairs[i + 1], OBJ_CLOSURE) : validValue(header, &pairs[i + 1]);
+		if (!valid) return false;
+	}
+	return true;
+}
+
+// What an instruction of an image's function reads and where it goes on. See decodeInstruction().
+typedef struct {
+	uint32_t length;
+	int pops;   // Values it takes from the stack. peek() and slots count too, so the stack must hold that many.
+	int pushes; // Values it leaves in their place.
+	int slot;   // Highest local slot it reads or captures. -1 if none.
+	bool jumps; // May continue at target.
+	int64_t target;
+	bool next;  // May continue at the next instruction.
+} ImageInstruction;
+
+static bool isConstant(const ImageFunction* function, const ImageValue* constants, uint8_t index, ImageValueType type) {
+	return index < function->constantCount && constants[index].type == (uint32_t)type;
+}
+
+// Decodes the instruction at offset, checking its operands as far as they don't depend on the stack.
+// Returns false if it's not an instruction the compiler makes, or it doesn't fit in the code.
+static bool decodeInstruction(const uint8_t* bytes, const ImageFunction* functions, const ImageFunction* function,
+		uint32_t offset, ImageInstruction* instruction) {
+	const uint8_t* code = bytes + function->codeOffset + offset;
+	const ImageValue* constants = (const ImageValue*)(bytes + function->constantsOffset);
+	uint32_t available = function->codeCount - offset;
+
+	instruction->length = 1;
+	instruction->pops = 0;
+	instruction->pushes = 0;
+	instruction->slot = -1;
+	instruction->jumps = false;
+	instruction->next = true;
+	switch (code[0]) {
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_ADD_PROFILED:
+		case OP_CHECK_INLINED:
+			instruction->length = 3;
+			break;
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_CALL:
+		case OP_CLOSURE:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_PEEK:
+		case OP_POP_UNDER:
+		case OP_IMPORT:
+			instruction->length = 2;
+			break;
+	}
+	if (available < instruction->length) return false;
+
+	switch (code[0]) {
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+			instruction->pushes = 1;
+			return true;
+		case OP_CONSTANT:
+			instruction->pushes = 1;
+			return code[1] < function->constantCount;
+		case OP_POP:
+		case OP_PRINT:
+		case OP_CLOSE_UPVALUE:
+			instruction->pops = 1;
+			return true;
+		case OP_GET_LOCAL:
+			instruction->pushes = 1;
+			instruction->slot = code[1];
+			return true;
+		case OP_SET_LOCAL:
+			instruction->pops = instruction->pushes = 1;
+			instruction->slot = code[1];
+			return true;
+		case OP_GET_GLOBAL:
+		case OP_CLASS:
+		case OP_IMPORT:
+			instruction->pushes = 1;
+			return isConstant(function, constants, code[1], VALUE_STRING);
+		case OP_DEFINE_GLOBAL:
+			instruction->pops = 1;
+			return isConstant(function, constants, code[1], VALUE_STRING);
+		case OP_SET_GLOBAL:
+		case OP_GET_PROPERTY:
+			instruction->pops = instruction->pushes = 1;
+			return isConstant(function, constants, code[1], VALUE_STRING);
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_METHOD:
+			instruction->pops = 2;
+			instruction->pushes = 1;
+			return isConstant(function, constants, code[1], VALUE_STRING);
+		case OP_GET_UPVALUE:
+			instruction->pushes = 1;
+			return code[1] < function->upvalueCount;
+		case OP_SET_UPVALUE:
+			instruction->pops = instruction->pushes = 1;
+			return code[1] < function->upvalueCount;
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_INHERIT:
+		case OP_ADD_NUMBER:
+		case OP_ADD_PROFILED: // Its profile entry is checked when it runs.
+			instruction->pops = 2;
+			instruction->pushes = 1;
+			return true;
+		case OP_NOT:
+		case OP_NEGATE:
+			instruction->pops = instruction->pushes = 1;
+			return true;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP: {
+			int jump = (code[1] << 8) | code[2];
+			instruction->jumps = true;
+			instruction->target = (int64_t)offset + 3 + (code[0] == OP_LOOP ? -jump : jump);
+			instruction->next = code[0] == OP_JUMP_IF_FALSE;
+			instruction->pops = instruction->pushes = code[0] == OP_JUMP_IF_FALSE ? 1 : 0;
+			return true;
+		}
+		case OP_CALL:
+			instruction->pops = code[1] + 1;
+			instruction->pushes = 1;
+			return true;
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+			// The receiver and arguments, and the superclass on top of them.
+			instruction->pops = code[2] + (code[0] == OP_SUPER_INVOKE ? 2 : 1);
+			instruction->pushes = 1;
+			return isConstant(function, constants, code[1], VALUE_STRING);
+		case OP_CLOSURE: {
+			if (!isConstant(function, constants, code[1], VALUE_FUNCTION)) return false;
+			const ImageFunction* closed = &functions[constants[code[1]].index];
+			instruction->length += 2 * (uint32_t)closed->upvalueCount;
+			if (available < instruction->length) return false;
+			instruction->pushes = 1;
+			for (int i = 0; i < closed->upvalueCount; ++i) {
+				uint8_t isLocal = code[2 + 2 * i];
+				uint8_t index = code[3 + 2 * i];
+				if (isLocal > 1 || (!isLocal && index >= function->upvalueCount)) return false;
+				if (isLocal && index > instruction->slot) instruction->slot = index;
+			}
+			return true;
+		}
+		case OP_RETURN:
+			instruction->pops = 1;
+			instruction->next = false;
+			return true;
+		case OP_PEEK:
+			instruction->pops = code[1] + 1;
+			instruction->pushes = code[1] + 2;
+			return true;
+		case OP_POP_UNDER:
+			instruction->pops = code[1] + 1;
+			instruction->pushes = 1;
+			return true;
+		case OP_CHECK_INLINED:
+			// Reads the callee beneath the arguments, and pushes the result on top of them.
+			instruction->pops = code[2] + 1;
+			instruction->pushes = code[2] + 2;
+			return isConstant(function, constants, code[1], VALUE_FUNCTION);
+		default:
+			return false;
+	}
+}
+
+// Checks the code of a function of an image as the compiler would have made it. Every instruction is whole,
+// the constants and upvalues it names exist, and its jumps land on instructions. Along every path from the start,
+// the stack has the same number of values at each instruction, which never pops or reads a local slot beyond
+// the values the function has pushed on top of its arguments.
+static bool validCode(const uint8_t* bytes, const ImageFunction* functions, const ImageFunction* function) {
+	// Stack depth at each offset. -2 if no instruction starts there, -1 if it's not reached yet.
+	// Not allocated by reallocate(), as validating creates no objects and GC has no reason to run.
+	int* depths = (int*)malloc(sizeof(int) * function->codeCount);
+	uint32_t* worklist = (uint32_t*)malloc(sizeof(uint32_t) * function->codeCount);
+	if (depths == NULL || worklist == NULL) exit(1); // Out of Memory
+
+	bool valid = true;
+	for (uint32_t offset = 0; offset < function->codeCount; ++offset) {
+		depths[offset] = -2;
+	}
+	ImageInstruction instruction;
+	for (uint32_t offset = 0; valid && offset < function->codeCount; offset += instruction.length) {
+		valid = decodeInstruction(bytes, functions, function, offset, &instruction);
+		depths[offset] = -1;
+	}
+
+	// The frame starts with the callee and the arguments.
+	int worklistCount = 0;
+	if (valid) {
+		depths[0] = function->arity + 1;
+		worklist[worklistCount++] = 0;
+	}
+	while (valid && worklistCount > 0) {
+		uint32_t offset = worklist[--worklistCount];
+		int depth = depths[offset];
+		decodeInstruction(bytes, functions, function, offset, &instruction);
+		// No frame can hold more values than the whole stack.
+		int nextDepth = depth - instruction.pops + instruction.pushes;
+		if (instruction.pops > depth || instruction.slot >= depth || nextDepth > STACK_MAX) {
+			valid = false;
+			break;
+		}
+
+		int64_t successors[2];
+		int successorCount = 0;
+		if (instruction.next) successors[successorCount++] = (int64_t)offset + instruction.length;
+		if (instruction.jumps) successors[successorCount++] = instruction.target;
+		for (int i = 0; i < successorCount && valid; ++i) {
+			int64_t successor = successors[i];
+			// Running off the end of the code or into the middle of an instruction.
+			if (successor < 0 || successor >= function->codeCount || depths[successor] == -2) {
+				valid = false;
+			} else if (depths[successor] == -1) {
+				depths[successor] = nextDepth;
+				worklist[worklistCount++] = (uint32_t)successor;
+			} else {
+				valid = depths[successor] == nextDepth;
+			}
+		}
+	}
+
+	free(depths);
+	free(worklist);
+	return valid;
+}
+
+// Checks everything loadMappedImage() and running the code rely on. Returns NULL if the image is valid.
+// What the code assumes about the types of the values on the stack is left to the checks of run() in vm.c,
+// where there are any, as for the compiler's output.
+static const char* validateImage(const uint8_t* bytes, size_t size, ImageKind kind) {
+	const ImageHeader* header = (const ImageHeader*)bytes;
+	if (size < sizeof(ImageHeader) || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+		return "not a bytecode image";
+	}
+	if (header->version != IMAGE_VERSION) return "written by a different version";
+	if (header->config != IMAGE_CONFIG) return "written by a different build configuration";
+
+	const char* corrupt = "truncated or corrupt";
+	if (header->size != size) return corrupt;
+	if (hashBytes(bytes + sizeof(ImageHeader), size - sizeof(ImageHeader)) != header->checksum) return corrupt;
+	if (header->kind != kind) return kind == IMAGE_SCRIPT ? "a heap snapshot, not a script" : "not a heap snapshot";
+
+	uint32_t offsets = header->functionsOffset | header->stringsOffset | header->objectsOffset | header->globalsOffset;
+	if ((offsets & 7) != 0) return corrupt;
+	if (!inBounds(size, header->functionsOffset, (uint64_t)sizeof(ImageFunction) * header->functionCount)) return corrupt;
+	if (!inBounds(size, header->stringsOffset, (uint64_t)sizeof(ImageString) * header->stringCount)) return corrupt;
+	if (!inBounds(size, header->objectsOffset, (uint64_t)sizeof(ImageObject) * header->objectCount)) return corrupt;
+	if (!inBounds(size, header->globalsOffset, (uint64_t)sizeof(ImageValue) * 2 * header->globalCount)) return corrupt;
+
+	const ImageFunction* functions = (const ImageFunction*)(bytes + header->functionsOffset);
+	if (kind == IMAGE_SCRIPT) {
+		if (header->functionCount == 0 || header->objectCount != 0 || header->globalCount != 0) return corrupt;
+		if (functions[0].arity != 0 || functions[0].upvalueCount != 0 || functions[0].name != -1) return corrupt;
+	}
+
+	const ImageString* strings = (const ImageString*)(bytes + header->stringsOffset);
+	for (uint32_t i = 0; i < header->stringCount; ++i) {
+		if (strings[i].length > INT32_MAX - 1) return corrupt;
+		if (!inBounds(size, strings[i].offset, (uint64_t)strings[i].length + 1)) return corrupt;
+		if (bytes[strings[i].offset + strings[i].length] != '\0') return corrupt;
+	}
+
+	for (uint32_t i = 0; i < header->functionCount; ++i) {
+		const ImageFunction* function = &functions[i];
+		if (function->arity < 0 || function->arity > UINT8_MAX) return corrupt;
+		if (function->upvalueCount < 0 || function->upvalueCount > UINT8_MAX) return corrupt;
+		if (function->name < -1 || function->name >= (int64_t)header->stringCount) return corrupt;
+		if (function->codeCount == 0 || function->codeCount > INT32_MAX) return corrupt;
+		if (!inBounds(size, function->codeOffset, function->codeCount)) return corrupt;
+		if ((function->linesOffset & 3) != 0 || function->lineCount > INT32_MAX) return corrupt;
+		if (!inBounds(size, function->linesOffset, (uint64_t)sizeof(LineStart) * function->lineCount)) return corrupt;
+		if ((function->constantsOffset & 7) != 0 || function->constantCount > UINT8_COUNT) return corrupt;
+		if (!inBounds(size, function->constantsOffset, (uint64_t)sizeof(ImageValue) * function->constantCount)) return corrupt;
+
+		const ImageValue* constants = (const ImageValue*)(bytes + function->constantsOffset);
+		for (uint32_t k = 0; k < function->constantCount; ++k) {
+			if (!validValue(header, &constants[k]) || constants[k].type == VALUE_OBJECT) return corrupt;
+			// The script is never a constant.
+			if (kind == IMAGE_SCRIPT && constants[k].type == VALUE_FUNCTION && constants[k].index == 0) return corrupt;
+		}
+	}
+	// Only after every function is checked, as closures read the upvalue counts of the functions they close.
+	for (uint32_t i = 0; i < header->functionCount; ++i) {
+		if (!validCode(bytes, functions, &functions[i])) return corrupt;
+	}
+
+	const ImageObject* objects = (const ImageObject*)(bytes + header->objectsOffset);
+	for (uint32_t i = 0; i < header->objectCount; ++i) {
+		const ImageObject* object = &objects[i];
+		if ((object->valuesOffset & 7) != 0) return corrupt;
+		if (!inBounds(size, object->valuesOffset, (uint64_t)sizeof(ImageValue) * object->valueCount)) return corrupt;
+
+		const ImageValue* values = (const ImageValue*)(bytes + object->valuesOffset);
+		bool valid = false;
+		switch (object->type) {
+			case OBJ_BOUND_METHOD:
+				valid = object->valueCount == 2 && validValue(header, &values[0])
+					&& isObject(header, objects, &values[1], OBJ_CLOSURE);
+				break;
+			case OBJ_CLASS:
+				valid = object->index < header->stringCount && validPairs(header, objects, values, object->valueCount, true);
+				break;
+			case OBJ_CLOSURE:
+				valid = object->index < header->functionCount
+					&& object->valueCount == (uint32_t)functions[object->index].upvalueCount;
+				for (uint32_t k = 0; valid && k < object->valueCount; ++k) {
+					valid = isObject(header, objects, &values[k], OBJ_UPVALUE);
+				}
+				break;
+			case OBJ_INSTANCE:
+				valid = object->valueCount >= 1 && isObject(header, objects, &values[0], OBJ_CLASS)
+					&& validPairs(header, objects, values + 1, object->valueCount - 1, false);
+				break;
+			case OBJ_NATIVE:
+				valid = object->index < header->stringCount && object->valueCount == 0;
+				break;
+			case OBJ_REGEX: {
+				// createObject() relies on the pattern compiling.
+				valid = object->index < header->stringCount && object->valueCount == 0;
+				const char* error;
+				Regex* regex = valid ? compileRegex((const char*)(bytes + strings[object->index].offset), strings[object->index].length, &error) : NULL;
+				valid = regex != NULL;
+				freeRegex(regex);
+				break;
+			}
+			case OBJ_UPVALUE:
+				valid = object->valueCount == 1 && validValue(header, &values[0]);
+				break;
+		}
+		if (!valid) return corrupt;
+	}
+
+	const ImageValue* globals = (const ImageValue*)(bytes + header->globalsOffset);
+	if (!validPairs(header, objects, globals, header->globalCount * 2, false)) return corrupt;
+	return NULL;
+}
+
+typedef struct {
+	VM* vm;
+	const uint8_t* bytes;
+	// Objects created so far, by index.
+	ObjString** strings;
+	ObjFunction** functions;
+	Obj** objects;
+	// Keeps the created objects reachable until they refer to each other.
+	// GC marks the constants of a function like any other, so a function on the stack holds them.
+	ObjFunction* holder;
+} ImageLoader;
+
+static void hold(ImageLoader* loader, Obj* object) {
+	addConstant(loader->vm, &loader->holder->chunk, OBJ_VAL(object));
+}
+
+static const ImageValue* valuesAt(ImageLoader* loader, uint32_t offset) {
+	return (const ImageValue*)(loader->bytes + offset);
+}
+
+// Every object is created before any is linked, so this doesn't allocate.
+static Value loadValue(ImageLoader* loader, const ImageValue* value) {
+	switch (value->type) {
+		case VALUE_FALSE: return BOOL_VAL(false);
+		case VALUE_TRUE: return BOOL_VAL(true);
+		case VALUE_NUMBER: return NUMBER_VAL(value->number);
+		case VALUE_STRING: return OBJ_VAL(loader->strings[value->index]);
+		case VALUE_SHORT_STRING: return shortStringVal(value->chars, (int)value->index);
+		case VALUE_FUNCTION: return OBJ_VAL(loader->functions[value->index]);
+		case VALUE_OBJECT: return OBJ_VAL(loader->objects[value->index]);
+		default:
+			return NIL_VAL;
+	}
+}
+
+static void loadTable(ImageLoader* loader, Table* table, const ImageValue* pairs, uint32_t count) {
+	for (uint32_t i = 0; i < count; i += 2) {
+		tableSet(table, AS_STRING(loadValue(loader, &pairs[i])), loadValue(loader, &pairs[i + 1]));
+	}
+}
+
+static void loadFunction(ImageLoader* loader, ObjFunction* function, const ImageFunction* image) {
+	function->arity = image->arity;
+	function->upvalueCount = image->upvalueCount;
+	function->name = image->name >= 0 ? loader->strings[image->name] : NULL;
+
+	// The code and line table are used in place from the read-only mapping.
+	// A capacity of 0 tells freeChunk() that the chunk doesn't own them.
+	Chunk* chunk = &function->chunk;
+	chunk->code = (uint8_t*)(loader->bytes + image->codeOffset);
+	chunk->count = (int)image->codeCount;
+	chunk->lines = (LineStart*)(loader->bytes + image->linesOffset);
+	chunk->lineCount = (int)image->lineCount;
+
+	int constantCount = (int)image->constantCount;
+	Value* values = ALLOCATE(Value, constantCount);
+	const ImageValue* constants = valuesAt(loader, image->constantsOffset);
+	for (int i = 0; i < constantCount; ++i) {
+		values[i] = loadValue(loader, &constants[i]);
+	}
+	chunk->constants.values = values;
+	chunk->constants.capacity = constantCount;
+	chunk->constants.count = constantCount;
+}
+
+// Creates the object with its references left empty. linkObject() fills them in.
+static Obj* createObject(ImageLoader* loader, const ImageObject* image) {
+	VM* vm = loader->vm;
+	switch (image->type) {
+		case OBJ_BOUND_METHOD: return (Obj*)newBoundMethod(vm, NIL_VAL, NULL);
+		case OBJ_CLASS: return (Obj*)newClass(vm, loader->strings[image->index]);
+		case OBJ_CLOSURE: return (Obj*)newClosure(vm, loader->functions[image->index]);
+		case OBJ_INSTANCE: return (Obj*)newInstance(vm, NULL);
+		case OBJ_REGEX: {
+			ObjString* pattern = loader->strings[image->index];
+			const char* error;
+			return (Obj*)newRegex(vm, pattern, compileRegex(pattern->chars, (size_t)pattern->length, &error));
+		}
+		case OBJ_NATIVE: {
+			Value native = NIL_VAL;
+			tableGet(&vm->natives, loader->strings[image->index], &native);
+			return AS_OBJ(native);
+		}
+		case OBJ_UPVALUE: {
+			ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+			upvalue->location = &upvalue->closed;
+			return (Obj*)upvalue;
+		}
+		default:
+			return NULL;
+	}
+}
+
+static void linkObject(ImageLoader* loader, Obj* object, const ImageObject* image) {
+	const ImageValue* values = valuesAt(loader, image->valuesOffset);
+	switch (image->type) {
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod* bound = (ObjBoundMethod*)object;
+			bound->receiver = loadValue(loader, &values[0]);
+			bound->method = (ObjClosure*)loader->objects[values[1].index];
+			break;
+		}
+		case OBJ_CLASS:
+			loadTable(loader, &((ObjClass*)object)->methods, values, image->valueCount);
+			break;
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			for (uint32_t i = 0; i < image->valueCount; ++i) {
+				closure->upvalues[i] = (ObjUpvalue*)loader->objects[values[i].index];
+			}
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance* instance = (ObjInstance*)object;
+			instance->klass = (ObjClass*)loader->objects[values[0].index];
+			loadTable(loader, &instance->fields, values + 1, image->valueCount - 1);
+			break;
+		}
+		case OBJ_UPVALUE:
+			((ObjUpvalue*)object)->closed = loadValue(loader, &values[0]);
+			break;
+		default:
+			break; // Natives belong to the VM.
+	}
+}
+
+// Creates the objects of a validated image. The VM keeps the mapping from now on.
+// Sets script for a script image and the globals for a snapshot.
+// Returns false if the image refers to a native the VM doesn't have.
+static bool loadMappedImage(VM* vm, const uint8_t* bytes, size_t size, ObjFunction** script) {
+	LoadedImage* image = ALLOCATE(LoadedImage, 1);
+	image->bytes = bytes;
+	image->size = size;
+	image->next = vm->images;
+	vm->images = image;
+
+	const ImageHeader* header = (const ImageHeader*)bytes;
+	const ImageFunction* functions = (const ImageFunction*)(bytes + header->functionsOffset);
+	const ImageString* strings = (const ImageString*)(bytes + header->stringsOffset);
+	const ImageObject* objects = (const ImageObject*)(bytes + header->objectsOffset);
+
+	ImageLoader loader;
+	loader.vm = vm;
+	loader.bytes = bytes;
+	loader.strings = ALLOCATE(ObjString*, header->stringCount);
+	loader.functions = ALLOCATE(ObjFunction*, header->functionCount);
+	loader.objects = ALLOCATE(Obj*, header->objectCount);
+	loader.holder = newFunction(vm);
+	push(vm, OBJ_VAL(loader.holder));
+
+	for (uint32_t i = 0; i < header->stringCount; ++i) {
+		loader.strings[i] = copyString(vm, (const char*)(bytes + strings[i].offset), (int)strings[i].length);
+		hold(&loader, (Obj*)loader.strings[i]);
+	}
+
+	bool loaded = true;
+	for (uint32_t i = 0; i < header->objectCount; ++i) {
+		Value native;
+		if (objects[i].type == OBJ_NATIVE && !tableGet(&vm->natives, loader.strings[objects[i].index], &native)) {
+			fprintf_s(stderr, "Native '%s' is not defined.\n", loader.strings[objects[i].index]->chars);
+			loaded = false;
+			break;
+		}
+	}
+
+	if (loaded) {
+		for (uint32_t i = 0; i < header->functionCount; ++i) {
+			loader.functions[i] = newFunction(vm);
+			hold(&loader, (Obj*)loader.functions[i]);
+		}
+		for (uint32_t i = 0; i < header->functionCount; ++i) {
+			loadFunction(&loader, loader.functions[i], &functions[i]);
+		}
+		for (uint32_t i = 0; i < header->objectCount; ++i) {
+			loader.objects[i] = createObject(&loader, &objects[i]);
+			hold(&loader, loader.objects[i]);
+		}
+		for (uint32_t i = 0; i < header->objectCount; ++i) {
+			linkObject(&loader, loader.objects[i], &objects[i]);
+		}
+
+		if (header->kind == IMAGE_SCRIPT) {
+			*script = loader.functions[0];
+		} else {
+			loadTable(&loader, &vm->globals, valuesAt(&loader, header->globalsOffset), header->globalCount * 2);
+		}
+	}
+
+	pop(vm);
+	FREE_ARRAY(ObjString*, loader.strings, header->stringCount);
+	FREE_ARRAY(ObjFunction*, loader.functions, header->functionCount);
+	FREE_ARRAY(Obj*, loader.objects, header->objectCount);
+	return loaded;
+}
+
+// Maps and validates the image. Returns NULL and reports the error to stderr if it's not usable.
+static const uint8_t* mapImage(const char* path, ImageKind kind, size_t* size) {
+	const uint8_t* bytes = mapFile(path, size);
+	if (bytes == NULL) {
+		fprintf_s(stderr, "Could not open image \"%s\".\n", path);
+		return NULL;
+	}
+	const char* problem = validateImage(bytes, *size, kind);
+	if (problem != NULL) {
+		fprintf_s(stderr, "Could not load image \"%s\": %s.\n", path, problem);
+		unmapFile(bytes, *size);
+		return NULL;
+	}
+	return bytes;
+}
+
+ObjFunction* loadImage(VM* vm, const char* path) {
+	size_t size = 0;
+	const uint8_t* bytes = mapImage(path, IMAGE_SCRIPT, &size);
+	if (bytes == NULL) return NULL;
+
+	ObjFunction* script = NULL;
+	loadMappedImage(vm, bytes, size, &script);
+	return script;
+}
+
+bool loadSnapshot(VM* vm, const char* path) {
+	size_t size = 0;
+	const uint8_t* bytes = mapImage(path, IMAGE_SNAPSHOT, &size);
+	if (bytes == NULL) return false;
+
+	return loadMappedImage(vm, bytes, size, NULL);
+}
+
+// Compilation cache //
+
+// Returns "<directory>/<key>.lbc". Free it with FREE_ARRAY(char, path, strlen(path) + 1).
+static char* cachePath(VM* vm, const char* directory, uint64_t sourceHash) {
+	// Builds that can't load each other's images use different entries, so they don't keep replacing them.
+	uint64_t key = sourceHash ^ ((uint64_t)IMAGE_VERSION << 48) ^ ((uint64_t)IMAGE_CONFIG << 32);
+	// A source compiled as a module has no inlined calls, unlike the same source compiled as a script.
+	if (vm->compilingModule) key = ~key;
+	size_t length = strlen(directory) + 1 + 16 + 4;
+	char* path = ALLOCATE(char, length + 1);
+	snprintf(path, length + 1, "%s/%016llx.lbc", directory, (unsigned long long)key);
+	return path;
+}
+
+static bool replaceFile(const char* from, const char* to) {
+#if defined(_WIN32)
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+ObjFunction* loadCachedScript(VM* vm, const char* directory, const char* source) {
+	uint64_t sourceHash = hashBytes(source, strlen(source));
+	char* path = cachePath(vm, directory, sourceHash);
+	size_t size = 0;
+	const uint8_t* bytes = mapFile(path, &size);
+	FREE_ARRAY(char, path, strlen(path) + 1);
+	if (bytes == NULL) return NULL;
+
+	// A stale or corrupt entry is a miss. storeCachedScript() replaces it.
+	if (validateImage(bytes, size, IMAGE_SCRIPT) != NULL || ((const ImageHeader*)bytes)->sourceHash != sourceHash) {
+		unmapFile(bytes, size);
+		return NULL;
+	}
+	ObjFunction* script = NULL;
+	loadMappedImage(vm, bytes, size, &script);
+	return script;
+}
+
+// Numbers the temporary files of this process, as VMs on different threads may store the same entry at once.
+#if defined(_WIN32)
+static volatile LONG temporaryCount = 0;
+#define NEXT_TEMPORARY() ((unsigned long)InterlockedIncrement(&temporaryCount))
+#else
+static _Atomic unsigned long temporaryCount = 0;
+#define NEXT_TEMPORARY() (atomic_fetch_add(&temporaryCount, 1) + 1)
+#endif
+
+void storeCachedScript(VM* vm, const char* directory, const char* source, ObjFunction* script) {
+	uint64_t sourceHash = hashBytes(source, strlen(source));
+	char* path = cachePath(vm, directory, sourceHash);
+
+	// Write a file of our own and rename it over the entry,
+	// so other writers see either the old entry or the complete new one.
+	size_t length = strlen(path) + 48;
+	char* temporary = ALLOCATE(char, length);
+#if defined(_WIN32)
+	unsigned long processId = (unsigned long)_getpid();
+#else
+	unsigned long processId = (unsigned long)getpid();
+#endif
+	snprintf(temporary, length, "%s.%lu.%lu.tmp", path, processId, NEXT_TEMPORARY());
+
+	bool written;
+	writeImageFile(vm, script, sourceHash, temporary, &written);
+	if (!written || !replaceFile(temporary, path)) {
+		remove(temporary);
+	}
+
+	FREE_ARRAY(char, temporary, length);
+	FREE_ARRAY(char, path, strlen(path) + 1);
+}
+
+void freeImages(VM* vm) {
+	LoadedImage* image = vm->images;
+	while (image != NULL) {
+		LoadedImage* next = image->next;
+		unmapFile(image->bytes, image->size);
+		FREE(LoadedImage, image);
+		image = next;
+	}
+	vm->images = NULL;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+CPLUSPLUS_BEGIN
+
+#include "object.h"
+#include "vm.h"
+
+// A bytecode image holds a compiled script and every function it refers to:
+// code, line tables, constants and the strings they use.
+// Code and line tables are used in place from a read-only mapping of the file,
+// so processes running the same image share those pages.
+// An image only loads into a VM built with the same configuration (see IMAGE_CONFIG in image.c).
+// Loading checks the code's operands, jumps and stack depths, but not the types of the values
+// some instructions take from the stack (a class for OP_INHERIT, for example), so load trusted images only.
+
+// Writes the script to path. Lazy functions are compiled first.
+// Returns false and reports the error to stderr on failure.
+bool writeImage(VM* vm, ObjFunction* script, const char* path);
+// Maps the image and returns its script function. The mapping is kept until freeVM().
+// Returns NULL and reports the error to stderr if the image can't be loaded.
+ObjFunction* loadImage(VM* vm, const char* path);
+
+// A heap snapshot holds the globals and everything reachable from them:
+// strings, functions, closures, classes, instances and bound methods.
+// Natives are stored by name and relinked to the natives of the loading VM.
+// Readers are stored as nil: open files don't outlive the process.
+
+// Writes the VM's globals to path.
+// Returns false and reports the error to stderr on failure.
+bool writeSnapshot(VM* vm, const char* path);
+// Maps the snapshot and sets its globals in the VM, replacing globals of the same name.
+// Returns false and reports the error to stderr if it can't be loaded.
+bool loadSnapshot(VM* vm, const char* path);
+
+// Compilation cache: images of compiled scripts in a directory, named by a hash of the source and the build.
+// The directory must exist. Entries are written atomically and checked on load,
+// so processes can share a directory.
+
+// Returns the script compiled from source, or NULL on a miss. Stale and corrupt entries are misses.
+ObjFunction* loadCachedScript(VM* vm, const char* directory, const char* source);
+// Stores the script compiled from source. If it can't be written, the entry stays missing.
+void storeCachedScript(VM* vm, const char* directory, const char* source, ObjFunction* script);
+
+// 64-bit hash of the bytes. Used for checksums, and to identify sources in the cache and in profiles.
+uint64_t hashBytes(const void* data, size_t length);
+
+// Maps the whole file read-only. Returns NULL if it's empty or can't be mapped.
+// Used for images, and by readFile() for large files.
+const uint8_t* mapFile(const char* path, size_t* size);
+void unmapFile(const uint8_t* bytes, size_t size);
+
+// Unmaps every image loaded into the VM. Called by freeVM() after all objects are freed.
+void freeImages(VM* vm);
+
+CPLUSPLUS_END
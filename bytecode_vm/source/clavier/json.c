@@ -0,0 +1,706 @@
+#include "json.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "text.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Containers nested deeper are rejected, as are instances that refer to themselves.
+#define JSON_DEPTH_MAX 1000
+
+// Scratch buffers aren't managed by GC, so growing them never collects.
+static void* growBuffer(void* buffer, size_t size) {
+	void* result = realloc(buffer, size);
+	if (result == NULL) exit(1); // Out of Memory
+	return result;
+}
+
+// Tests 8 bytes at a time, as a word, whether any of them needs a closer look.
+// (x - 0x01..01) & ~x & 0x80..80 is nonzero if a byte of x is zero, and (x - 0x20..20) & ~x if one is below 0x20.
+#define ONES  0x0101010101010101u
+#define HIGHS 0x8080808080808080u
+
+static inline uint64_t zeroBytes(uint64_t word) {
+	return (word - ONES) & ~word & HIGHS;
+}
+
+// A quote, a backslash or a control character: what a string's characters can't be copied past.
+static inline bool hasEscapedByte(uint64_t word) {
+	return (zeroBytes(word ^ (ONES * '"')) | zeroBytes(word ^ (ONES * '\\')) | ((word - ONES * 0x20) & ~word & HIGHS)) != 0;
+}
+
+static inline bool isEscaped(unsigned char c) {
+	return c == '"' || c == '\\' || c < 0x20;
+}
+
+// Parser //
+
+// Keys and classes the parser makes, on the stack so GC doesn't collect them.
+enum {
+	SLOT_VALUE,
+	SLOT_NEXT,
+	SLOT_LENGTH,
+	SLOT_FIRST,
+	SLOT_PIECE,
+	SLOT_ARRAY,
+	SLOT_OBJECT
+};
+
+typedef struct {
+	VM* vm;
+	Text* text;
+	const char* current;
+	const char* end;
+	Value* slots;
+	// Characters of strings with escapes, decoded.
+	char* buffer;
+	size_t bufferCapacity;
+	// Set when parsing fails.
+	const char* error;
+	const char* errorAt;
+} Parser;
+
+static bool fail(Parser* parser, const char* at, const char* message) {
+	parser->error = message;
+	parser->errorAt = at;
+	return false;
+}
+
+static char* reserveBuffer(Parser* parser, size_t size) {
+	if (parser->bufferCapacity < size) {
+		size_t capacity = parser->bufferCapacity < 64 ? 64 : parser->bufferCapacity;
+		while (capacity < size) capacity *= 2;
+		parser->buffer = (char*)growBuffer(parser->buffer, capacity);
+		parser->bufferCapacity = capacity;
+	}
+	return parser->buffer;
+}
+
+static void skipWhitespace(Parser* parser) {
+	const char* chars = parser->current;
+	while (chars < parser->end && (*chars == ' ' || *chars == '\n' || *chars == '\r' || *chars == '\t')) ++chars;
+	parser->current = chars;
+}
+
+// Whether the next character is c, after whitespace. It's consumed if so.
+static bool consume(Parser* parser, char c) {
+	skipWhitespace(parser);
+	if (parser->current == parser->end || *parser->current != c) return false;
+	parser->current++;
+	return true;
+}
+
+static bool isDigit(const char* chars, const char* end) {
+	return chars < end && *chars >= '0' && *chars <= '9';
+}
+
+// Length of the UTF-8 sequence at chars, or 0 if it's invalid: cut short, overlong, a surrogate or above U+10FFFF.
+static int utf8Length(const unsigned char* chars, const unsigned char* end) {
+	unsigned char c = chars[0];
+	int length;
+	uint32_t code;
+	uint32_t min;
+	if (c < 0x80) return 1;
+	if (c >= 0xC2 && c <= 0xDF) {
+		length = 2; code = c & 0x1F; min = 0x80;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		length = 3; code = c & 0x0F; min = 0x800;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		length = 4; code = c & 0x07; min = 0x10000;
+	} else {
+		return 0;
+	}
+	if (end - chars < length) return 0;
+	for (int i = 1; i < length; ++i) {
+		if ((chars[i] & 0xC0) != 0x80) return 0;
+		code = code << 6 | (chars[i] & 0x3F);
+	}
+	if (code < min || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) return 0;
+	return length;
+}
+
+static int writeUtf8(uint32_t code, char* chars) {
+	if (code < 0x80) {
+		chars[0] = (char)code;
+		return 1;
+	}
+	if (code < 0x800) {
+		chars[0] = (char)(0xC0 | code >> 6);
+		chars[1] = (char)(0x80 | (code & 0x3F));
+		return 2;
+	}
+	if (code < 0x10000) {
+		chars[0] = (char)(0xE0 | code >> 12);
+		chars[1] = (char)(0x80 | (code >> 6 & 0x3F));
+		chars[2] = (char)(0x80 | (code & 0x3F));
+		return 3;
+	}
+	chars[0] = (char)(0xF0 | code >> 18);
+	chars[1] = (char)(0x80 | (code >> 12 & 0x3F));
+	chars[2] = (char)(0x80 | (code >> 6 & 0x3F));
+	chars[3] = (char)(0x80 | (code & 0x3F));
+	return 4;
+}
+
+// The 4 hex digits of a \u escape.
+static bool readHex(const char* chars, const char* end, uint32_t* code) {
+	if (end - chars < 4) return false;
+	*code = 0;
+	for (int i = 0; i < 4; ++i) {
+		char c = chars[i];
+		int digit;
+		if (c >= '0' && c <= '9') digit = c - '0';
+		else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+		else return false;
+		*code = *code << 4 | (uint32_t)digit;
+	}
+	return true;
+}
+
+// Finds the end of the string at the quote, and validates its characters but not its escapes.
+// Most characters are plain ASCII, so they're skipped a word at a time.
+static bool scanString(Parser* parser, const char** start, size_t* length, bool* escaped) {
+	const char* chars = parser->current + 1;
+	const char* end = parser->end;
+	*escaped = false;
+	for (;;) {
+		while (end - chars >= 8) {
+			uint64_t word;
+			memcpy(&word, chars, 8);
+			if (hasEscapedByte(word) || (word & HIGHS) != 0) break;
+			chars += 8;
+		}
+		if (chars == end) return fail(parser, parser->current, "Unterminated string");
+
+		unsigned char c = (unsigned char)*chars;
+		if (c == '"') break;
+		if (c == '\\') {
+			// The escaped character is checked by decodeString().
+			if (end - chars < 2) return fail(parser, parser->current, "Unterminated string");
+			*escaped = true;
+			chars += 2;
+		} else if (c < 0x20) {
+			return fail(parser, chars, "Control character in a string");
+		} else if (c >= 0x80) {
+			int sequence = utf8Length((const unsigned char*)chars, (const unsigned char*)end);
+			if (sequence == 0) return fail(parser, chars, "Invalid UTF-8");
+			chars += sequence;
+		} else {
+			++chars;
+		}
+	}
+
+	*start = parser->current + 1;
+	*length = (size_t)(chars - *start);
+	parser->current = chars + 1;
+	return true;
+}
+
+// Decodes the escapes of a scanned string to the parser's buffer. They never make it longer.
+static bool decodeString(Parser* parser, const char* chars, size_t length, size_t* decodedLength) {
+	char* decoded = reserveBuffer(parser, length);
+	char* out = decoded;
+	const char* end = chars + length;
+	while (chars < end) {
+		const char* escape = (const char*)memchr(chars, '\\', (size_t)(end - chars));
+		size_t run = (size_t)((escape != NULL ? escape : end) - chars);
+		memcpy(out, chars, run);
+		out += run;
+		if (escape == NULL) break;
+
+		// Scanned strings don't end with a lone backslash.
+		chars = escape + 2;
+		switch (escape[1]) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '/': *out++ = '/'; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				uint32_t code;
+				if (!readHex(chars, end, &code)) return fail(parser, escape, "Invalid \\u escape");
+				chars += 4;
+				if (code >= 0xDC00 && code <= 0xDFFF) return fail(parser, escape, "Unpaired surrogate");
+				if (code >= 0xD800 && code <= 0xDBFF) {
+					// A character above U+FFFF is escaped as a pair of surrogates.
+					uint32_t low;
+					if (end - chars < 2 || chars[0] != '\\' || chars[1] != 'u'
+						|| !readHex(chars + 2, end, &low) || low < 0xDC00 || low > 0xDFFF) {
+						return fail(parser, escape, "Unpaired surrogate");
+					}
+					chars += 6;
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+				}
+				out += writeUtf8(code, out);
+				break;
+			}
+			default:
+				return fail(parser, escape, "Invalid escape");
+		}
+	}
+	*decodedLength = (size_t)(out - decoded);
+	return true;
+}
+
+// Pushes the string value at the quote. Strings without escapes are sliced from the text.
+static bool parseString(Parser* parser) {
+	const char* at = parser->current;
+	const char* chars;
+	size_t length;
+	bool escaped;
+	if (!scanString(parser, &chars, &length, &escaped)) return false;
+	if (!escaped) {
+		if (length > INT_MAX) return fail(parser, at, "String is too long");
+		push(parser->vm, sliceText(parser->vm, parser->text, chars, length));
+		return true;
+	}
+
+	if (!decodeString(parser, chars, length, &length)) return false;
+	if (length > INT_MAX) return fail(parser, at, "String is too long");
+	push(parser->vm, stringValue(parser->vm, parser->buffer, (int)length));
+	return true;
+}
+
+// Pushes the member name at the quote, interned as field names are.
+static bool parseKey(Parser* parser) {
+	const char* at = parser->current;
+	const char* chars;
+	size_t length;
+	bool escaped;
+	if (!scanString(parser, &chars, &length, &escaped)) return false;
+	if (escaped) {
+		if (!decodeString(parser, chars, length, &length)) return false;
+		chars = parser->buffer;
+	}
+	if (length > INT_MAX) return fail(parser, at, "Member name is too long");
+	push(parser->vm, OBJ_VAL(copyString(parser->vm, chars, (int)length)));
+	return true;
+}
+
+static bool parseNumberValue(Parser* parser) {
+	const char* chars = parser->current;
+	const char* end = parser->end;
+	bool negative = *chars == '-';
+	if (negative) ++chars;
+	const char* digits = chars;
+
+	if (chars < end && *chars == '0') {
+		++chars;
+	} else if (isDigit(chars, end)) {
+		while (isDigit(chars, end)) ++chars;
+	} else {
+		return fail(parser, parser->current, "Invalid number");
+	}
+	if (chars < end && *chars == '.') {
+		++chars;
+		if (!isDigit(chars, end)) return fail(parser, parser->current, "Invalid number");
+		while (isDigit(chars, end)) ++chars;
+	}
+	bool exponent = chars < end && (*chars == 'e' || *chars == 'E');
+	if (exponent) {
+		++chars;
+		if (chars < end && (*chars == '+' || *chars == '-')) ++chars;
+		if (!isDigit(chars, end)) return fail(parser, parser->current, "Invalid number");
+		while (isDigit(chars, end)) ++chars;
+	}
+	parser->current = chars;
+
+	// Both read a null-terminated copy, as the text may end right after the number.
+	// parseNumber() takes digits with an optional fraction, as the scanner does.
+	size_t length = (size_t)(chars - digits);
+	char local[64];
+	char* copy = length < sizeof(local) ? local : reserveBuffer(parser, length + 1);
+	memcpy(copy, digits, length);
+	copy[length] = '\0';
+	double number = exponent || length > INT_MAX ? strtod(copy, NULL) : parseNumber(copy, (int)length);
+	push(parser->vm, NUMBER_VAL(negative ? -number : number));
+	return true;
+}
+
+static bool parseLiteral(Parser* parser, const char* literal, size_t length, Value value) {
+	if ((size_t)(parser->end - parser->current) < length || memcmp(parser->current, literal, length) != 0) {
+		return fail(parser, parser->current, "Unexpected character");
+	}
+	parser->current += length;
+	push(parser->vm, value);
+	return true;
+}
+
+static bool parseValue(Parser* parser, int depth);
+
+// Each level keeps a few values on the stack while it's parsed.
+static bool enterContainer(Parser* parser, int depth) {
+	VM* vm = parser->vm;
+	if (depth > JSON_DEPTH_MAX || vm->stackTop + 4 > vm->stack + STACK_MAX) {
+		return fail(parser, parser->current, "Nested too deeply");
+	}
+	parser->current++;
+	return true;
+}
+
+static bool parseObject(Parser* parser, int depth) {
+	if (!enterContainer(parser, depth)) return false;
+	VM* vm = parser->vm;
+	ObjInstance* object = newInstance(vm, AS_CLASS(parser->slots[SLOT_OBJECT]));
+	push(vm, OBJ_VAL(object));
+	if (consume(parser, '}')) return true;
+
+	for (;;) {
+		skipWhitespace(parser);
+		if (parser->current == parser->end || *parser->current != '"') {
+			return fail(parser, parser->current, "Expected a member name");
+		}
+		if (!parseKey(parser)) return false;
+		if (!consume(parser, ':')) return fail(parser, parser->current, "Expected ':'");
+		if (!parseValue(parser, depth)) return false;
+		tableSet(&object->fields, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+		pop(vm);
+		pop(vm);
+
+		if (consume(parser, ',')) continue;
+		if (consume(parser, '}')) return true;
+		return fail(parser, parser->current, "Expected ',' or '}'");
+	}
+}
+
+static bool parseArray(Parser* parser, int depth) {
+	if (!enterContainer(parser, depth)) return false;
+	VM* vm = parser->vm;
+	ObjString* valueKey = AS_STRING(parser->slots[SLOT_VALUE]);
+	ObjString* nextKey = AS_STRING(parser->slots[SLOT_NEXT]);
+	ObjString* firstKey = AS_STRING(parser->slots[SLOT_FIRST]);
+	ObjInstance* array = newInstance(vm, AS_CLASS(parser->slots[SLOT_ARRAY]));
+	push(vm, OBJ_VAL(array));
+	tableSet(&array->fields, AS_STRING(parser->slots[SLOT_LENGTH]), NUMBER_VAL(0));
+	tableSet(&array->fields, firstKey, NIL_VAL);
+	if (consume(parser, ']')) return true;
+
+	// Elements are linked from the array as they're parsed, so GC doesn't collect them.
+	ObjInstance* last = NULL;
+	double length = 0;
+	for (;;) {
+		if (!parseValue(parser, depth)) return false;
+		ObjInstance* piece = newInstance(vm, AS_CLASS(parser->slots[SLOT_PIECE]));
+		push(vm, OBJ_VAL(piece));
+		tableSet(&piece->fields, valueKey, vm->stackTop[-2]);
+		tableSet(&piece->fields, nextKey, NIL_VAL);
+		if (last != NULL) {
+			tableSet(&last->fields, nextKey, OBJ_VAL(piece));
+		} else {
+			tableSet(&array->fields, firstKey, OBJ_VAL(piece));
+		}
+		last = piece;
+		pop(vm);
+		pop(vm);
+		length++;
+
+		if (consume(parser, ',')) continue;
+		if (consume(parser, ']')) break;
+		return fail(parser, parser->current, "Expected ',' or ']'");
+	}
+	tableSet(&array->fields, AS_STRING(parser->slots[SLOT_LENGTH]), NUMBER_VAL(length));
+	return true;
+}
+
+// Pushes the value at the current character, after whitespace.
+static bool parseValue(Parser* parser, int depth) {
+	skipWhitespace(parser);
+	if (parser->current == parser->end) return fail(parser, parser->current, "Unexpected end");
+	char c = *parser->current;
+	switch (c) {
+		case '{': return parseObject(parser, depth + 1);
+		case '[': return parseArray(parser, depth + 1);
+		case '"': return parseString(parser);
+		case 't': return parseLiteral(parser, "true", 4, BOOL_VAL(true));
+		case 'f': return parseLiteral(parser, "false", 5, BOOL_VAL(false));
+		case 'n': return parseLiteral(parser, "null", 4, NIL_VAL);
+		default:
+			if (c == '-' || (c >= '0' && c <= '9')) return parseNumberValue(parser);
+			return fail(parser, parser->current, "Unexpected character");
+	}
+}
+
+// Replaces the name on top of the stack with a class of that name.
+static void makeClass(VM* vm) {
+	vm->stackTop[-1] = OBJ_VAL(newClass(vm, AS_STRING(vm->stackTop[-1])));
+}
+
+static Value jsonParseNative(VM* vm, int argCount, Value* args) {
+	if (argCount != 1) {
+		runtimeError(vm, "[jsonParseNative] Invalid number of arguments: 1 was expected, but %d was given", argCount);
+		return NIL_VAL;
+	}
+	Text text;
+	if (!textArgument(vm, "jsonParseNative", args, 0, &text)) return NIL_VAL;
+
+	Parser parser;
+	parser.vm = vm;
+	parser.text = &text;
+	parser.current = text.chars;
+	parser.end = text.chars + text.length;
+	parser.slots = vm->stackTop;
+	parser.buffer = NULL;
+	parser.bufferCapacity = 0;
+	parser.error = NULL;
+	parser.errorAt = NULL;
+
+	push(vm, OBJ_VAL(copyString(vm, "value", 5)));
+	push(vm, OBJ_VAL(copyString(vm, "next", 4)));
+	push(vm, OBJ_VAL(copyString(vm, "length", 6)));
+	push(vm, OBJ_VAL(copyString(vm, "first", 5)));
+	push(vm, OBJ_VAL(copyString(vm, "Piece", 5)));
+	makeClass(vm);
+	push(vm, OBJ_VAL(copyString(vm, "JsonArray", 9)));
+	makeClass(vm);
+	push(vm, OBJ_VAL(copyString(vm, "JsonObject", 10)));
+	makeClass(vm);
+
+	// Containers stay on the stack while they're filled.
+	bool parsed = parseValue(&parser, 0);
+	if (parsed) {
+		skipWhitespace(&parser);
+		if (parser.current != parser.end) parsed = fail(&parser, parser.current, "Unexpected character after the value");
+	}
+	Value result = parsed ? vm->stackTop[-1] : NIL_VAL;
+	vm->stackTop = parser.slots;
+	free(parser.buffer);
+
+	if (!parsed) {
+		runtimeError(vm, "[jsonParseNative] %s at byte %zu", parser.error, (size_t)(parser.errorAt - text.chars));
+	}
+	return result;
+}
+
+// Serializer //
+
+typedef struct {
+	VM* vm;
+	// The JSON written so far.
+	char* chars;
+	size_t length;
+	size_t capacity;
+	// Interned field names of arrays.
+	ObjString* valueKey;
+	ObjString* nextKey;
+	ObjString* firstKey;
+	// Set when writing fails. The format of a message with the number, if it has one.
+	const char* error;
+	double errorNumber;
+} Writer;
+
+// The error is reported once the writer is done with the stack, as runtimeError() resets it.
+static bool failWriting(Writer* writer, const char* error, double number) {
+	writer->error = error;
+	writer->errorNumber = number;
+	return false;
+}
+
+static char* reserve(Writer* writer, size_t count) {
+	if (writer->capacity - writer->length < count) {
+		size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+		while (capacity - writer->length < count) capacity *= 2;
+		writer->chars = (char*)growBuffer(writer->chars, capacity);
+		writer->capacity = capacity;
+	}
+	return writer->chars + writer->length;
+}
+
+static void writeBytes(Writer* writer, const char* chars, size_t count) {
+	memcpy(reserve(writer, count), chars, count);
+	writer->length += count;
+}
+
+static void writeChar(Writer* writer, char c) {
+	*reserve(writer, 1) = c;
+	writer->length++;
+}
+
+static void writeEscape(Writer* writer, unsigned char c) {
+	static const char hex[] = "0123456789abcdef";
+	switch (c) {
+		case '"': writeBytes(writer, "\\\"", 2); break;
+		case '\\': writeBytes(writer, "\\\\", 2); break;
+		case '\b': writeBytes(writer, "\\b", 2); break;
+		case '\f': writeBytes(writer, "\\f", 2); break;
+		case '\n': writeBytes(writer, "\\n", 2); break;
+		case '\r': writeBytes(writer, "\\r", 2); break;
+		case '\t': writeBytes(writer, "\\t", 2); break;
+		default: {
+			char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+			writeBytes(writer, escape, 6);
+			break;
+		}
+	}
+}
+
+// Runs of characters that need no escape are copied at once. They're found a word at a time.
+static void writeString(Writer* writer, const char* chars, size_t length) {
+	const char* end = chars + length;
+	writeChar(writer, '"');
+	while (chars < end) {
+		const char* run = chars;
+		while (end - chars >= 8) {
+			uint64_t word;
+			memcpy(&word, chars, 8);
+			if (hasEscapedByte(word)) break;
+			chars += 8;
+		}
+		while (chars < end && !isEscaped((unsigned char)*chars)) ++chars;
+		writeBytes(writer, run, (size_t)(chars - run));
+		if (chars < end) writeEscape(writer, (unsigned char)*chars++);
+	}
+	writeChar(writer, '"');
+}
+
+static bool writeJsonValue(Writer* writer, Value value, int depth);
+
+static bool isJsonArray(ObjClass* klass) {
+	return klass->name->length == 9 && memcmp(klass->name->chars, "JsonArray", 9) == 0;
+}
+
+static bool writeArray(Writer* writer, ObjInstance* array, int depth) {
+	Value element = NIL_VAL;
+	tableGet(&array->fields, writer->firstKey, &element);
+	// Follows the elements at half speed, so it meets them again only if they loop.
+	Value slow = element;
+	int count = 0;
+
+	writeChar(writer, '[');
+	while (!IS_NIL(element)) {
+		if (!IS_INSTANCE(element)) {
+			return failWriting(writer, "[jsonStringifyNative] An element of a JsonArray is not an instance", 0);
+		}
+		ObjInstance* piece = AS_INSTANCE(element);
+		Value item = NIL_VAL;
+		tableGet(&piece->fields, writer->valueKey, &item);
+		if (count > 0) writeChar(writer, ',');
+		if (!writeJsonValue(writer, item, depth)) return false;
+
+		element = NIL_VAL;
+		tableGet(&piece->fields, writer->nextKey, &element);
+		if (++count % 2 == 0) tableGet(&AS_INSTANCE(slow)->fields, writer->nextKey, &slow);
+		if (IS_OBJ(element) && AS_OBJ(element) == AS_OBJ(slow)) {
+			return failWriting(writer, "[jsonStringifyNative] The elements of a JsonArray loop", 0);
+		}
+	}
+	writeChar(writer, ']');
+	return true;
+}
+
+static bool writeInstance(Writer* writer, ObjInstance* instance, int depth) {
+	if (depth > JSON_DEPTH_MAX) {
+		return failWriting(writer, "[jsonStringifyNative] Instances are nested too deeply, or refer to themselves", 0);
+	}
+	if (isJsonArray(instance->klass)) return writeArray(writer, instance, depth);
+
+	writeChar(writer, '{');
+	bool first = true;
+	for (int i = 0; i < instance->fields.capacity; ++i) {
+		Entry* entry = &instance->fields.entries[i];
+		if (entry->key == NULL) continue;
+		if (!first) writeChar(writer, ',');
+		first = false;
+		writeString(writer, entry->key->chars, (size_t)entry->key->length);
+		writeChar(writer, ':');
+		if (!writeJsonValue(writer, entry->value, depth)) return false;
+	}
+	writeChar(writer, '}');
+	return true;
+}
+
+static bool writeJsonValue(Writer* writer, Value value, int depth) {
+	if (IS_NIL(value)) {
+		writeBytes(writer, "null", 4);
+		return true;
+	}
+	if (IS_BOOL(value)) {
+		if (AS_BOOL(value)) writeBytes(writer, "true", 4);
+		else writeBytes(writer, "false", 5);
+		return true;
+	}
+	if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		if (!isfinite(number)) {
+			return failWriting(writer, "[jsonStringifyNative] %g can't be written as JSON", number);
+		}
+		char buffer[NUMBER_BUFFER_SIZE];
+		writeBytes(writer, buffer, (size_t)formatNumber(number, buffer));
+		return true;
+	}
+	if (IS_SHORT_STRING(value)) {
+		char chars[SHORT_STRING_MAX];
+		writeString(writer, chars, (size_t)shortStringChars(value, chars));
+		return true;
+	}
+
+	if (IS_OBJ(value)) {
+		switch (OBJ_TYPE(value)) {
+			case OBJ_INSTANCE:
+				return writeInstance(writer, AS_INSTANCE(value), depth + 1);
+			case OBJ_MAPPED_STRING:
+				writeString(writer, AS_MAPPED_STRING(value)->chars, AS_MAPPED_STRING(value)->length);
+				return true;
+			case OBJ_ROPE: {
+				// Everything written is reachable from the argument, so GC may run.
+				ObjString* string = flattenRope(writer->vm, AS_ROPE(value));
+				writeString(writer, string->chars, (size_t)string->length);
+				return true;
+			}
+			case OBJ_STRING:
+				writeString(writer, AS_STRING(value)->chars, (size_t)AS_STRING(value)->length);
+				return true;
+			case OBJ_STRING_VIEW:
+				writeString(writer, AS_STRING_VIEW(value)->chars, AS_STRING_VIEW(value)->length);
+				return true;
+			default:
+				break;
+		}
+	}
+	return failWriting(writer, "[jsonStringifyNative] Only nil, booleans, numbers, strings and instances can be written as JSON", 0);
+}
+
+static Value jsonStringifyNative(VM* vm, int argCount, Value* args) {
+	if (argCount != 1) {
+		runtimeError(vm, "[jsonStringifyNative] Invalid number of arguments: 1 was expected, but %d was given", argCount);
+		return NIL_VAL;
+	}
+
+	Writer writer;
+	writer.vm = vm;
+	writer.chars = NULL;
+	writer.length = 0;
+	writer.capacity = 0;
+	writer.error = NULL;
+	writer.errorNumber = 0;
+	Value* slots = vm->stackTop;
+	push(vm, OBJ_VAL(copyString(vm, "value", 5)));
+	push(vm, OBJ_VAL(copyString(vm, "next", 4)));
+	push(vm, OBJ_VAL(copyString(vm, "first", 5)));
+	writer.valueKey = AS_STRING(slots[0]);
+	writer.nextKey = AS_STRING(slots[1]);
+	writer.firstKey = AS_STRING(slots[2]);
+
+	bool written = writeJsonValue(&writer, args[0], 0);
+	if (written && writer.length > INT_MAX) {
+		written = failWriting(&writer, "[jsonStringifyNative] The JSON is too long for a string", 0);
+	}
+	Value result = written ? stringValue(vm, writer.chars, (int)writer.length) : NIL_VAL;
+	vm->stackTop = slots;
+	free(writer.chars);
+
+	if (!written) runtimeError(vm, writer.error, writer.errorNumber);
+	return result;
+}
+
+void defineJsonNatives(VM* vm) {
+	defineNative(vm, "jsonParse", jsonParseNative);
+	defineNative(vm, "jsonStringify", jsonStringifyNative);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.h"
+CPLUSPLUS_BEGIN
+
+#include "vm.h"
+
+// Natives that read and write JSON (RFC 8259):
+//   jsonParse(s)         The value s holds. It's a runtime error if s isn't valid JSON or UTF-8.
+//   jsonStringify(value) value as compact JSON. It's a runtime error if it holds something else,
+//                        a function for example, or if it refers to itself.
+// As scripts have no lists nor maps, parsed containers are instances:
+//   An object is a JsonObject with a field per member. If a name is repeated, the last member wins.
+//   An array is a JsonArray with the fields length and first, the first of its elements or nil.
+//   Each element is a Piece with the fields value and next, the next element or nil, as split() makes.
+// null is nil. Strings aren't hashed nor interned, and long ones without escapes are views of s.
+// jsonStringify() writes a JsonArray as an array, and any other instance as an object of its fields,
+// in no particular order.
+void defineJsonNatives(VM* vm);
+
+CPLUSPLUS_END
@@ -1,5 +1,7 @@
 #include "compiler.h"
+#include "image.h"
 #include "memory.h"
+#include "regex.h"
 #include "vm.h"
 
 #if DEBUG_LOG_GC
@@ -36,6 +38,7 @@ static void freeObject(Obj* object) {
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
 			freeChunk(&function->chunk);
+			freeLazyFunction(function->lazy);
 			FREE(ObjFunction, object);
 			break;
 		}
@@ -45,14 +48,41 @@ static void freeObject(Obj* object) {
 			FREE(ObjInstance, object);
 			break;
 		}
+		case OBJ_MAPPED_STRING: {
+			ObjMappedString* string = (ObjMappedString*)object;
+			unmapFile((const uint8_t*)string->chars, string->length);
+			FREE(ObjMappedString, object);
+			break;
+		}
 		case OBJ_NATIVE: {
 			FREE(ObjNative, object);
 			break;
 		}
+		case OBJ_READER: {
+			ObjReader* reader = (ObjReader*)object;
+			if (reader->file != NULL) fclose(reader->file);
+			FREE_ARRAY(char, reader->buffer, reader->capacity);
+			FREE(ObjReader, object);
+			break;
+		}
+		case OBJ_REGEX: {
+			freeRegex(((ObjRegex*)object)->regex);
+			FREE(ObjRegex, object);
+			break;
+		}
+		case OBJ_ROPE: {
+			// A rope does not own its pieces nor its flattened string.
+			FREE(ObjRope, object);
+			break;
+		}
 		case OBJ_STRING: {
 			ObjString* string = (ObjString*)object;
-			FREE_ARRAY(char, string->chars, string->length + 1);
-			FREE(ObjString, object);
+			reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+			break;
+		}
+		case OBJ_STRING_VIEW: {
+			// The parent owns the characters.
+			FREE(ObjStringView, object);
 			break;
 		}
 		case OBJ_UPVALUE: {
@@ -78,6 +108,9 @@ static void markRoots(VM* vm) {
 	}
 
 	markTable(vm, &(vm->globals));
+	markTable(vm, &(vm->natives));
+	markTable(vm, &(vm->modules));
+	markTable(vm, &(vm->regexes));
 	markCompilerRoots();
 	markObject(vm, (Obj*)vm->initString);
 }
@@ -131,8 +164,25 @@ static void blackenObject(VM* vm, Obj* object) {
 		case OBJ_UPVALUE:
 			markValue(vm, ((ObjUpvalue*)object)->closed);
 			break;
-		// Native functions and strings have no outgoing references;
 		case OBJ_NATIVE:
+			markObject(vm, (Obj*)((ObjNative*)object)->name);
+			break;
+		case OBJ_ROPE: {
+			ObjRope* rope = (ObjRope*)object;
+			markObject(vm, rope->left);
+			markObject(vm, rope->right);
+			markObject(vm, (Obj*)rope->string);
+			break;
+		}
+		case OBJ_STRING_VIEW:
+			markObject(vm, ((ObjStringView*)object)->parent);
+			break;
+		case OBJ_REGEX:
+			markObject(vm, (Obj*)((ObjRegex*)object)->pattern);
+			break;
+		// Strings and readers have no outgoing references;
+		case OBJ_MAPPED_STRING:
+		case OBJ_READER:
 		case OBJ_STRING:
 			break;
 	}
@@ -173,15 +223,18 @@ static void sweep(VM* vm) {
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 	VM* vm = g_vm; // #todo-gc: remove global variable
 
-	vm->bytesAllocated += newSize - oldSize;
-	if (newSize > oldSize) {
+	// Memory allocated while no VM is current, like a scanner used on its own, isn't counted.
+	if (vm != NULL) {
+		vm->bytesAllocated += newSize - oldSize;
+		// Only allocations collect: freeing happens while GC sweeps.
+		if (newSize > oldSize) {
 #if DEBUG_STRESS_GC
-		collectGarbage(vm);
+			collectGarbage(vm);
 #endif
-	}
-
-	if (vm->bytesAllocated > vm->nextGC) {
-		collectGarbage(vm);
+			if (vm->bytesAllocated > vm->nextGC) {
+				collectGarbage(vm);
+			}
+		}
 	}
 
 	if (newSize == 0) {
@@ -247,12 +300,40 @@ void collectGarbage(VM* vm) {
 #endif
 }
 
-void freeObjects(VM* vm) {
+// Shared objects stay marked, so GC neither traces nor frees them, in this VM or in its clones.
+// That's safe because strings, string views, functions and natives refer only to each other.
+void shareImmutableObjects(VM* vm) {
+	Obj* previous = NULL;
 	Obj* object = vm->objects;
+	while (object != NULL) {
+		Obj* next = object->next;
+		if (object->type == OBJ_STRING || object->type == OBJ_MAPPED_STRING || object->type == OBJ_STRING_VIEW ||
+			object->type == OBJ_FUNCTION || object->type == OBJ_NATIVE) {
+			if (previous != NULL) {
+				previous->next = next;
+			} else {
+				vm->objects = next;
+			}
+			object->isMarked = true;
+			object->next = vm->sharedObjects;
+			vm->sharedObjects = object;
+		} else {
+			previous = object;
+		}
+		object = next;
+	}
+}
+
+static void freeObjectList(Obj* object) {
 	while (object != NULL) {
 		Obj* next = object->next;
 		freeObject(object);
 		object = next;
 	}
+}
+
+void freeObjects(VM* vm) {
+	freeObjectList(vm->objects);
+	freeObjectList(vm->sharedObjects);
 	free(vm->grayStack);
 }
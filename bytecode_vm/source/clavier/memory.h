@@ -27,4 +27,7 @@ void markObject(VM* vm, Obj* object);
 void markValue(VM* vm, Value value);
 void collectGarbage(VM* vm);
 
+// Moves every string, function and native out of GC's reach, into vm->sharedObjects.
+// They live until freeVM(). Lazy functions must be compiled first. See cloneVM().
+void shareImmutableObjects(VM* vm);
 void freeObjects(VM* vm);
@@ -0,0 +1,347 @@
+#include "number.h"
+#include "numbertable.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+//
+// formatNumber() finds the shortest decimal in the rounding interval of a double with the Ryu algorithm.
+// Ulf Adams, "Ryu: fast float-to-string conversion", PLDI 2018
+//
+
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_EXPONENT_BITS 11
+#define DOUBLE_BIAS 1023
+
+// Positional notation is used while the decimal point is within this many digits.
+#define MAX_POSITIONAL_EXPONENT 21
+#define MIN_POSITIONAL_EXPONENT -6
+
+static uint64_t umul128(uint64_t a, uint64_t b, uint64_t* high) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	return _umul128(a, b, high);
+#elif defined(__SIZEOF_INT128__)
+	unsigned __int128 product = (unsigned __int128)a * b;
+	*high = (uint64_t)(product >> 64);
+	return (uint64_t)product;
+#else
+	uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+	uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+	uint64_t lowLow = aLow * bLow;
+	uint64_t lowHigh = aLow * bHigh;
+	uint64_t highLow = aHigh * bLow;
+	uint64_t highHigh = aHigh * bHigh;
+	uint64_t middle = (lowLow >> 32) + (uint32_t)lowHigh + (uint32_t)highLow;
+	*high = highHigh + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+	return (middle << 32) | (uint32_t)lowLow;
+#endif
+}
+
+// 0 < dist < 64
+static uint64_t shiftRight128(uint64_t low, uint64_t high, int dist) {
+	return (high << (64 - dist)) | (low >> dist);
+}
+
+// (m * mul) >> j where m has at most 55 bits and 64 < j < 128.
+static uint64_t mulShift64(uint64_t m, const uint64_t* mul, int j) {
+	uint64_t high1;
+	uint64_t low1 = umul128(m, mul[1], &high1);
+	uint64_t high0;
+	umul128(m, mul[0], &high0);
+	uint64_t sum = high0 + low1;
+	if (sum < high0) {
+		++high1;
+	}
+	return shiftRight128(sum, high1, j - 64);
+}
+
+// ceil(log2(5^e)) for 0 <= e <= 3528
+static int pow5Bits(int e) {
+	return (int)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e)) for 0 <= e <= 1650
+static uint32_t log10Pow2(int e) {
+	return ((uint32_t)e * 78913) >> 18;
+}
+
+// floor(log10(5^e)) for 0 <= e <= 2620
+static uint32_t log10Pow5(int e) {
+	return ((uint32_t)e * 732923) >> 20;
+}
+
+static bool multipleOfPowerOf5(uint64_t value, uint32_t p) {
+	uint32_t count = 0;
+	while (value % 5 == 0) {
+		value /= 5;
+		count++;
+	}
+	return count >= p;
+}
+
+static bool multipleOfPowerOf2(uint64_t value, uint32_t p) {
+	return (value & ((1ull << p) - 1)) == 0;
+}
+
+typedef struct {
+	uint64_t mantissa;
+	int exponent; // value = mantissa * 10^exponent
+} Decimal;
+
+static Decimal toDecimal(uint64_t ieeeMantissa, uint32_t ieeeExponent) {
+	// Step 1: value = m2 * 2^e2. 2 more bits for the half way points to the neighbours.
+	int e2;
+	uint64_t m2;
+	if (ieeeExponent == 0) {
+		e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+		m2 = ieeeMantissa;
+	} else {
+		e2 = (int)ieeeExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+		m2 = (1ull << DOUBLE_MANTISSA_BITS) | ieeeMantissa;
+	}
+	bool acceptBounds = (m2 & 1) == 0; // Round half to even when reading back.
+
+	// Step 2: The interval of the decimals that read back to the value is [mm, mp] around mv.
+	// The lower neighbour is closer if the value is a power of 2.
+	uint64_t mv = 4 * m2;
+	uint32_t mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+	// Step 3: Convert the interval to a decimal power.
+	uint64_t vr, vp, vm;
+	int e10;
+	bool vmIsTrailingZeros = false;
+	bool vrIsTrailingZeros = false;
+	if (e2 >= 0) {
+		uint32_t q = log10Pow2(e2) - (e2 > 3);
+		e10 = (int)q;
+		int k = DOUBLE_POW5_INV_BITCOUNT + pow5Bits((int)q) - 1;
+		int i = -e2 + (int)q + k;
+		vr = mulShift64(4 * m2, DOUBLE_POW5_INV_SPLIT[q], i);
+		vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_INV_SPLIT[q], i);
+		vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_INV_SPLIT[q], i);
+		if (q <= 21) {
+			// Only one of mp, mv and mm can be a multiple of 5, if any.
+			if (mv % 5 == 0) {
+				vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+			} else if (acceptBounds) {
+				vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+			} else {
+				vp -= multipleOfPowerOf5(mv + 2, q);
+			}
+		}
+	} else {
+		uint32_t q = log10Pow5(-e2) - (-e2 > 1);
+		e10 = (int)q + e2;
+		int i = -e2 - (int)q;
+		int k = pow5Bits(i) - DOUBLE_POW5_BITCOUNT;
+		int j = (int)q - k;
+		vr = mulShift64(4 * m2, DOUBLE_POW5_SPLIT[i], j);
+		vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_SPLIT[i], j);
+		vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_SPLIT[i], j);
+		if (q <= 1) {
+			// mv = 4 * m2 always has at least 2 trailing 0 bits.
+			vrIsTrailingZeros = true;
+			if (acceptBounds) {
+				vmIsTrailingZeros = mmShift == 1;
+			} else {
+				--vp;
+			}
+		} else if (q < 63) {
+			vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+		}
+	}
+
+	// Step 4: Remove digits while the interval still contains a decimal with fewer digits.
+	int removed = 0;
+	uint8_t lastRemovedDigit = 0;
+	uint64_t output;
+	if (vmIsTrailingZeros || vrIsTrailingZeros) {
+		// Rare. The exact digits matter for rounding.
+		while (vp / 10 > vm / 10) {
+			vmIsTrailingZeros &= vm % 10 == 0;
+			vrIsTrailingZeros &= lastRemovedDigit == 0;
+			lastRemovedDigit = (uint8_t)(vr % 10);
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			++removed;
+		}
+		if (vmIsTrailingZeros) {
+			while (vm % 10 == 0) {
+				vrIsTrailingZeros &= lastRemovedDigit == 0;
+				lastRemovedDigit = (uint8_t)(vr % 10);
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				++removed;
+			}
+		}
+		if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+			// Exactly half way. Round to even.
+			lastRemovedDigit = 4;
+		}
+		output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+	} else {
+		bool roundUp = false;
+		if (vp / 100 > vm / 100) {
+			// Remove 2 digits at a time first.
+			roundUp = vr % 100 >= 50;
+			vr /= 100;
+			vp /= 100;
+			vm /= 100;
+			removed += 2;
+		}
+		while (vp / 10 > vm / 10) {
+			roundUp = vr % 10 >= 5;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			++removed;
+		}
+		output = vr + (vr == vm || roundUp);
+	}
+
+	Decimal decimal;
+	decimal.mantissa = output;
+	decimal.exponent = e10 + removed;
+	return decimal;
+}
+
+// Integers below 2^53 don't need the algorithm.
+static bool toSmallInteger(uint64_t ieeeMantissa, uint32_t ieeeExponent, Decimal* decimal) {
+	uint64_t m2 = (1ull << DOUBLE_MANTISSA_BITS) | ieeeMantissa;
+	int e2 = (int)ieeeExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS;
+
+	if (e2 > 0 || e2 < -DOUBLE_MANTISSA_BITS) return false;
+	uint64_t mask = (1ull << -e2) - 1;
+	if ((m2 & mask) != 0) return false;
+
+	decimal->mantissa = m2 >> -e2;
+	decimal->exponent = 0;
+	while (decimal->mantissa % 10 == 0) {
+		decimal->mantissa /= 10;
+		decimal->exponent++;
+	}
+	return true;
+}
+
+static int decimalLength(uint64_t value) {
+	int length = 1;
+	while (value >= 10) {
+		value /= 10;
+		length++;
+	}
+	return length;
+}
+
+int formatNumber(double value, char* buffer) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	bool sign = (bits >> (DOUBLE_MANTISSA_BITS + DOUBLE_EXPONENT_BITS)) != 0;
+	uint64_t ieeeMantissa = bits & ((1ull << DOUBLE_MANTISSA_BITS) - 1);
+	uint32_t ieeeExponent = (uint32_t)((bits >> DOUBLE_MANTISSA_BITS) & ((1u << DOUBLE_EXPONENT_BITS) - 1));
+
+	char* p = buffer;
+	if (ieeeExponent == (1u << DOUBLE_EXPONENT_BITS) - 1) {
+		if (ieeeMantissa != 0) {
+			memcpy(p, "nan", 4);
+			return 3;
+		}
+		if (sign) *p++ = '-';
+		memcpy(p, "inf", 4);
+		return (int)(p - buffer) + 3;
+	}
+	if (sign) *p++ = '-';
+	if (ieeeExponent == 0 && ieeeMantissa == 0) {
+		memcpy(p, "0", 2);
+		return (int)(p - buffer) + 1;
+	}
+
+	Decimal decimal;
+	if (!toSmallInteger(ieeeMantissa, ieeeExponent, &decimal)) {
+		decimal = toDecimal(ieeeMantissa, ieeeExponent);
+	}
+
+	char digits[20];
+	int length = decimalLength(decimal.mantissa);
+	for (int i = length - 1; i >= 0; --i) {
+		digits[i] = (char)('0' + decimal.mantissa % 10);
+		decimal.mantissa /= 10;
+	}
+
+	// value = 0.digits * 10^point
+	int point = length + decimal.exponent;
+	if (length <= point && point <= MAX_POSITIONAL_EXPONENT) {
+		memcpy(p, digits, length);
+		p += length;
+		memset(p, '0', point - length);
+		p += point - length;
+	} else if (0 < point && point <= MAX_POSITIONAL_EXPONENT) {
+		memcpy(p, digits, point);
+		p += point;
+		*p++ = '.';
+		memcpy(p, digits + point, length - point);
+		p += length - point;
+	} else if (MIN_POSITIONAL_EXPONENT < point && point <= 0) {
+		*p++ = '0';
+		*p++ = '.';
+		memset(p, '0', -point);
+		p += -point;
+		memcpy(p, digits, length);
+		p += length;
+	} else {
+		*p++ = digits[0];
+		if (length > 1) {
+			*p++ = '.';
+			memcpy(p, digits + 1, length - 1);
+			p += length - 1;
+		}
+		int exponent = point - 1;
+		*p++ = 'e';
+		*p++ = exponent < 0 ? '-' : '+';
+		if (exponent < 0) exponent = -exponent;
+		if (exponent >= 100) *p++ = (char)('0' + exponent / 100);
+		if (exponent >= 10) *p++ = (char)('0' + exponent / 10 % 10);
+		*p++ = (char)('0' + exponent % 10);
+	}
+	*p = '\0';
+	return (int)(p - buffer);
+}
+
+// Powers of 10 that are exact in a double.
+static const double exactPowersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_POWER_OF_10 22
+#define MAX_EXACT_INTEGER (1ull << 53)
+#define MAX_UINT64_DIGITS 19
+
+double parseNumber(const char* start, int length) {
+	uint64_t mantissa = 0;
+	int significantDigits = 0;
+	int fractionDigits = 0;
+	bool fraction = false;
+
+	for (int i = 0; i < length; ++i) {
+		char c = start[i];
+		if (c == '.') {
+			fraction = true;
+			continue;
+		}
+		mantissa = mantissa * 10 + (uint64_t)(c - '0');
+		if (mantissa != 0) significantDigits++;
+		if (fraction) fractionDigits++;
+	}
+
+	// Both operands are exact, so the division rounds correctly. (Clinger's fast path)
+	if (significantDigits <= MAX_UINT64_DIGITS && mantissa <= MAX_EXACT_INTEGER && fractionDigits <= MAX_EXACT_POWER_OF_10) {
+		return (double)mantissa / exactPowersOf10[fractionDigits];
+	}
+	return strtod(start, NULL);
+}
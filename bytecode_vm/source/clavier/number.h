@@ -0,0 +1,16 @@
+#pragma once
+
+#include "common.h"
+CPLUSPLUS_BEGIN
+
+// Enough for any output of formatNumber() including the terminating '\0'.
+#define NUMBER_BUFFER_SIZE 32
+
+// Writes the shortest string that reads back to the same double. Returns the length.
+// Small exponents are written in positional notation (1000000, 0.001), others in scientific notation (1e+21).
+int formatNumber(double value, char* buffer);
+
+// Parses a number literal as scanned by the scanner: digits with an optional fraction.
+double parseNumber(const char* start, int length);
+
+CPLUSPLUS_END
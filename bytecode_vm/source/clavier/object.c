@@ -5,7 +5,11 @@
 #include "vm.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h> // _umul128()
+#endif
 
 #define ALLOCATE_OBJ(vm, type, objectType) \
 	(type*)allocateObject(vm, sizeof(type), objectType)
@@ -57,6 +61,8 @@ ObjFunction* newFunction(VM* vm) {
 	function->arity = 0;
 	function->upvalueCount = 0;
 	function->name = NULL;
+	function->lazy = NULL;
+	function->profileSite = -1;
 	initChunk(&function->chunk);
 	return function;
 }
@@ -68,23 +74,165 @@ ObjInstance* newInstance(VM* vm, ObjClass* klass) {
 	return instance;
 }
 
-ObjNative* newNative(VM* vm, NativeFn function) {
+ObjMappedString* newMappedString(VM* vm, const char* chars, size_t length) {
+	ObjMappedString* string = ALLOCATE_OBJ(vm, ObjMappedString, OBJ_MAPPED_STRING);
+	string->length = length;
+	string->chars = chars;
+	return string;
+}
+
+ObjNative* newNative(VM* vm, ObjString* name, NativeFn function) {
 	ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+	native->name = name;
 	native->function = function;
 	return native;
 }
 
-static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash) {
-	ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+ObjReader* newReader(VM* vm, FILE* file) {
+	// Allocated first, so GC can't collect the reader while the buffer is allocated.
+	char* buffer = ALLOCATE(char, READER_BUFFER_SIZE);
+	ObjReader* reader = ALLOCATE_OBJ(vm, ObjReader, OBJ_READER);
+	reader->file = file;
+	reader->buffer = buffer;
+	reader->capacity = READER_BUFFER_SIZE;
+	reader->start = 0;
+	reader->end = 0;
+	return reader;
+}
+
+ObjRegex* newRegex(VM* vm, ObjString* pattern, struct Regex* regex) {
+	ObjRegex* object = ALLOCATE_OBJ(vm, ObjRegex, OBJ_REGEX);
+	object->pattern = pattern;
+	object->regex = regex;
+	return object;
+}
+
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length) {
+	ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->left = left;
+	rope->right = right;
+	rope->string = NULL;
+	return rope;
+}
+
+ObjString* allocateString(VM* vm, int length) {
+	ObjString* string = (ObjString*)allocateObject(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
 	string->length = length;
-	string->chars = chars;
-	string->hash = hash;
-	tableSet(&vm->strings, string, NIL_VAL); // Intern every string
+	string->hash = 0;
+	string->interned = false;
+	string->chars[length] = '\0';
 	return string;
 }
 
-// #todo: Explore hashing algorithms
-static uint32_t hashString(const char* key, int length) {
+static void addInterned(VM* vm, ObjString* string, uint32_t hash) {
+	string->hash = hash;
+	string->interned = true;
+	// Growing the table might trigger GC, so keep the new string on the stack.
+	push(vm, OBJ_VAL(string));
+	tableSet(&vm->strings, string, NIL_VAL);
+	pop(vm);
+}
+
+#if STRING_HASH == STRING_HASH_WYHASH
+
+// wyhash (final version 4) by Wang Yi, which is in the public domain.
+// It reads 8 bytes at a time and mixes them by 64x64 to 128 bit multiplication.
+static const uint64_t wySecret[4] = {
+	0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+// Sets a and b to the low and high halves of a * b.
+static inline void wyMultiply(uint64_t* a, uint64_t* b) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	*a = _umul128(*a, *b, b);
+#elif defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t)*a * *b;
+	*a = (uint64_t)product;
+	*b = (uint64_t)(product >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32);
+	uint64_t carry = t < rl;
+	uint64_t low = t + (rm1 << 32);
+	carry += low < t;
+	*a = low;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t wyMix(uint64_t a, uint64_t b) {
+	wyMultiply(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t wyRead8(const uint8_t* p) {
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint64_t wyRead4(const uint8_t* p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// Reads 1 to 3 bytes.
+static inline uint64_t wyRead3(const uint8_t* p, size_t length) {
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+}
+
+uint32_t hashString(const char* key, int length) {
+	const uint8_t* p = (const uint8_t*)key;
+	size_t remaining = (size_t)length;
+	uint64_t seed = wyMix(wySecret[0], wySecret[1]);
+	uint64_t a, b;
+	if (remaining <= 16) {
+		if (remaining >= 4) {
+			// Two overlapping 4 byte reads from each end cover up to 16 bytes.
+			size_t middle = (remaining >> 3) << 2;
+			a = (wyRead4(p) << 32) | wyRead4(p + middle);
+			b = (wyRead4(p + remaining - 4) << 32) | wyRead4(p + remaining - 4 - middle);
+		} else if (remaining > 0) {
+			a = wyRead3(p, remaining);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		if (remaining > 48) {
+			uint64_t seed1 = seed;
+			uint64_t seed2 = seed;
+			do {
+				seed = wyMix(wyRead8(p) ^ wySecret[1], wyRead8(p + 8) ^ seed);
+				seed1 = wyMix(wyRead8(p + 16) ^ wySecret[2], wyRead8(p + 24) ^ seed1);
+				seed2 = wyMix(wyRead8(p + 32) ^ wySecret[3], wyRead8(p + 40) ^ seed2);
+				p += 48;
+				remaining -= 48;
+			} while (remaining > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (remaining > 16) {
+			seed = wyMix(wyRead8(p) ^ wySecret[1], wyRead8(p + 8) ^ seed);
+			p += 16;
+			remaining -= 16;
+		}
+		// The last 16 bytes, overlapping the ones already read.
+		a = wyRead8(p + remaining - 16);
+		b = wyRead8(p + remaining - 8);
+	}
+	a ^= wySecret[1];
+	b ^= seed;
+	wyMultiply(&a, &b);
+	// Table uses the low bits as the index.
+	return (uint32_t)wyMix(a ^ wySecret[0] ^ (uint64_t)length, b ^ wySecret[1]);
+}
+
+#else
+
+uint32_t hashString(const char* key, int length) {
 	// FNV-1a hash
 	uint32_t hash = 2166136261u;
 	for (int i = 0; i < length; ++i) {
@@ -94,26 +242,51 @@ static uint32_t hashString(const char* key, int length) {
 	return hash;
 }
 
-ObjString* takeString(VM* vm, char* chars, int length) {
+#endif // STRING_HASH
+
+ObjString* copyString(VM* vm, const char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
 	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
-	if (interned != NULL) {
-		FREE_ARRAY(char, chars, length + 1);
-		return interned;
-	}
+	if (interned != NULL) return interned;
 
-	return allocateString(vm, chars, length, hash);
+	ObjString* string = allocateString(vm, length);
+	memcpy_s(string->chars, length, chars, length);
+	addInterned(vm, string, hash);
+	return string;
 }
 
-ObjString* copyString(VM* vm, const char* chars, int length) {
-	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b) {
+	ObjString* string = allocateString(vm, a->length + b->length);
+	memcpy_s(string->chars, a->length, a->chars, a->length);
+	memcpy_s(string->chars + a->length, b->length, b->chars, b->length);
+	return string;
+}
+
+ObjStringView* newStringView(VM* vm, Obj* parent, const char* chars, size_t length) {
+	if (parent->type == OBJ_STRING_VIEW) parent = ((ObjStringView*)parent)->parent;
+	ObjStringView* view = ALLOCATE_OBJ(vm, ObjStringView, OBJ_STRING_VIEW);
+	view->length = length;
+	view->chars = chars;
+	view->parent = parent;
+	return view;
+}
+
+Value stringValue(VM* vm, const char* chars, int length) {
+	if (FITS_SHORT_STRING(length)) return shortStringVal(chars, length);
+	ObjString* string = allocateString(vm, length);
+	memcpy_s(string->chars, length, chars, length);
+	return OBJ_VAL(string);
+}
+
+ObjString* internString(VM* vm, ObjString* string) {
+	if (string->interned) return string;
+
+	uint32_t hash = hashString(string->chars, string->length);
+	ObjString* interned = tableFindString(&vm->strings, string->chars, string->length, hash);
 	if (interned != NULL) return interned;
 
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy_s(heapChars, length, chars, length);
-	heapChars[length] = '\0';
-	return allocateString(vm, heapChars, length, hash);
+	addInterned(vm, string, hash);
+	return string;
 }
 
 ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
@@ -124,41 +297,134 @@ ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
 	return upvalue;
 }
 
-static void printFunction(ObjFunction* function) {
+// Fills dest from its end, so ropes built by appending need only a short stack.
+// The stack isn't allocated by reallocate(), so GC can't run while the rope is walked.
+static void copyRopeChars(ObjRope* rope, char* dest) {
+	int capacity = 8;
+	int count = 0;
+	Obj** stack = (Obj**)malloc(sizeof(Obj*) * capacity);
+	if (stack == NULL) exit(1); // Out of Memory
+	stack[count++] = (Obj*)rope;
+
+	int end = rope->length;
+	while (count > 0) {
+		Obj* node = stack[--count];
+		if (node->type == OBJ_ROPE && ((ObjRope*)node)->string != NULL) {
+			node = (Obj*)((ObjRope*)node)->string;
+		}
+		if (node->type == OBJ_STRING) {
+			ObjString* string = (ObjString*)node;
+			end -= string->length;
+			memcpy_s(dest + end, string->length, string->chars, string->length);
+			continue;
+		}
+		if (node->type == OBJ_MAPPED_STRING) {
+			// Ropes are shorter than INT_MAX, so are their pieces.
+			ObjMappedString* string = (ObjMappedString*)node;
+			end -= (int)string->length;
+			memcpy_s(dest + end, string->length, string->chars, string->length);
+			continue;
+		}
+		if (node->type == OBJ_STRING_VIEW) {
+			ObjStringView* view = (ObjStringView*)node;
+			end -= (int)view->length;
+			memcpy_s(dest + end, view->length, view->chars, view->length);
+			continue;
+		}
+
+		if (capacity < count + 2) {
+			capacity = GROW_CAPACITY(capacity);
+			stack = (Obj**)realloc(stack, sizeof(Obj*) * capacity);
+			if (stack == NULL) exit(1); // Out of Memory
+		}
+		// The right one is popped first.
+		stack[count++] = ((ObjRope*)node)->left;
+		stack[count++] = ((ObjRope*)node)->right;
+	}
+	free(stack);
+}
+
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+	if (rope->string != NULL) return rope->string;
+
+	ObjString* string = allocateString(vm, rope->length);
+	copyRopeChars(rope, string->chars);
+	rope->string = string;
+	// The pieces aren't needed anymore, so GC can collect them.
+	rope->left = NULL;
+	rope->right = NULL;
+	return rope->string;
+}
+
+static void writeFunction(Output* output, ObjFunction* function) {
 	if (function->name == NULL) {
-		printf("<script>");
+		writeOutputString(output, "<script>");
 		return;
 	}
-	// #todo: Replace all printf() with printf_s()
-	printf("<fn %s>", function->name->chars);
+	writeOutputString(output, "<fn ");
+	writeOutput(output, function->name->chars, function->name->length);
+	writeOutputString(output, ">");
 }
 
-void printObject(Value value) {
+void writeObject(Output* output, Value value) {
 	switch (OBJ_TYPE(value)) {
 		case OBJ_BOUND_METHOD:
-			printFunction(AS_BOUND_METHOD(value)->method->function);
+			writeFunction(output, AS_BOUND_METHOD(value)->method->function);
 			break;
 		case OBJ_CLASS:
-			printf_s("%s", AS_CLASS(value)->name->chars);
+			writeOutput(output, AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
 			break;
 		case OBJ_CLOSURE:
-			printFunction(AS_CLOSURE(value)->function);
+			writeFunction(output, AS_CLOSURE(value)->function);
 			break;
 		case OBJ_FUNCTION:
-			printFunction(AS_FUNCTION(value));
+			writeFunction(output, AS_FUNCTION(value));
+			break;
+		case OBJ_INSTANCE: {
+			ObjString* name = AS_INSTANCE(value)->klass->name;
+			writeOutput(output, name->chars, name->length);
+			writeOutputString(output, " instance");
 			break;
-		case OBJ_INSTANCE:
-			printf_s("%s instance", AS_INSTANCE(value)->klass->name->chars);
+		}
+		case OBJ_MAPPED_STRING:
+			writeOutput(output, AS_MAPPED_STRING(value)->chars, AS_MAPPED_STRING(value)->length);
 			break;
 		case OBJ_NATIVE:
-			printf_s("<native fn>");
+			writeOutputString(output, "<native fn>");
 			break;
+		case OBJ_READER:
+			writeOutputString(output, "<reader>");
+			break;
+		case OBJ_REGEX: {
+			ObjString* pattern = AS_REGEX(value)->pattern;
+			writeOutputString(output, "<regex ");
+			writeOutput(output, pattern->chars, pattern->length);
+			writeOutputString(output, ">");
+			break;
+		}
+		case OBJ_ROPE: {
+			ObjRope* rope = AS_ROPE(value);
+			if (rope->string != NULL) {
+				writeOutput(output, rope->string->chars, rope->length);
+				break;
+			}
+			// Printing needs the characters but not an interned string, so the rope isn't flattened.
+			char* chars = (char*)malloc(rope->length);
+			if (chars == NULL) exit(1); // Out of Memory
+			copyRopeChars(rope, chars);
+			writeOutput(output, chars, rope->length);
+			free(chars);
+			break;
+		}
 		case OBJ_STRING:
-			printf_s("%s", AS_CSTRING(value));
+			writeOutput(output, AS_CSTRING(value), AS_STRING(value)->length);
+			break;
+		case OBJ_STRING_VIEW:
+			writeOutput(output, AS_STRING_VIEW(value)->chars, AS_STRING_VIEW(value)->length);
 			break;
 		case OBJ_UPVALUE:
 			// Upvalue is not a first class value that users can access.
-			printf("upvalue");
+			writeOutputString(output, "upvalue");
 			break;
 	}
 }
@@ -5,6 +5,8 @@
 #include "table.h"
 #include "value.h"
 
+#include <stdio.h>
+
 typedef struct VM_t VM;
 
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
@@ -14,22 +16,32 @@ typedef struct VM_t VM;
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_MAPPED_STRING(value) isObjType(value, OBJ_MAPPED_STRING)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_READER(value)       isObjType(value, OBJ_READER)
+#define IS_REGEX(value)        isObjType(value, OBJ_REGEX)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_STRING_VIEW(value)  isObjType(value, OBJ_STRING_VIEW)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_MAPPED_STRING(value) ((ObjMappedString*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
+#define AS_READER(value)       ((ObjReader*)AS_OBJ(value))
+#define AS_REGEX(value)        ((ObjRegex*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
+#define AS_STRING_VIEW(value)  ((ObjStringView*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
 // For each enum:
 // - Declare IS_XXX() and AS_XXX() macros in object.h
 // - Declare newXXX() in object.h
-// - Modify printObject() in object.c
+// - Modify writeObject() in object.c
 // - Modify freeObject() in memory.c
 typedef enum {
 	OBJ_BOUND_METHOD,
@@ -37,8 +49,13 @@ typedef enum {
 	OBJ_CLOSURE,
 	OBJ_FUNCTION,
 	OBJ_INSTANCE,
+	OBJ_MAPPED_STRING,
 	OBJ_NATIVE,
+	OBJ_READER,
+	OBJ_REGEX,
+	OBJ_ROPE,
 	OBJ_STRING,
+	OBJ_STRING_VIEW,
 	OBJ_UPVALUE,
 } ObjType;
 
@@ -55,6 +72,9 @@ struct Obj {
 	struct Obj* next;
 };
 
+// Defined in compiler.c
+typedef struct LazyFunction LazyFunction;
+
 // Function is first class citizen.
 typedef struct {
 	Obj obj;
@@ -62,6 +82,8 @@ typedef struct {
 	int upvalueCount;
 	Chunk chunk;
 	ObjString* name;
+	LazyFunction* lazy; // Not NULL if the body is not compiled yet. See compileLazyFunction().
+	int profileSite; // Index of its call count in VM.recording, or -1. See profile.h.
 } ObjFunction;
 
 // Native functions have side effect and represented in different way than ObjFunction.
@@ -69,16 +91,68 @@ typedef Value(*NativeFn)(VM* vm, int argCount, Value* args);
 
 typedef struct {
 	Obj obj;
+	ObjString* name; // Images refer to natives by name.
 	NativeFn function;
 } ObjNative;
 
+// The characters follow the header in the same allocation.
 struct ObjString {
 	Obj obj;
 	int length;
-	char* chars;
-	uint32_t hash;
+	uint32_t hash; // Computed when interned.
+	// Interned strings are in VM.strings, so equal ones are the same object. Only they can be table keys.
+	// Strings made at runtime aren't interned unless they need to be. See internString().
+	bool interned;
+	char chars[]; // length characters and the terminating null.
 };
 
+// A file read a line or a chunk at a time through a buffer. See reader.h.
+typedef struct {
+	Obj obj;
+	FILE* file; // NULL once closed.
+	char* buffer;
+	int capacity;
+	int start; // First byte not returned yet.
+	int end;   // End of the bytes read into the buffer.
+} ObjReader;
+
+// A compiled regular expression. See regex.h.
+typedef struct {
+	Obj obj;
+	ObjString* pattern;
+	// Its DFA grows as it matches, so clones compile their own rather than share it.
+	struct Regex* regex;
+} ObjRegex;
+
+// The characters of a file mapped into memory, so that reading a file doesn't copy it.
+// The length may exceed INT_MAX, and no null follows the characters.
+// Like uninterned strings, it's compared by its characters. The file is unmapped when it's freed.
+typedef struct {
+	Obj obj;
+	size_t length;
+	const char* chars;
+} ObjMappedString;
+
+// Characters of another string, so that slicing a string doesn't copy them. See text.h.
+// The view keeps its parent alive, and a view of a view shares the same parent.
+// Like uninterned strings, it's compared by its characters. No null follows the characters.
+typedef struct {
+	Obj obj;
+	size_t length;
+	const char* chars;
+	Obj* parent; // ObjString or ObjMappedString
+} ObjStringView;
+
+// A string made by concatenation, so that building a string piece by piece takes linear time.
+// Its characters are copied, hashed and interned only when they are needed. See flattenRope().
+typedef struct {
+	Obj obj;
+	int length;
+	Obj* left;  // ObjString, ObjMappedString, ObjStringView or ObjRope
+	Obj* right; // ObjString, ObjMappedString, ObjStringView or ObjRope
+	ObjString* string; // Set once flattened. Then left and right are NULL.
+} ObjRope;
+
 // Runtime representation of an upvalue.
 typedef struct ObjUpvalue {
 	Obj obj;
@@ -121,13 +195,36 @@ ObjClass*       newClass(VM* vm, ObjString* name);
 ObjClosure*     newClosure(VM* vm, ObjFunction* function);
 ObjFunction*    newFunction(VM* vm);
 ObjInstance*    newInstance(VM* vm, ObjClass* klass);
-ObjNative*      newNative(VM* vm, NativeFn function);
-ObjString*      takeString(VM* vm, char* chars, int length);
+// chars is a mapping made by mapFile(), which the string owns.
+ObjMappedString* newMappedString(VM* vm, const char* chars, size_t length);
+ObjNative*      newNative(VM* vm, ObjString* name, NativeFn function);
+// file is closed when the reader is freed.
+ObjReader*      newReader(VM* vm, FILE* file);
+// regex is compiled from pattern, and freed with the object.
+ObjRegex*       newRegex(VM* vm, ObjString* pattern, struct Regex* regex);
+// left and right are ObjString, ObjMappedString, ObjStringView or ObjRope, and length is the sum of their lengths.
+ObjRope*        newRope(VM* vm, Obj* left, Obj* right, int length);
+// An uninterned string of length characters for the caller to fill. The terminating null is set.
+ObjString*      allocateString(VM* vm, int length);
 // length does not include the terminating null.
 ObjString*      copyString(VM* vm, const char* chars, int length);
+// An uninterned string of a's characters followed by b's. a and b must be reachable by GC.
+ObjString*      concatenateStrings(VM* vm, ObjString* a, ObjString* b);
+// length characters of parent starting at chars. parent must be reachable by GC.
+ObjStringView*  newStringView(VM* vm, Obj* parent, const char* chars, size_t length);
 ObjUpvalue*     newUpvalue(VM* vm, Value* slot);
 
-void printObject(Value value);
+// A short string if it fits, otherwise an uninterned ObjString.
+Value stringValue(VM* vm, const char* chars, int length);
+// Returns the interned string equal to string, which is string itself if there was none.
+ObjString* internString(VM* vm, ObjString* string);
+// Returns a string of the rope's characters. The rope must be reachable by GC.
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+
+// Hash of the characters, by the function STRING_HASH selects.
+uint32_t hashString(const char* key, int length);
+
+void writeObject(Output* output, Value value);
 
 // Should not be a macro, if so 'value' will be evaluated twice.
 static inline bool isObjType(Value value, ObjType type) {
@@ -0,0 +1,545 @@
+#include "optimizer.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <string.h>
+
+// Give up threading if a chain of jumps is longer than this. (Also guards against cycles)
+#define MAX_JUMP_THREADING_HOPS 8
+
+// Decoded form of an instruction.
+typedef struct {
+	uint8_t op;
+	uint8_t operands[2]; // Constant index, slot, argument count, ... Unused for jumps.
+	int offset;          // Offset in the original code. OP_CLOSURE copies its upvalue pairs from here.
+	int length;          // Size after encoding.
+	int line;
+	int target;          // Index of the jump destination. -1 if not a jump.
+	bool isTarget;       // Some jump lands here.
+	bool removed;
+} Instruction;
+
+typedef struct {
+	VM* vm;
+	Chunk* chunk;
+	Instruction* instructions;
+	int count;
+	int capacity;
+} Optimizer;
+
+static bool isJump(uint8_t op) {
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP;
+}
+
+static bool hasConstantOperand(uint8_t op) {
+	switch (op) {
+		case OP_CONSTANT:
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_CLOSURE:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_IMPORT:
+		case OP_CHECK_INLINED:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Same as isFalsey() in vm.c
+static bool isFalsey(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)) || (IS_NUMBER(value) && AS_NUMBER(value) == 0.0);
+}
+
+static bool decode(Optimizer* opt) {
+	Chunk* chunk = opt->chunk;
+
+	// Map from code offset to instruction index, to resolve jump destinations.
+	int* indices = ALLOCATE(int, chunk->count + 1);
+	for (int i = 0; i <= chunk->count; ++i) {
+		indices[i] = -1;
+	}
+
+	opt->capacity = chunk->count;
+	opt->instructions = ALLOCATE(Instruction, opt->capacity);
+	opt->count = 0;
+	for (int offset = 0; offset < chunk->count;) {
+		Instruction* instruction = &opt->instructions[opt->count];
+		instruction->op = chunk->code[offset];
+		instruction->offset = offset;
+		instruction->length = instructionLength(chunk, offset);
+		instruction->line = getLine(chunk, offset);
+		instruction->target = -1;
+		instruction->isTarget = false;
+		instruction->removed = false;
+		if (!isJump(instruction->op)) {
+			for (int i = 0; i < 2 && i < instruction->length - 1; ++i) {
+				instruction->operands[i] = chunk->code[offset + 1 + i];
+			}
+		}
+		indices[offset] = opt->count++;
+		offset += instruction->length;
+	}
+
+	bool valid = true;
+	for (int i = 0; i < opt->count; ++i) {
+		Instruction* instruction = &opt->instructions[i];
+		if (!isJump(instruction->op)) continue;
+
+		int jump = (chunk->code[instruction->offset + 1] << 8) | chunk->code[instruction->offset + 2];
+		int destination = instruction->offset + 3 + (instruction->op == OP_LOOP ? -jump : jump);
+		if (destination < 0 || destination >= chunk->count || indices[destination] == -1) {
+			valid = false; // Jumps into the middle of an instruction. Leave the chunk as is.
+			break;
+		}
+		instruction->target = indices[destination];
+	}
+
+	FREE_ARRAY(int, indices, chunk->count + 1);
+	return valid;
+}
+
+// Returns the first instruction at or after index that is not removed. -1 if none.
+static int liveFrom(Optimizer* opt, int index) {
+	while (index >= 0 && index < opt->count && opt->instructions[index].removed) {
+		index++;
+	}
+	return index < opt->count ? index : -1;
+}
+
+static int nextLive(Optimizer* opt, int index) {
+	return liveFrom(opt, index + 1);
+}
+
+// Redirect jumps whose destination was removed, then mark jump destinations.
+static void markTargets(Optimizer* opt) {
+	for (int i = 0; i < opt->count; ++i) {
+		opt->instructions[i].isTarget = false;
+	}
+	for (int i = 0; i < opt->count; ++i) {
+		Instruction* instruction = &opt->instructions[i];
+		if (instruction->removed || instruction->target == -1) continue;
+
+		// Removed instructions have no effect, so landing on the next one is the same.
+		instruction->target = liveFrom(opt, instruction->target);
+		if (instruction->target != -1) {
+			opt->instructions[instruction->target].isTarget = true;
+		}
+	}
+}
+
+static bool eliminateDeadCode(Optimizer* opt) {
+	bool* reachable = ALLOCATE(bool, opt->count);
+	int* worklist = ALLOCATE(int, opt->count);
+	int worklistCount = 0;
+	for (int i = 0; i < opt->count; ++i) {
+		reachable[i] = false;
+	}
+
+	int entry = liveFrom(opt, 0);
+	if (entry != -1) {
+		reachable[entry] = true;
+		worklist[worklistCount++] = entry;
+	}
+
+	while (worklistCount > 0) {
+		int index = worklist[--worklistCount];
+		Instruction* instruction = &opt->instructions[index];
+
+		int successors[2] = { -1, -1 };
+		if (instruction->op != OP_JUMP && instruction->op != OP_LOOP && instruction->op != OP_RETURN) {
+			successors[0] = nextLive(opt, index);
+		}
+		if (instruction->target != -1) {
+			successors[1] = instruction->target;
+		}
+
+		for (int i = 0; i < 2; ++i) {
+			int successor = successors[i];
+			if (successor != -1 && !reachable[successor]) {
+				reachable[successor] = true;
+				worklist[worklistCount++] = successor;
+			}
+		}
+	}
+
+	bool changed = false;
+	for (int i = 0; i < opt->count; ++i) {
+		if (!opt->instructions[i].removed && !reachable[i]) {
+			opt->instructions[i].removed = true;
+			changed = true;
+		}
+	}
+
+	FREE_ARRAY(bool, reachable, opt->count);
+	FREE_ARRAY(int, worklist, opt->count);
+	return changed;
+}
+
+static bool threadJumps(Optimizer* opt) {
+	bool changed = false;
+	for (int i = 0; i < opt->count; ++i) {
+		Instruction* jump = &opt->instructions[i];
+		if (jump->removed || jump->target == -1) continue;
+
+		int target = jump->target;
+		for (int hops = 0; hops < MAX_JUMP_THREADING_HOPS; ++hops) {
+			Instruction* next = &opt->instructions[target];
+			// OP_JUMP_IF_FALSE does not pop the condition, so the second one sees the same value.
+			bool follow = next->op == OP_JUMP || next->op == OP_LOOP
+				|| (jump->op == OP_JUMP_IF_FALSE && next->op == OP_JUMP_IF_FALSE);
+			if (!follow || next->target == -1 || next->target == target) break;
+
+			// Offsets only shrink while encoding, so the original distance is an upper bound.
+			Instruction* destination = &opt->instructions[next->target];
+			int distance = destination->offset - (jump->offset + 3);
+			if (distance < 0) distance = -distance;
+			if (distance > UINT16_MAX) break;
+			// OP_JUMP_IF_FALSE can only jump forward.
+			if (jump->op == OP_JUMP_IF_FALSE && destination->offset < jump->offset) break;
+
+			target = next->target;
+		}
+
+		if (target != jump->target) {
+			jump->target = target;
+			changed = true;
+		}
+
+		// Jump to the next instruction does nothing.
+		if (jump->op != OP_LOOP && jump->target == nextLive(opt, i)) {
+			jump->removed = true;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static bool literalValue(Optimizer* opt, Instruction* instruction, Value* value) {
+	switch (instruction->op) {
+		case OP_CONSTANT: *value = opt->chunk->constants.values[instruction->operands[0]]; return true;
+		case OP_NIL: *value = NIL_VAL; return true;
+		case OP_TRUE: *value = BOOL_VAL(true); return true;
+		case OP_FALSE: *value = BOOL_VAL(false); return true;
+		default: return false;
+	}
+}
+
+// Turns the instruction into one that pushes the value. Returns false if the constant table is full.
+static bool setLiteral(Optimizer* opt, Instruction* instruction, Value value) {
+	if (IS_NIL(value)) {
+		instruction->op = OP_NIL;
+		instruction->length = 1;
+	} else if (IS_BOOL(value)) {
+		instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+		instruction->length = 1;
+	} else {
+		// The compiler's constant index is gone, but folding is rare enough to search linearly.
+		ValueArray* constants = &(opt->chunk->constants);
+		int constant = 0;
+		while (constant < constants->count && !valuesIdentical(constants->values[constant], value)) {
+			constant++;
+		}
+		if (constant == constants->count) {
+			constant = addConstant(opt->vm, opt->chunk, value);
+		}
+		if (constant > UINT8_MAX) return false;
+		instruction->op = OP_CONSTANT;
+		instruction->operands[0] = (uint8_t)constant;
+		instruction->length = 2;
+	}
+	return true;
+}
+
+static bool foldUnary(uint8_t op, Value a, Value* result) {
+	switch (op) {
+		case OP_NOT:
+			*result = BOOL_VAL(isFalsey(a));
+			return true;
+		case OP_NEGATE:
+			if (!IS_NUMBER(a)) return false; // Leave it for runtime error.
+			*result = NUMBER_VAL(-AS_NUMBER(a));
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool foldBinary(Optimizer* opt, uint8_t op, Value a, Value b, Value* result) {
+	// Constants don't need profiling.
+	if (op == OP_ADD_NUMBER || op == OP_ADD_PROFILED) op = OP_ADD;
+
+	if (op == OP_EQUAL) {
+		*result = BOOL_VAL(valuesEqual(a, b));
+		return true;
+	}
+
+	if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+		// Both strings are in the constant table, so GC won't collect them.
+		ObjString* string = concatenateStrings(opt->vm, AS_STRING(a), AS_STRING(b));
+		*result = OBJ_VAL(internString(opt->vm, string));
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false; // Leave it for runtime error.
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (op) {
+		case OP_GREATER:  *result = BOOL_VAL(x > y); return true;
+		case OP_LESS:     *result = BOOL_VAL(x < y); return true;
+		case OP_ADD:      *result = NUMBER_VAL(x + y); return true;
+		case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+		case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+		case OP_DIVIDE:   *result = NUMBER_VAL(x / y); return true;
+		default:          return false;
+	}
+}
+
+static bool foldConstants(Optimizer* opt) {
+	bool changed = false;
+	for (int i = liveFrom(opt, 0); i != -1; i = nextLive(opt, i)) {
+		Instruction* first = &opt->instructions[i];
+		Value a;
+		if (!literalValue(opt, first, &a)) continue;
+
+		int j = nextLive(opt, i);
+		if (j == -1) break;
+		Instruction* second = &opt->instructions[j];
+		// Folded instructions are merged into the first one, so only the first one can be a jump target.
+		if (second->isTarget) continue;
+
+		Value result;
+		if (foldUnary(second->op, a, &result)) {
+			if (setLiteral(opt, first, result)) {
+				second->removed = true;
+				changed = true;
+			}
+			continue;
+		}
+
+		// Condition is known at compile time.
+		if (second->op == OP_JUMP_IF_FALSE) {
+			if (isFalsey(a)) {
+				second->op = OP_JUMP;
+			} else {
+				second->removed = true;
+			}
+			changed = true;
+			continue;
+		}
+
+		Value b;
+		if (!literalValue(opt, second, &b)) continue;
+
+		int k = nextLive(opt, j);
+		if (k == -1) break;
+		Instruction* third = &opt->instructions[k];
+		if (third->isTarget) continue;
+
+		if (foldBinary(opt, third->op, a, b, &result) && setLiteral(opt, first, result)) {
+			second->removed = true;
+			third->removed = true;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static bool isPurePush(uint8_t op) {
+	switch (op) {
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_UPVALUE:
+		case OP_PEEK:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Returns the matching getter of a setter, or the setter itself if it's not a setter.
+static uint8_t getterOf(uint8_t op) {
+	switch (op) {
+		case OP_SET_LOCAL:   return OP_GET_LOCAL;
+		case OP_SET_UPVALUE: return OP_GET_UPVALUE;
+		case OP_SET_GLOBAL:  return OP_GET_GLOBAL;
+		default:             return op;
+	}
+}
+
+static bool eliminatePushPop(Optimizer* opt) {
+	Value* constants = opt->chunk->constants.values;
+
+	bool changed = false;
+	for (int i = liveFrom(opt, 0); i != -1; i = nextLive(opt, i)) {
+		Instruction* first = &opt->instructions[i];
+		int j = nextLive(opt, i);
+		if (j == -1) break;
+		Instruction* second = &opt->instructions[j];
+		if (second->op != OP_POP || second->isTarget) continue;
+
+		// Pushing a value and popping it immediately does nothing.
+		if (isPurePush(first->op)) {
+			first->removed = true;
+			second->removed = true;
+			changed = true;
+			continue;
+		}
+
+		// Setters leave the value on the stack, so reading it again right after popping it is redundant.
+		uint8_t getter = getterOf(first->op);
+		if (getter == first->op) continue;
+
+		int k = nextLive(opt, j);
+		if (k == -1) break;
+		Instruction* third = &opt->instructions[k];
+		if (third->op != getter || third->isTarget) continue;
+
+		bool sameVariable = (getter == OP_GET_GLOBAL)
+			? valuesEqual(constants[first->operands[0]], constants[third->operands[0]])
+			: first->operands[0] == third->operands[0];
+		if (sameVariable) {
+			second->removed = true;
+			third->removed = true;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static void encode(Optimizer* opt) {
+	Chunk* chunk = opt->chunk;
+
+	int* offsets = ALLOCATE(int, opt->count);
+	int size = 0;
+	for (int i = 0; i < opt->count; ++i) {
+		offsets[i] = size;
+		if (!opt->instructions[i].removed) size += opt->instructions[i].length;
+	}
+
+	Chunk optimized;
+	initChunk(&optimized);
+	for (int i = 0; i < opt->count; ++i) {
+		Instruction* instruction = &opt->instructions[i];
+		if (instruction->removed) continue;
+
+		uint8_t op = instruction->op;
+		int line = instruction->line;
+		if (isJump(op)) {
+			int from = offsets[i] + 3;
+			int to = offsets[instruction->target];
+			// Unconditional jumps might have been threaded to the other direction.
+			if (op != OP_JUMP_IF_FALSE) op = to >= from ? OP_JUMP : OP_LOOP;
+			int jump = to >= from ? to - from : from - to;
+			writeChunk(&optimized, op, line);
+			writeChunk(&optimized, (jump >> 8) & 0xff, line);
+			writeChunk(&optimized, jump & 0xff, line);
+		} else if (op == OP_CLOSURE) {
+			writeChunk(&optimized, op, line);
+			writeChunk(&optimized, instruction->operands[0], line);
+			// Copy (isLocal, index) pairs as is.
+			for (int j = 2; j < instruction->length; ++j) {
+				writeChunk(&optimized, chunk->code[instruction->offset + j], line);
+			}
+		} else {
+			writeChunk(&optimized, op, line);
+			for (int j = 0; j < instruction->length - 1; ++j) {
+				writeChunk(&optimized, instruction->operands[j], line);
+			}
+		}
+	}
+
+	FREE_ARRAY(int, offsets, opt->count);
+
+	// Keep the constant table and replace the code.
+	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+	chunk->code = optimized.code;
+	chunk->count = optimized.count;
+	chunk->capacity = optimized.capacity;
+	chunk->lines = optimized.lines;
+	chunk->lineCount = optimized.lineCount;
+	chunk->lineCapacity = optimized.lineCapacity;
+}
+
+// Folding leaves unused constants behind. Drop them and renumber the rest.
+static void compactConstants(Optimizer* opt) {
+	Chunk* chunk = opt->chunk;
+	int constantCount = chunk->constants.count;
+
+	int* remap = ALLOCATE(int, constantCount);
+	for (int i = 0; i < constantCount; ++i) {
+		remap[i] = -1;
+	}
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+		if (hasConstantOperand(chunk->code[offset])) {
+			remap[chunk->code[offset + 1]] = 0;
+		}
+	}
+
+	int usedCount = 0;
+	for (int i = 0; i < constantCount; ++i) {
+		if (remap[i] != -1) remap[i] = usedCount++;
+	}
+
+	if (usedCount < constantCount) {
+		// The old table is still owned by the chunk while building the new one, so GC can reach every value.
+		ValueArray constants;
+		initValueArray(&constants);
+		for (int i = 0; i < constantCount; ++i) {
+			if (remap[i] != -1) writeValueArray(&constants, chunk->constants.values[i]);
+		}
+		for (int offset = 0; offset < chunk->count;) {
+			// Length of OP_CLOSURE depends on the old index, so read it before patching.
+			int length = instructionLength(chunk, offset);
+			if (hasConstantOperand(chunk->code[offset])) {
+				chunk->code[offset + 1] = (uint8_t)remap[chunk->code[offset + 1]];
+			}
+			offset += length;
+		}
+		freeValueArray(&chunk->constants);
+		chunk->constants = constants;
+	}
+
+	FREE_ARRAY(int, remap, constantCount);
+}
+
+void optimizeChunk(VM* vm, Chunk* chunk) {
+	Optimizer opt;
+	opt.vm = vm;
+	opt.chunk = chunk;
+
+	if (decode(&opt)) {
+		bool changed = false;
+		for (bool progress = true; progress;) {
+			progress = false;
+			markTargets(&opt);
+			progress |= eliminateDeadCode(&opt);
+			markTargets(&opt);
+			progress |= threadJumps(&opt);
+			markTargets(&opt);
+			progress |= foldConstants(&opt);
+			markTargets(&opt);
+			progress |= eliminatePushPop(&opt);
+			changed |= progress;
+		}
+
+		if (changed) {
+			encode(&opt);
+			compactConstants(&opt);
+		}
+	}
+
+	FREE_ARRAY(Instruction, opt.instructions, opt.capacity);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "common.h"
+#include "chunk.h"
+
+typedef struct VM_t VM;
+
+// Rewrites a finished chunk in place.
+// - Constant folding (including string literal concatenation)
+// - Dead code elimination after unconditional jumps and returns
+// - Jump threading
+// - Redundant push/pop elimination
+// The function that owns the chunk should be reachable by GC while optimizing.
+void optimizeChunk(VM* vm, Chunk* chunk);
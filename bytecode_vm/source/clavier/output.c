@@ -0,0 +1,38 @@
+#include "output.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void writeStdout(void* context, const char* chars, size_t length) {
+	fwrite(chars, sizeof(char), length, stdout);
+	fflush(stdout);
+}
+
+void initOutput(Output* output, WriteFn write, void* context) {
+	output->write = write != NULL ? write : writeStdout;
+	output->context = context;
+	output->count = 0;
+}
+
+void writeOutput(Output* output, const char* chars, size_t length) {
+	if (output->count + length > OUTPUT_BUFFER_SIZE) {
+		flushOutput(output);
+		// Too large to buffer. Pass it through.
+		if (length > OUTPUT_BUFFER_SIZE) {
+			output->write(output->context, chars, length);
+			return;
+		}
+	}
+	memcpy(output->buffer + output->count, chars, length);
+	output->count += length;
+}
+
+void writeOutputString(Output* output, const char* string) {
+	writeOutput(output, string, strlen(string));
+}
+
+void flushOutput(Output* output) {
+	if (output->count == 0) return;
+	output->write(output->context, output->buffer, output->count);
+	output->count = 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "common.h"
+
+// #todo: Profile and find optimal size
+#define OUTPUT_BUFFER_SIZE 8192
+
+// Receives buffered output. context is what the host passed to initOutput().
+typedef void (*WriteFn)(void* context, const char* chars, size_t length);
+
+// Buffers small writes and passes them to write in large blocks.
+typedef struct {
+	WriteFn write;
+	void* context;
+	size_t count;
+	char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+// write == NULL writes to stdout.
+void initOutput(Output* output, WriteFn write, void* context);
+void writeOutput(Output* output, const char* chars, size_t length);
+void writeOutputString(Output* output, const char* string);
+void flushOutput(Output* output);
@@ -0,0 +1,129 @@
+#include "profile.h"
+#include "memory.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PROFILE_HEADER "liszt profile 1"
+
+Profile* newProfile(void) {
+	Profile* profile = ALLOCATE(Profile, 1);
+	profile->entries = NULL;
+	profile->count = 0;
+	profile->capacity = 0;
+	profile->slots = NULL;
+	profile->slotCapacity = 0;
+	return profile;
+}
+
+void freeProfile(Profile* profile) {
+	FREE_ARRAY(ProfileEntry, profile->entries, profile->capacity);
+	FREE_ARRAY(int, profile->slots, profile->slotCapacity);
+	FREE(Profile, profile);
+}
+
+uint64_t profileKey(uint64_t sourceHash, size_t offset) {
+	uint64_t key = (sourceHash ^ offset) * 0xff51afd7ed558ccdu;
+	return key ^ (key >> 33);
+}
+
+static int* findSlot(Profile* profile, int* slots, int capacity, uint64_t key) {
+	uint32_t index = (uint32_t)key & (capacity - 1);
+	for (;;) {
+		int* slot = &slots[index];
+		if (*slot == -1 || profile->entries[*slot].key == key) return slot;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static void growSlots(Profile* profile) {
+	int capacity = GROW_CAPACITY(profile->slotCapacity);
+	int* slots = ALLOCATE(int, capacity);
+	for (int i = 0; i < capacity; ++i) {
+		slots[i] = -1;
+	}
+	for (int i = 0; i < profile->count; ++i) {
+		*findSlot(profile, slots, capacity, profile->entries[i].key) = i;
+	}
+	FREE_ARRAY(int, profile->slots, profile->slotCapacity);
+	profile->slots = slots;
+	profile->slotCapacity = capacity;
+}
+
+int profileSite(Profile* profile, uint64_t key) {
+	if (profile->count + 1 > profile->slotCapacity / 2) {
+		growSlots(profile);
+	}
+	int* slot = findSlot(profile, profile->slots, profile->slotCapacity, key);
+	if (*slot != -1) return *slot;
+
+	if (profile->count + 1 > profile->capacity) {
+		int oldCapacity = profile->capacity;
+		profile->capacity = GROW_CAPACITY(oldCapacity);
+		profile->entries = GROW_ARRAY(ProfileEntry, profile->entries, oldCapacity, profile->capacity);
+	}
+	ProfileEntry* entry = &profile->entries[profile->count];
+	entry->key = key;
+	entry->count = 0;
+	*slot = profile->count;
+	return profile->count++;
+}
+
+uint32_t profileCount(Profile* profile, uint64_t key) {
+	if (profile->count == 0) return 0;
+	int slot = *findSlot(profile, profile->slots, profile->slotCapacity, key);
+	return slot != -1 ? profile->entries[slot].count : 0;
+}
+
+Profile* readProfile(const char* path) {
+	FILE* file;
+	if (fopen_s(&file, path, "r") != 0 || file == NULL) {
+		fprintf_s(stderr, "Could not open profile \"%s\".\n", path);
+		return NULL;
+	}
+
+	char header[sizeof(PROFILE_HEADER) + 1];
+	if (fgets(header, sizeof(header), file) == NULL || strncmp(header, PROFILE_HEADER "\n", sizeof(header)) != 0) {
+		fprintf_s(stderr, "Could not read profile \"%s\": not a profile.\n", path);
+		fclose(file);
+		return NULL;
+	}
+
+	Profile* profile = newProfile();
+	unsigned long long key;
+	unsigned int count;
+	while (fscanf_s(file, "%llx %u", &key, &count) == 2) {
+		int site = profileSite(profile, key);
+		profile->entries[site].count = count;
+	}
+	bool valid = feof(file);
+	fclose(file);
+
+	if (!valid) {
+		fprintf_s(stderr, "Could not read profile \"%s\": corrupt.\n", path);
+		freeProfile(profile);
+		return NULL;
+	}
+	return profile;
+}
+
+bool writeProfile(Profile* profile, const char* path) {
+	FILE* file;
+	if (fopen_s(&file, path, "w") != 0 || file == NULL) {
+		fprintf_s(stderr, "Could not write file \"%s\".\n", path);
+		return false;
+	}
+
+	fprintf_s(file, PROFILE_HEADER "\n");
+	for (int i = 0; i < profile->count; ++i) {
+		// Sites that never ran tell nothing.
+		if (profile->entries[i].count == 0) continue;
+		fprintf_s(file, "%016llx %u\n", (unsigned long long)profile->entries[i].key, profile->entries[i].count);
+	}
+	bool written = !ferror(file);
+	written = fclose(file) == 0 && written;
+	if (!written) {
+		fprintf_s(stderr, "Could not write file \"%s\".\n", path);
+	}
+	return written;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "common.h"
+CPLUSPLUS_BEGIN
+
+// Observations of a run, for compiling the same sources better in later runs.
+// Entries are keyed by a source position, so they apply while the source doesn't change:
+//   the '(' of a function's parameter list: how many times it was called.
+//   the '+' of an addition: PROFILE_* bits of the operands seen.
+// The VM records into VM.recording and the compiler uses VM.profile. Both are owned by the host.
+
+#define PROFILE_NUMBERS 1
+#define PROFILE_STRINGS 2
+#define PROFILE_OTHER   4
+
+typedef struct {
+	uint64_t key;
+	uint32_t count;
+} ProfileEntry;
+
+typedef struct Profile {
+	ProfileEntry* entries;
+	int count;
+	int capacity;
+	// Open addressing hash table from a key to the index of its entry. -1 for empty slot.
+	int* slots;
+	int slotCapacity;
+} Profile;
+
+Profile* newProfile(void);
+void freeProfile(Profile* profile);
+// Returns NULL and reports the error to stderr if the file can't be read.
+Profile* readProfile(const char* path);
+// Returns false and reports the error to stderr on failure.
+bool writeProfile(Profile* profile, const char* path);
+
+// Key of a position in a source with the given hashBytes().
+uint64_t profileKey(uint64_t sourceHash, size_t offset);
+// Index of the entry for key. Added with count 0 if missing.
+// Indices don't change, so instrumented code refers to entries by index.
+int profileSite(Profile* profile, uint64_t key);
+// 0 if there is no entry for key.
+uint32_t profileCount(Profile* profile, uint64_t key);
+
+CPLUSPLUS_END
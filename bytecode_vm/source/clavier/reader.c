@@ -0,0 +1,126 @@
+#include "reader.h"
+#include "memory.h"
+#include "object.h"
+#include "text.h"
+
+#include <limits.h>
+#include <string.h>
+
+static ObjReader* readerArgument(VM* vm, const char* name, int expected, int argCount, Value* args) {
+	if (argCount != expected) {
+		runtimeError(vm, "[%s] Invalid number of arguments: %d was expected, but %d was given", name, expected, argCount);
+		return NULL;
+	}
+	if (!IS_READER(args[0])) {
+		runtimeError(vm, "[%s] The first argument is not a reader", name);
+		return NULL;
+	}
+	return AS_READER(args[0]);
+}
+
+// Moves the bytes not returned yet to the front of the buffer, and reads more after them.
+// The buffer grows if they fill it. Returns false if nothing more was read.
+// The reader must be reachable by GC, as growing the buffer might trigger it.
+static bool fillReader(ObjReader* reader) {
+	if (reader->file == NULL) return false;
+
+	if (reader->start > 0) {
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	if (reader->end == reader->capacity) {
+		if (reader->capacity > INT_MAX / 2) return false;
+		int capacity = GROW_CAPACITY(reader->capacity);
+		reader->buffer = GROW_ARRAY(char, reader->buffer, reader->capacity, capacity);
+		reader->capacity = capacity;
+	}
+
+	size_t count = fread(reader->buffer + reader->end, sizeof(char), reader->capacity - reader->end, reader->file);
+	reader->end += (int)count;
+	return count > 0;
+}
+
+// Returns the next length bytes as a string, and consumes them and the skipped bytes after them.
+static Value takeBytes(VM* vm, ObjReader* reader, int length, int skipped) {
+	Value string = stringValue(vm, reader->buffer + reader->start, length);
+	reader->start += length + skipped;
+	return string;
+}
+
+static Value openReaderNative(VM* vm, int argCount, Value* args) {
+	if (argCount != 1) {
+		runtimeError(vm, "[openReaderNative] Invalid number of arguments: 1 was expected, but %d was given", argCount);
+		return NIL_VAL;
+	}
+	ObjString* path = stringArgument(vm, "openReaderNative", args, 0);
+	if (path == NULL) return NIL_VAL;
+
+	FILE* file;
+	fopen_s(&file, path->chars, "rb");
+	if (file == NULL) {
+		runtimeError(vm, "[openReaderNative] Failed to open file: %s", path->chars);
+		return NIL_VAL;
+	}
+	return OBJ_VAL(newReader(vm, file));
+}
+
+static Value readLineNative(VM* vm, int argCount, Value* args) {
+	ObjReader* reader = readerArgument(vm, "readLineNative", 1, argCount, args);
+	if (reader == NULL) return NIL_VAL;
+
+	// Bytes searched for a line break aren't searched again after more are read.
+	int searched = 0;
+	for (;;) {
+		const char* line = reader->buffer + reader->start;
+		const char* newline = (const char*)memchr(line + searched, '\n', reader->end - reader->start - searched);
+		if (newline != NULL) {
+			int length = (int)(newline - line);
+			if (length > 0 && line[length - 1] == '\r') {
+				return takeBytes(vm, reader, length - 1, 2);
+			}
+			return takeBytes(vm, reader, length, 1);
+		}
+		searched = reader->end - reader->start;
+		if (!fillReader(reader)) break;
+	}
+
+	// The last line may not end with a line break.
+	if (reader->start == reader->end) return NIL_VAL;
+	return takeBytes(vm, reader, reader->end - reader->start, 0);
+}
+
+static Value readChunkNative(VM* vm, int argCount, Value* args) {
+	ObjReader* reader = readerArgument(vm, "readChunkNative", 2, argCount, args);
+	if (reader == NULL) return NIL_VAL;
+	if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1 || AS_NUMBER(args[1]) > INT_MAX / 2) {
+		runtimeError(vm, "[readChunkNative] The size is not a positive number of bytes");
+		return NIL_VAL;
+	}
+
+	int size = (int)AS_NUMBER(args[1]);
+	while (reader->end - reader->start < size && fillReader(reader)) {}
+
+	int available = reader->end - reader->start;
+	if (available == 0) return NIL_VAL;
+	return takeBytes(vm, reader, available < size ? available : size, 0);
+}
+
+static Value closeReaderNative(VM* vm, int argCount, Value* args) {
+	ObjReader* reader = readerArgument(vm, "closeReaderNative", 1, argCount, args);
+	if (reader == NULL) return NIL_VAL;
+
+	if (reader->file != NULL) {
+		fclose(reader->file);
+		reader->file = NULL;
+	}
+	reader->start = reader->end;
+	return NIL_VAL;
+}
+
+void defineReaderNatives(VM* vm) {
+	defineNative(vm, "openReader", openReaderNative);
+	defineNative(vm, "readLine", readLineNative);
+	defineNative(vm, "readChunk", readChunkNative);
+	defineNative(vm, "closeReader", closeReaderNative);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "common.h"
+CPLUSPLUS_BEGIN
+
+#include "vm.h"
+
+// Natives that read a file a line or a chunk at a time, so memory doesn't grow with the file:
+//   openReader(path)      A reader of the file. It's a runtime error if the file can't be opened.
+//   readLine(reader)      The next line without its "\n" or "\r\n", or nil at the end of the file.
+//   readChunk(reader, n)  The next n bytes, fewer at the end of the file, or nil at the end.
+//   closeReader(reader)   Closes the file, which GC does otherwise. A closed reader reads nil.
+// A reader's buffer grows only to hold the longest line or chunk read.
+void defineReaderNatives(VM* vm);
+
+CPLUSPLUS_END
@@ -0,0 +1,928 @@
+#include "regex.h"
+#include "memory.h"
+#include "object.h"
+#include "text.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Limits that keep compiling and matching bounded.
+#define REGEX_DEPTH_MAX   1000  // Nested groups and repetitions
+#define REGEX_REPEAT_MAX  1000  // Counts of {m,n}
+#define REGEX_PROGRAM_MAX 65536 // Instructions of a compiled pattern
+#define DFA_STATE_MAX     4096  // States a DFA keeps. It starts over when it has more.
+
+#define DFA_UNKNOWN -1 // A transition not computed yet
+#define DFA_DEAD     0 // The state without NFA states. Nothing matches from it.
+#define DFA_START    1
+
+// Memory of a compiled pattern is owned by its ObjRegex rather than managed by GC.
+static void* growBuffer(void* buffer, size_t size) {
+	void* result = realloc(buffer, size);
+	if (result == NULL) exit(1); // Out of Memory
+	return result;
+}
+
+typedef struct {
+	uint32_t bits[8];
+} ByteSet;
+
+static void addByte(ByteSet* set, int byte) {
+	set->bits[byte >> 5] |= 1u << (byte & 31);
+}
+
+static bool hasByte(const ByteSet* set, int byte) {
+	return (set->bits[byte >> 5] >> (byte & 31)) & 1;
+}
+
+static void addRange(ByteSet* set, int from, int to) {
+	for (int byte = from; byte <= to; ++byte) addByte(set, byte);
+}
+
+static void invertSet(ByteSet* set) {
+	for (int i = 0; i < 8; ++i) set->bits[i] = ~set->bits[i];
+}
+
+// Parsing //
+
+typedef enum {
+	NODE_EMPTY,
+	NODE_SET,       // A byte of the set
+	NODE_CONCAT,    // The children one after another
+	NODE_ALTERNATE, // One of the children
+	NODE_REPEAT,    // The child from min to max times
+} NodeType;
+
+typedef struct {
+	NodeType type;
+	int first; // First child in Parser.children, or the child of NODE_REPEAT
+	int count; // Children of NODE_CONCAT and NODE_ALTERNATE
+	int set;   // Index of the set of NODE_SET
+	int min;
+	int max;   // -1 if unbounded
+} Node;
+
+typedef struct {
+	const char* current;
+	const char* end;
+	const char* error;
+	Node* nodes;
+	int nodeCount;
+	int nodeCapacity;
+	int* children;
+	int childCount;
+	int childCapacity;
+	ByteSet* sets;
+	int setCount;
+	int setCapacity;
+} Parser;
+
+static int fail(Parser* parser, const char* error) {
+	if (parser->error == NULL) parser->error = error;
+	return -1;
+}
+
+static int addNode(Parser* parser, NodeType type) {
+	if (parser->nodeCount == parser->nodeCapacity) {
+		parser->nodeCapacity = GROW_CAPACITY(parser->nodeCapacity);
+		parser->nodes = (Node*)growBuffer(parser->nodes, sizeof(Node) * parser->nodeCapacity);
+	}
+	Node* node = &parser->nodes[parser->nodeCount];
+	node->type = type;
+	node->first = 0;
+	node->count = 0;
+	node->set = 0;
+	node->min = 0;
+	node->max = 0;
+	return parser->nodeCount++;
+}
+
+static int addSetNode(Parser* parser, const ByteSet* set) {
+	if (parser->setCount == parser->setCapacity) {
+		parser->setCapacity = GROW_CAPACITY(parser->setCapacity);
+		parser->sets = (ByteSet*)growBuffer(parser->sets, sizeof(ByteSet) * parser->setCapacity);
+	}
+	parser->sets[parser->setCount] = *set;
+	int node = addNode(parser, NODE_SET);
+	parser->nodes[node].set = parser->setCount++;
+	return node;
+}
+
+// Makes a node of the items. A single item is returned as it is.
+static int addListNode(Parser* parser, NodeType type, const int* items, int count) {
+	if (count == 0) return addNode(parser, NODE_EMPTY);
+	if (count == 1) return items[0];
+	if (parser->childCount + count > parser->childCapacity) {
+		while (parser->childCount + count > parser->childCapacity) {
+			parser->childCapacity = GROW_CAPACITY(parser->childCapacity);
+		}
+		parser->children = (int*)growBuffer(parser->children, sizeof(int) * parser->childCapacity);
+	}
+	memcpy_s(parser->children + parser->childCount, sizeof(int) * count, items, sizeof(int) * count);
+	int node = addNode(parser, type);
+	parser->nodes[node].first = parser->childCount;
+	parser->nodes[node].count = count;
+	parser->childCount += count;
+	return node;
+}
+
+static bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+static bool isAlphanumeric(char c) {
+	return isDigit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Parses what follows a backslash, and adds the bytes it stands for to set.
+// Returns the byte, -2 for a class like \d, or -1 if it's invalid.
+static int parseEscape(Parser* parser, ByteSet* set) {
+	if (parser->current == parser->end) return fail(parser, "Missing character after \\");
+
+	char c = *parser->current++;
+	int byte = -2;
+	ByteSet escaped = { 0 };
+	switch (c) {
+		case 'd': case 'D':
+			addRange(&escaped, '0', '9');
+			break;
+		case 'w': case 'W':
+			addRange(&escaped, 'a', 'z');
+			addRange(&escaped, 'A', 'Z');
+			addRange(&escaped, '0', '9');
+			addByte(&escaped, '_');
+			break;
+		case 's': case 'S':
+			addByte(&escaped, ' ');
+			addRange(&escaped, '\t', '\r'); // \t \n \v \f \r
+			break;
+		case 'n': byte = '\n'; break;
+		case 'r': byte = '\r'; break;
+		case 't': byte = '\t'; break;
+		case 'f': byte = '\f'; break;
+		case 'v': byte = '\v'; break;
+		case '0': byte = '\0'; break;
+		default:
+			// Escaped punctuation stands for itself. Letters are reserved for classes.
+			if (isAlphanumeric(c)) return fail(parser, "Unknown escape");
+			byte = (uint8_t)c;
+			break;
+	}
+	if (byte >= 0) {
+		addByte(&escaped, byte);
+	} else if (c == 'D' || c == 'W' || c == 'S') {
+		invertSet(&escaped);
+	}
+	for (int i = 0; i < 8; ++i) set->bits[i] |= escaped.bits[i];
+	return byte;
+}
+
+// A byte in brackets, or a class like \d. Returns the byte, -2 for a class, or -1 if invalid.
+static int parseClassItem(Parser* parser, ByteSet* set) {
+	if (parser->current == parser->end) return fail(parser, "Missing ]");
+	char c = *parser->current++;
+	if (c == '\\') return parseEscape(parser, set);
+	addByte(set, (uint8_t)c);
+	return (uint8_t)c;
+}
+
+// After the opening bracket. A ] right after [ or [^ stands for itself.
+static int parseClass(Parser* parser) {
+	ByteSet set = { 0 };
+	bool negated = parser->current < parser->end && *parser->current == '^';
+	if (negated) parser->current++;
+
+	bool first = true;
+	for (;;) {
+		if (parser->current == parser->end) return fail(parser, "Missing ]");
+		if (*parser->current == ']' && !first) {
+			parser->current++;
+			break;
+		}
+		first = false;
+
+		int low = parseClassItem(parser, &set);
+		if (low == -1) return -1;
+		if (parser->end - parser->current >= 2 && parser->current[0] == '-' && parser->current[1] != ']') {
+			parser->current++;
+			int high = parseClassItem(parser, &set);
+			if (high == -1) return -1;
+			if (low < 0 || high < low) return fail(parser, "Invalid range in []");
+			addRange(&set, low, high);
+		}
+	}
+
+	if (negated) invertSet(&set);
+	return addSetNode(parser, &set);
+}
+
+static int parseAlternate(Parser* parser, int depth);
+
+static int parseAtom(Parser* parser, int depth) {
+	char c = *parser->current++;
+	switch (c) {
+		case '(': {
+			if (depth == REGEX_DEPTH_MAX) return fail(parser, "Pattern is nested too deeply");
+			if (parser->end - parser->current >= 2 && parser->current[0] == '?' && parser->current[1] == ':') {
+				parser->current += 2;
+			}
+			int node = parseAlternate(parser, depth + 1);
+			if (node == -1) return -1;
+			if (parser->current == parser->end || *parser->current != ')') return fail(parser, "Missing )");
+			parser->current++;
+			return node;
+		}
+		case '[':
+			return parseClass(parser);
+		case '.': {
+			ByteSet set = { 0 };
+			addByte(&set, '\n');
+			invertSet(&set);
+			return addSetNode(parser, &set);
+		}
+		case '\\': {
+			ByteSet set = { 0 };
+			if (parseEscape(parser, &set) == -1) return -1;
+			return addSetNode(parser, &set);
+		}
+		case '*': case '+': case '?': case '{':
+			return fail(parser, "Nothing to repeat");
+		case '^': case '$':
+			return fail(parser, "^ and $ are only supported at the ends of a pattern");
+		default: {
+			ByteSet set = { 0 };
+			addByte(&set, (uint8_t)c);
+			return addSetNode(parser, &set);
+		}
+	}
+}
+
+// Parses a count of {m,n}. Returns -1 if there is none or it's too large.
+static int parseCount(Parser* parser) {
+	if (parser->current == parser->end || !isDigit(*parser->current)) return -1;
+	int count = 0;
+	while (parser->current < parser->end && isDigit(*parser->current)) {
+		count = count * 10 + (*parser->current++ - '0');
+		if (count > REGEX_REPEAT_MAX) return fail(parser, "Repetition count is too large");
+	}
+	return count;
+}
+
+static int parseRepeat(Parser* parser, int depth) {
+	int node = parseAtom(parser, depth);
+	while (node != -1 && parser->current < parser->end) {
+		int min, max;
+		char c = *parser->current;
+		if (c == '*') {
+			min = 0;
+			max = -1;
+		} else if (c == '+') {
+			min = 1;
+			max = -1;
+		} else if (c == '?') {
+			min = 0;
+			max = 1;
+		} else if (c == '{') {
+			parser->current++;
+			min = parseCount(parser);
+			max = min;
+			if (min != -1 && parser->current < parser->end && *parser->current == ',') {
+				parser->current++;
+				bool unbounded = parser->current < parser->end && *parser->current == '}';
+				max = unbounded ? -1 : parseCount(parser);
+				if (!unbounded && max == -1) min = -1;
+			}
+			if (min == -1 || parser->current == parser->end || *parser->current != '}' || (max != -1 && max < min)) {
+				return fail(parser, "Invalid repetition {}");
+			}
+		} else {
+			break;
+		}
+		parser->current++;
+
+		int repeat = addNode(parser, NODE_REPEAT);
+		parser->nodes[repeat].first = node;
+		parser->nodes[repeat].min = min;
+		parser->nodes[repeat].max = max;
+		node = repeat;
+	}
+	return node;
+}
+
+static int parseConcat(Parser* parser, int depth) {
+	int* items = NULL;
+	int count = 0;
+	int capacity = 0;
+	while (parser->current < parser->end && *parser->current != '|' && *parser->current != ')') {
+		int item = parseRepeat(parser, depth);
+		if (item == -1) {
+			free(items);
+			return -1;
+		}
+		if (count == capacity) {
+			capacity = GROW_CAPACITY(capacity);
+			items = (int*)growBuffer(items, sizeof(int) * capacity);
+		}
+		items[count++] = item;
+	}
+	int node = addListNode(parser, NODE_CONCAT, items, count);
+	free(items);
+	return node;
+}
+
+static int parseAlternate(Parser* parser, int depth) {
+	int* items = NULL;
+	int count = 0;
+	int capacity = 0;
+	for (;;) {
+		int item = parseConcat(parser, depth);
+		if (item == -1) {
+			free(items);
+			return -1;
+		}
+		if (count == capacity) {
+			capacity = GROW_CAPACITY(capacity);
+			items = (int*)growBuffer(items, sizeof(int) * capacity);
+		}
+		items[count++] = item;
+		if (parser->current == parser->end || *parser->current != '|') break;
+		parser->current++;
+	}
+	int node = addListNode(parser, NODE_ALTERNATE, items, count);
+	free(items);
+	return node;
+}
+
+// Compiling //
+
+// A Thompson NFA. Byte instructions consume a byte of their set, the others none.
+typedef enum {
+	INST_BYTE,
+	INST_SPLIT, // Continues at both next and alt
+	INST_MATCH,
+} InstOp;
+
+typedef struct {
+	InstOp op;
+	int next;
+	int alt;
+	int set;
+} Inst;
+
+// NFA states, in the order added. Sparse sets, so clearing one is O(1).
+typedef struct {
+	int* dense;
+	int* sparse;
+	size_t* starts; // Where the thread of each state started matching, by dense index
+	int count;
+} StateSet;
+
+typedef struct {
+	int first; // Its NFA states in Dfa.pcs
+	int count;
+	bool accepting;
+} DfaState;
+
+// Sets of NFA states built as the text needs them, so matching is a table lookup per byte.
+typedef struct {
+	// The start state is added after each byte, so matches can start anywhere.
+	bool unanchored;
+	DfaState* states;
+	int count;
+	int capacity;
+	int* pcs;
+	int pcCount;
+	int pcCapacity;
+	int* next; // Transitions by state and byte class. DFA_UNKNOWN until computed.
+	int* table; // States by their NFA states. Open addressing of index + 1, 0 is empty.
+	int tableCapacity;
+} Dfa;
+
+struct Regex {
+	Inst* program;
+	int count;
+	int capacity;
+	int start;
+	int match;
+	ByteSet* sets;
+	int setCount;
+	bool anchorStart;
+	bool anchorEnd;
+	// Bytes no set tells apart share a class, so DFA states have a transition per class.
+	uint8_t byteClass[256];
+	int classCount;
+	Dfa anchored;
+	Dfa unanchored;
+	// Scratch space sized by the program.
+	StateSet current;
+	StateSet following;
+	int* stack;
+	int* keys;  // NFA states of the DFA state being made
+	int* saved; // Keys kept while the DFA starts over
+};
+
+static int emit(Regex* regex, Parser* parser, InstOp op, int next, int alt, int set) {
+	if (regex->count == REGEX_PROGRAM_MAX) return fail(parser, "Pattern is too large");
+	if (regex->count == regex->capacity) {
+		regex->capacity = GROW_CAPACITY(regex->capacity);
+		regex->program = (Inst*)growBuffer(regex->program, sizeof(Inst) * regex->capacity);
+	}
+	Inst* inst = &regex->program[regex->count];
+	inst->op = op;
+	inst->next = next;
+	inst->alt = alt;
+	inst->set = set;
+	return regex->count++;
+}
+
+// Compiles the node to continue at next. Returns where it starts, or -1 if the program is too large.
+static int compileNode(Regex* regex, Parser* parser, int index, int next, int depth) {
+	if (depth == REGEX_DEPTH_MAX) return fail(parser, "Pattern is nested too deeply");
+	Node node = parser->nodes[index];
+	switch (node.type) {
+		case NODE_EMPTY:
+			return next;
+		case NODE_SET:
+			return emit(regex, parser, INST_BYTE, next, -1, node.set);
+		case NODE_CONCAT:
+			for (int i = node.count - 1; i >= 0 && next != -1; --i) {
+				next = compileNode(regex, parser, parser->children[node.first + i], next, depth + 1);
+			}
+			return next;
+		case NODE_ALTERNATE: {
+			int entry = compileNode(regex, parser, parser->children[node.first + node.count - 1], next, depth + 1);
+			for (int i = node.count - 2; i >= 0 && entry != -1; --i) {
+				int branch = compileNode(regex, parser, parser->children[node.first + i], next, depth + 1);
+				if (branch == -1) return -1;
+				entry = emit(regex, parser, INST_SPLIT, branch, entry, 0);
+			}
+			return entry;
+		}
+		case NODE_REPEAT: {
+			int entry = next;
+			if (node.max == -1) {
+				// A loop back to a split between another time and what follows.
+				int split = emit(regex, parser, INST_SPLIT, -1, next, 0);
+				if (split == -1) return -1;
+				int body = compileNode(regex, parser, node.first, split, depth + 1);
+				if (body == -1) return -1;
+				regex->program[split].next = body;
+				entry = split;
+			} else {
+				// The optional times, each skippable.
+				for (int i = node.min; i < node.max && entry != -1; ++i) {
+					int body = compileNode(regex, parser, node.first, entry, depth + 1);
+					if (body == -1) return -1;
+					entry = emit(regex, parser, INST_SPLIT, body, entry, 0);
+				}
+			}
+			for (int i = 0; i < node.min && entry != -1; ++i) {
+				entry = compileNode(regex, parser, node.first, entry, depth + 1);
+			}
+			return entry;
+		}
+	}
+	return -1;
+}
+
+static void computeByteClasses(Regex* regex) {
+	memset(regex->byteClass, 0, sizeof(regex->byteClass));
+	regex->classCount = 1;
+	for (int i = 0; i < regex->setCount; ++i) {
+		// Splits each class into the bytes in the set and those not.
+		int classes[512];
+		for (int k = 0; k < regex->classCount * 2; ++k) classes[k] = -1;
+		int count = 0;
+		for (int byte = 0; byte < 256; ++byte) {
+			int key = regex->byteClass[byte] * 2 + hasByte(&regex->sets[i], byte);
+			if (classes[key] == -1) classes[key] = count++;
+			regex->byteClass[byte] = (uint8_t)classes[key];
+		}
+		regex->classCount = count;
+	}
+}
+
+static void initStateSet(StateSet* set, int size) {
+	set->dense = (int*)growBuffer(NULL, sizeof(int) * size);
+	set->sparse = (int*)calloc(size, sizeof(int));
+	if (set->sparse == NULL) exit(1); // Out of Memory
+	set->starts = (size_t*)growBuffer(NULL, sizeof(size_t) * size);
+	set->count = 0;
+}
+
+static void freeStateSet(StateSet* set) {
+	free(set->dense);
+	free(set->sparse);
+	free(set->starts);
+}
+
+static bool hasState(const StateSet* set, int pc) {
+	int index = set->sparse[pc];
+	return index < set->count && set->dense[index] == pc;
+}
+
+static void insertState(StateSet* set, int pc, size_t start) {
+	set->sparse[pc] = set->count;
+	set->dense[set->count] = pc;
+	set->starts[set->count] = start;
+	set->count++;
+}
+
+static void initDfa(Dfa* dfa, bool unanchored) {
+	dfa->unanchored = unanchored;
+	dfa->states = NULL;
+	dfa->count = 0;
+	dfa->capacity = 0;
+	dfa->pcs = NULL;
+	dfa->pcCount = 0;
+	dfa->pcCapacity = 0;
+	dfa->next = NULL;
+	dfa->table = NULL;
+	dfa->tableCapacity = 0;
+}
+
+static void freeDfa(Dfa* dfa) {
+	free(dfa->states);
+	free(dfa->pcs);
+	free(dfa->next);
+	free(dfa->table);
+}
+
+Regex* compileRegex(const char* pattern, size_t length, const char** error) {
+	Parser parser;
+	parser.current = pattern;
+	parser.end = pattern + length;
+	parser.error = NULL;
+	parser.nodes = NULL;
+	parser.nodeCount = 0;
+	parser.nodeCapacity = 0;
+	parser.children = NULL;
+	parser.childCount = 0;
+	parser.childCapacity = 0;
+	parser.sets = NULL;
+	parser.setCount = 0;
+	parser.setCapacity = 0;
+
+	// A $ at the end anchors unless it's escaped, that is after an odd number of backslashes.
+	bool anchorStart = length > 0 && pattern[0] == '^';
+	if (anchorStart) parser.current++;
+	bool anchorEnd = false;
+	if (parser.end > parser.current && parser.end[-1] == '$') {
+		const char* backslash = parser.end - 1;
+		while (backslash > parser.current && backslash[-1] == '\\') --backslash;
+		anchorEnd = (parser.end - 1 - backslash) % 2 == 0;
+		if (anchorEnd) parser.end--;
+	}
+
+	int root = parseAlternate(&parser, 0);
+	if (root != -1 && parser.current != parser.end) fail(&parser, "Unmatched )");
+	if (root != -1 && (anchorStart || anchorEnd) && parser.nodes[root].type == NODE_ALTERNATE) {
+		fail(&parser, "^ and $ can't anchor a | outside of parentheses");
+	}
+
+	Regex* regex = (Regex*)growBuffer(NULL, sizeof(Regex));
+	regex->program = NULL;
+	regex->count = 0;
+	regex->capacity = 0;
+	regex->sets = parser.sets;
+	regex->setCount = parser.setCount;
+	regex->anchorStart = anchorStart;
+	regex->anchorEnd = anchorEnd;
+	if (parser.error == NULL) {
+		regex->match = emit(regex, &parser, INST_MATCH, -1, -1, 0);
+		regex->start = compileNode(regex, &parser, root, regex->match, 0);
+	}
+	free(parser.nodes);
+	free(parser.children);
+	if (parser.error != NULL) {
+		*error = parser.error;
+		free(regex->program);
+		free(regex->sets);
+		free(regex);
+		return NULL;
+	}
+
+	computeByteClasses(regex);
+	initDfa(&regex->anchored, false);
+	initDfa(&regex->unanchored, true);
+	initStateSet(&regex->current, regex->count);
+	initStateSet(&regex->following, regex->count);
+	regex->stack = (int*)growBuffer(NULL, sizeof(int) * regex->count);
+	regex->keys = (int*)growBuffer(NULL, sizeof(int) * regex->count);
+	regex->saved = (int*)growBuffer(NULL, sizeof(int) * regex->count);
+	return regex;
+}
+
+void freeRegex(Regex* regex) {
+	if (regex == NULL) return;
+	free(regex->program);
+	free(regex->sets);
+	freeDfa(&regex->anchored);
+	freeDfa(&regex->unanchored);
+	freeStateSet(&regex->current);
+	freeStateSet(&regex->following);
+	free(regex->stack);
+	free(regex->keys);
+	free(regex->saved);
+	free(regex);
+}
+
+// Matching //
+
+// Adds pc and the instructions it reaches without consuming a byte, for a thread started at start.
+static void addThread(Regex* regex, StateSet* set, int pc, size_t start) {
+	if (hasState(set, pc)) return;
+	insertState(set, pc, start);
+	int top = 0;
+	regex->stack[top++] = pc;
+	while (top > 0) {
+		const Inst* inst = &regex->program[regex->stack[--top]];
+		if (inst->op != INST_SPLIT) continue;
+		if (!hasState(set, inst->alt)) {
+			insertState(set, inst->alt, start);
+			regex->stack[top++] = inst->alt;
+		}
+		if (!hasState(set, inst->next)) {
+			insertState(set, inst->next, start);
+			regex->stack[top++] = inst->next;
+		}
+	}
+}
+
+static uint32_t hashStates(const int* pcs, int count) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < count; ++i) {
+		hash ^= (uint32_t)pcs[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int compareStates(const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+static void insertDfaIndex(Dfa* dfa, int index) {
+	const DfaState* state = &dfa->states[index];
+	uint32_t slot = hashStates(dfa->pcs + state->first, state->count) & (dfa->tableCapacity - 1);
+	while (dfa->table[slot] != 0) slot = (slot + 1) & (dfa->tableCapacity - 1);
+	dfa->table[slot] = index + 1;
+}
+
+// The state of the NFA states in keys, added if it's new. Returns -1 if the DFA is full.
+static int addDfaState(Regex* regex, Dfa* dfa, int* keys, int count) {
+	// Sorted, so the same states make the same key in any order.
+	qsort(keys, count, sizeof(int), compareStates);
+	uint32_t hash = hashStates(keys, count);
+	if (dfa->tableCapacity > 0) {
+		uint32_t slot = hash & (dfa->tableCapacity - 1);
+		for (; dfa->table[slot] != 0; slot = (slot + 1) & (dfa->tableCapacity - 1)) {
+			const DfaState* state = &dfa->states[dfa->table[slot] - 1];
+			if (state->count == count && memcmp(dfa->pcs + state->first, keys, sizeof(int) * count) == 0) {
+				return dfa->table[slot] - 1;
+			}
+		}
+	}
+	if (dfa->count == DFA_STATE_MAX) return -1;
+
+	if (dfa->count == dfa->capacity) {
+		dfa->capacity = GROW_CAPACITY(dfa->capacity);
+		dfa->states = (DfaState*)growBuffer(dfa->states, sizeof(DfaState) * dfa->capacity);
+		dfa->next = (int*)growBuffer(dfa->next, sizeof(int) * dfa->capacity * regex->classCount);
+	}
+	while (dfa->pcCount + count > dfa->pcCapacity) {
+		dfa->pcCapacity = GROW_CAPACITY(dfa->pcCapacity);
+		dfa->pcs = (int*)growBuffer(dfa->pcs, sizeof(int) * dfa->pcCapacity);
+	}
+	int index = dfa->count++;
+	DfaState* state = &dfa->states[index];
+	state->first = dfa->pcCount;
+	state->count = count;
+	state->accepting = false;
+	for (int i = 0; i < count; ++i) {
+		if (keys[i] == regex->match) state->accepting = true;
+	}
+	if (count > 0) memcpy_s(dfa->pcs + dfa->pcCount, sizeof(int) * count, keys, sizeof(int) * count);
+	dfa->pcCount += count;
+	for (int i = 0; i < regex->classCount; ++i) {
+		dfa->next[index * regex->classCount + i] = DFA_UNKNOWN;
+	}
+
+	// Kept at most half full.
+	if (dfa->count * 2 > dfa->tableCapacity) {
+		free(dfa->table);
+		dfa->tableCapacity = dfa->tableCapacity == 0 ? 16 : dfa->tableCapacity * 2;
+		dfa->table = (int*)calloc(dfa->tableCapacity, sizeof(int));
+		if (dfa->table == NULL) exit(1); // Out of Memory
+		for (int i = 0; i < dfa->count; ++i) insertDfaIndex(dfa, i);
+	} else {
+		insertDfaIndex(dfa, index);
+	}
+	return index;
+}
+
+// Keys of the byte and match instructions in the set. The others lead to them.
+static int collectKeys(Regex* regex, const StateSet* set) {
+	int count = 0;
+	for (int i = 0; i < set->count; ++i) {
+		if (regex->program[set->dense[i]].op != INST_SPLIT) regex->keys[count++] = set->dense[i];
+	}
+	return count;
+}
+
+// Empties the DFA, then adds the dead and the start states.
+static void resetDfa(Regex* regex, Dfa* dfa) {
+	dfa->count = 0;
+	dfa->pcCount = 0;
+	if (dfa->table != NULL) memset(dfa->table, 0, sizeof(int) * dfa->tableCapacity);
+	addDfaState(regex, dfa, regex->keys, 0);
+
+	StateSet* set = &regex->current;
+	set->count = 0;
+	addThread(regex, set, regex->start, 0);
+	addDfaState(regex, dfa, regex->keys, collectKeys(regex, set));
+}
+
+static int computeNext(Regex* regex, Dfa* dfa, int index, uint8_t byte) {
+	StateSet* set = &regex->current;
+	set->count = 0;
+	const DfaState* state = &dfa->states[index];
+	for (int i = 0; i < state->count; ++i) {
+		const Inst* inst = &regex->program[dfa->pcs[state->first + i]];
+		if (inst->op == INST_BYTE && hasByte(&regex->sets[inst->set], byte)) {
+			addThread(regex, set, inst->next, 0);
+		}
+	}
+	if (dfa->unanchored) addThread(regex, set, regex->start, 0);
+
+	int count = collectKeys(regex, set);
+	int next = addDfaState(regex, dfa, regex->keys, count);
+	if (next != -1) {
+		dfa->next[index * regex->classCount + regex->byteClass[byte]] = next;
+		return next;
+	}
+	// Full. The states are built again as they're needed, starting from this one.
+	memcpy_s(regex->saved, sizeof(int) * regex->count, regex->keys, sizeof(int) * count);
+	resetDfa(regex, dfa);
+	memcpy_s(regex->keys, sizeof(int) * regex->count, regex->saved, sizeof(int) * count);
+	return addDfaState(regex, dfa, regex->keys, count);
+}
+
+static int stepDfa(Regex* regex, Dfa* dfa, int state, uint8_t byte) {
+	int next = dfa->next[state * regex->classCount + regex->byteClass[byte]];
+	return next != DFA_UNKNOWN ? next : computeNext(regex, dfa, state, byte);
+}
+
+static Dfa* readyDfa(Regex* regex, Dfa* dfa) {
+	if (dfa->count == 0) resetDfa(regex, dfa);
+	return dfa;
+}
+
+bool matchRegex(Regex* regex, const char* chars, size_t length) {
+	Dfa* dfa = readyDfa(regex, &regex->anchored);
+	int state = DFA_START;
+	for (size_t i = 0; i < length && state != DFA_DEAD; ++i) {
+		state = stepDfa(regex, dfa, state, (uint8_t)chars[i]);
+	}
+	return dfa->states[state].accepting;
+}
+
+// Whether a match starts at from or later, found by the DFA.
+static bool hasMatch(Regex* regex, const char* chars, size_t length, size_t from) {
+	Dfa* dfa = readyDfa(regex, regex->anchorStart ? &regex->anchored : &regex->unanchored);
+	int state = DFA_START;
+	for (size_t i = from; i < length && state != DFA_DEAD; ++i) {
+		// Without $, any match will do, so the search stops at the first.
+		if (!regex->anchorEnd && dfa->states[state].accepting) return true;
+		state = stepDfa(regex, dfa, state, (uint8_t)chars[i]);
+	}
+	return dfa->states[state].accepting;
+}
+
+// Runs a thread from every position, as the DFA can't tell where a match starts.
+// Threads are kept in the order they started, so of two reaching the same state the earlier one stays.
+static bool simulateNfa(Regex* regex, const char* chars, size_t length, size_t from, size_t* start, size_t* end) {
+	StateSet* current = &regex->current;
+	StateSet* following = &regex->following;
+	current->count = 0;
+	bool found = false;
+
+	for (size_t position = from; ; ++position) {
+		// No later start beats a match found.
+		if (!found && (!regex->anchorStart || position == 0)) addThread(regex, current, regex->start, position);
+		for (int i = 0; i < current->count; ++i) {
+			if (current->dense[i] != regex->match || (regex->anchorEnd && position != length)) continue;
+			size_t threadStart = current->starts[i];
+			if (!found || threadStart < *start || (threadStart == *start && position > *end)) {
+				*start = threadStart;
+				*end = position;
+				found = true;
+			}
+		}
+		if (position == length || (current->count == 0 && (found || regex->anchorStart))) break;
+
+		following->count = 0;
+		uint8_t byte = (uint8_t)chars[position];
+		for (int i = 0; i < current->count; ++i) {
+			const Inst* inst = &regex->program[current->dense[i]];
+			if (inst->op != INST_BYTE || !hasByte(&regex->sets[inst->set], byte)) continue;
+			if (found && current->starts[i] > *start) continue;
+			addThread(regex, following, inst->next, current->starts[i]);
+		}
+		StateSet* swap = current;
+		current = following;
+		following = swap;
+	}
+	return found;
+}
+
+bool findRegex(Regex* regex, const char* chars, size_t length, size_t from, size_t* start, size_t* end) {
+	if (from > length || (regex->anchorStart && from > 0)) return false;
+	// Most texts searched don't match, which the DFA finds at a table lookup per byte.
+	if (!hasMatch(regex, chars, length, from)) return false;
+	return simulateNfa(regex, chars, length, from, start, end);
+}
+
+// Natives //
+
+ObjRegex* regexFor(VM* vm, ObjString* pattern) {
+	pattern = internString(vm, pattern);
+	Value cached;
+	if (tableGet(&vm->regexes, pattern, &cached)) return AS_REGEX(cached);
+
+	const char* error;
+	Regex* regex = compileRegex(pattern->chars, (size_t)pattern->length, &error);
+	if (regex == NULL) {
+		runtimeError(vm, "Invalid regular expression '%s': %s", pattern->chars, error);
+		return NULL;
+	}
+	// The interned string may be referenced only by the string table, which GC doesn't mark.
+	push(vm, OBJ_VAL(pattern));
+	ObjRegex* object = newRegex(vm, pattern, regex);
+	push(vm, OBJ_VAL(object));
+	if (vm->regexes.count >= REGEX_CACHE_MAX) {
+		freeTable(&vm->regexes);
+		initTable(&vm->regexes);
+	}
+	tableSet(&vm->regexes, pattern, OBJ_VAL(object));
+	pop(vm);
+	pop(vm);
+	return object;
+}
+
+// A regex, or a pattern string compiled through the cache.
+static ObjRegex* regexArgument(VM* vm, const char* name, Value* args, int index) {
+	if (IS_REGEX(args[index])) return AS_REGEX(args[index]);
+	ObjString* pattern = stringArgument(vm, name, args, index);
+	if (pattern == NULL) return NULL;
+	push(vm, OBJ_VAL(pattern));
+	ObjRegex* regex = regexFor(vm, pattern);
+	// An invalid pattern is a runtime error, which resets the stack, pattern included.
+	if (regex == NULL) return NULL;
+	pop(vm);
+	return regex;
+}
+
+static Value regexNative(VM* vm, int argCount, Value* args) {
+	if (argCount != 1) {
+		runtimeError(vm, "[regexNative] Invalid number of arguments: 1 was expected, but %d was given", argCount);
+		return NIL_VAL;
+	}
+	ObjRegex* regex = regexArgument(vm, "regexNative", args, 0);
+	return regex != NULL ? OBJ_VAL(regex) : NIL_VAL;
+}
+
+static Value matchNative(VM* vm, int argCount, Value* args) {
+	if (argCount != 2) {
+		runtimeError(vm, "[matchNative] Invalid number of arguments: 2 was expected, but %d was given", argCount);
+		return NIL_VAL;
+	}
+	Text text;
+	if (!textArgument(vm, "matchNative", args, 1, &text)) return NIL_VAL;
+	ObjRegex* regex = regexArgument(vm, "matchNative", args, 0);
+	if (regex == NULL) return NIL_VAL;
+
+	return BOOL_VAL(matchRegex(regex->regex, text.chars, text.length));
+}
+
+static Value findNative(VM* vm, int argCount, Value* args) {
+	if (argCount != 2) {
+		runtimeError(vm, "[findNative] Invalid number of arguments: 2 was expected, but %d was given", argCount);
+		return NIL_VAL;
+	}
+	Text text;
+	if (!textArgument(vm, "findNative", args, 1, &text)) return NIL_VAL;
+	ObjRegex* regex = regexArgument(vm, "findNative", args, 0);
+	if (regex == NULL) return NIL_VAL;
+
+	size_t start, end;
+	if (!findRegex(regex->regex, text.chars, text.length, 0, &start, &end)) return NIL_VAL;
+	return sliceText(vm, &text, text.chars + start, end - start);
+}
+
+void defineRegexNatives(VM* vm) {
+	defineNative(vm, "Regex", regexNative);
+	defineNative(vm, "match", matchNative);
+	defineNative(vm, "find", findNative);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "common.h"
+CPLUSPLUS_BEGIN
+
+#include "vm.h"
+
+// Regular expressions over bytes, matched in time linear in the text.
+// Syntax: literals, ., [...] and [^...] with ranges, \d \w \s \D \W \S, escapes like \. and \n,
+// grouping with (...) or (?:...), |, and the repetitions *, +, ?, {m}, {m,} and {m,n}.
+// ^ and $ are supported at the ends of a pattern, anchoring it to the ends of the text.
+// Of the matches, the leftmost is found, then the longest of those.
+typedef struct Regex Regex;
+
+// Returns NULL and sets error if the pattern is invalid.
+Regex* compileRegex(const char* pattern, size_t length, const char** error);
+void freeRegex(Regex* regex);
+// Whether the regex matches all of chars.
+bool matchRegex(Regex* regex, const char* chars, size_t length);
+// Finds the first match that starts at from or later. Sets its range to [*start, *end).
+bool findRegex(Regex* regex, const char* chars, size_t length, size_t from, size_t* start, size_t* end);
+
+// The compiled pattern, from the VM's cache if it was compiled before.
+// Reports a runtime error and returns NULL if it's invalid. pattern must be reachable by GC.
+ObjRegex* regexFor(VM* vm, ObjString* pattern);
+
+// Natives, as patterns are usually written once and used on every line:
+//   Regex(pattern)   The compiled pattern. It's a runtime error if it's invalid.
+//   match(regex, s)  Whether the regex matches all of s.
+//   find(regex, s)   The first match in s, or nil.
+// regex may be a pattern string as well. replace() in text.h takes a regex to replace its matches.
+void defineRegexNatives(VM* vm);
+
+CPLUSPLUS_END
@@ -4,89 +4,124 @@
 #include <stdio.h>
 #include <string.h>
 
-static bool isAtEnd(Scanner* scanner) {
-	return *(scanner->current) == '\0';
-}
-
-static char advance(Scanner* scanner) {
-	scanner->current++;
-	return scanner->current[-1];
-}
-
-static char peek(Scanner* scanner) {
-	return *scanner->current;
-}
-
-static char peekNext(Scanner* scanner) {
-	if (isAtEnd(scanner)) return '\0';
-	return scanner->current[1];
+// The source is terminated by '\0', which works as a sentinel.
+// No character class below contains it, so loops over a class stop at the end without checking it,
+// and looking one character ahead is always safe once the current one is not '\0'.
+
+#define CHAR_ALPHA 0x01 // a-z A-Z _
+#define CHAR_DIGIT 0x02 // 0-9
+#define CHAR_SPACE 0x04 // Whitespace except newline
+
+#define A CHAR_ALPHA
+#define D CHAR_DIGIT
+#define S CHAR_SPACE
+
+static const uint8_t charClasses[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0, S, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,
+	0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+	A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A,
+	0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+	A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#undef A
+#undef D
+#undef S
+
+#define CLASS_OF(c) charClasses[(uint8_t)(c)]
+
+typedef struct {
+	const char* name;
+	int length;
+	TokenType type;
+} Keyword;
+
+// Perfect hash of the keywords. Every keyword has at least 2 characters.
+// Rebuild the table when a keyword is added.
+#define KEYWORD_HASH(start, length) \
+	(((uint8_t)(start)[0] * 7 + (uint8_t)(start)[1] * 14 + (length)) & 31)
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 6
+
+static const Keyword keywords[32] = {
+	[0]  = { "this",   4, TOKEN_THIS },
+	[2]  = { "class",  5, TOKEN_CLASS },
+	[3]  = { "nil",    3, TOKEN_NIL },
+	[7]  = { "or",     2, TOKEN_OR },
+	[10] = { "return", 6, TOKEN_RETURN },
+	[11] = { "var",    3, TOKEN_VAR },
+	[12] = { "true",   4, TOKEN_TRUE },
+	[14] = { "and",    3, TOKEN_AND },
+	[15] = { "else",   4, TOKEN_ELSE },
+	[16] = { "super",  5, TOKEN_SUPER },
+	[17] = { "print",  5, TOKEN_PRINT },
+	[19] = { "fun",    3, TOKEN_FUN },
+	[21] = { "if",     2, TOKEN_IF },
+	[22] = { "while",  5, TOKEN_WHILE },
+	[27] = { "import", 6, TOKEN_IMPORT },
+	[29] = { "false",  5, TOKEN_FALSE },
+	[31] = { "for",    3, TOKEN_FOR },
+};
+
+// 8 spaces or 8 tabs in a word. Indentation is skipped a word at a time.
+#define SPACE_WORD 0x2020202020202020ull
+#define TAB_WORD   0x0909090909090909ull
+
+static uint64_t loadWord(const char* p) {
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
 }
 
 static bool match(Scanner* scanner, char expected) {
-	if (isAtEnd(scanner)) return false;
 	if (*scanner->current != expected) return false;
 	scanner->current++;
 	return true;
 }
 
 static void skipWhitespace(Scanner* scanner) {
+	const char* p = scanner->current;
+	const char* end = scanner->end;
+
 	for (;;) {
-		char c = peek(scanner);
-		switch (c) {
-			case ' ': case '\r': case '\t': advance(scanner); break;
-			case '\n': scanner->line++; advance(scanner); break;
-			case '/':
-				if (peekNext(scanner) == '/') {
-					while (peek(scanner) != '\n' && !isAtEnd(scanner)) {
-						advance(scanner);
-					}
-				} else {
-					return;
-				}
-				break;
-			default: return;
+		while (end - p >= 8 && (loadWord(p) == SPACE_WORD || loadWord(p) == TAB_WORD)) {
+			p += 8;
 		}
-	}
-}
 
-static TokenType checkKeyword(Scanner* scanner, int start, int length, const char* rest, TokenType type) {
-	if (scanner->current - scanner->start == start + length && memcmp(scanner->start + start, rest, length) == 0) {
-		return type;
+		char c = *p;
+		if (CLASS_OF(c) & CHAR_SPACE) {
+			p++;
+		} else if (c == '\n') {
+			scanner->line++;
+			p++;
+		} else if (c == '/' && p[1] == '/') {
+			const char* newline = (const char*)memchr(p, '\n', end - p);
+			p = newline != NULL ? newline : end;
+		} else {
+			break;
+		}
 	}
-	return TOKEN_IDENTIFIER;
+	scanner->current = p;
 }
 
-static TokenType identifierType(Scanner* scanner) {
+static TokenType identifierType(const char* start, int length) {
 	// #todo: Support string interpolation
-	switch (scanner->start[0]) {
-		case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
-		case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
-		case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
-		case 'f':
-			if (scanner->current - scanner->start > 1) {
-				switch (scanner->start[1]) {
-					case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
-					case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
-					case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
-				}
-			}
-			break;
-		case 'i': return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
-		case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
-		case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
-		case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
-		case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
-		case 's': return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
-		case 't':
-			if (scanner->current - scanner->start > 1) {
-				switch (scanner->start[1]) {
-					case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
-					case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
-				}
-			}
-			break;
-		case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
-		case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+	if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH) return TOKEN_IDENTIFIER;
+
+	const Keyword* keyword = &keywords[KEYWORD_HASH(start, length)];
+	if (keyword->length == length && memcmp(start, keyword->name, length) == 0) {
+		return keyword->type;
 	}
 	return TOKEN_IDENTIFIER;
 }
@@ -109,40 +144,51 @@ static Token errorToken(Scanner* scanner, const char* message) {
 	return token;
 }
 
-static Token string(Scanner* scanner) {
-	while (peek(scanner) != '"' && !isAtEnd(scanner)) {
-		if (peek(scanner) == '\n') scanner->line++;
-		advance(scanner);
+static void countLines(Scanner* scanner, const char* from, const char* to) {
+	const char* newline;
+	while ((newline = (const char*)memchr(from, '\n', to - from)) != NULL) {
+		scanner->line++;
+		from = newline + 1;
 	}
+}
 
-	if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
+static Token string(Scanner* scanner) {
+	const char* quote = (const char*)memchr(scanner->current, '"', scanner->end - scanner->current);
+	if (quote == NULL) {
+		countLines(scanner, scanner->current, scanner->end);
+		scanner->current = scanner->end;
+		return errorToken(scanner, "Unterminated string.");
+	}
 
-	advance(scanner); // Closing "
+	countLines(scanner, scanner->current, quote);
+	scanner->current = quote + 1; // Closing "
 	return makeToken(scanner, TOKEN_STRING);
 }
 
-static bool isAlpha(char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_'; }
-static bool isDigit(char c) { return '0' <= c && c <= '9'; }
-
 static Token identifier(Scanner* scanner) {
-	while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
-	return makeToken(scanner, identifierType(scanner));
+	const char* p = scanner->current;
+	while (CLASS_OF(*p) & (CHAR_ALPHA | CHAR_DIGIT)) p++;
+	scanner->current = p;
+	return makeToken(scanner, identifierType(scanner->start, (int)(p - scanner->start)));
 }
 
 static Token number(Scanner* scanner) {
-	while (isDigit(peek(scanner))) advance(scanner);
+	const char* p = scanner->current;
+	while (CLASS_OF(*p) & CHAR_DIGIT) p++;
 
-	if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
-		advance(scanner);
-		while (isDigit(peek(scanner))) advance(scanner);
+	if (*p == '.' && (CLASS_OF(p[1]) & CHAR_DIGIT)) {
+		p++;
+		while (CLASS_OF(*p) & CHAR_DIGIT) p++;
 	}
 
+	scanner->current = p;
 	return makeToken(scanner, TOKEN_NUMBER);
 }
 
-void initScanner(Scanner* scanner, const char* source) {
+void initScanner(Scanner* scanner, const char* source, size_t length) {
 	scanner->start = source;
 	scanner->current = source;
+	scanner->end = source + length;
 	scanner->line = 1;
 }
 
@@ -150,11 +196,13 @@ Token scanToken(Scanner* scanner) {
 	skipWhitespace(scanner);
 	scanner->start = scanner->current;
 
-	if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
+	char c = *scanner->current;
+	if (c == '\0') return makeToken(scanner, TOKEN_EOF);
+	scanner->current++;
 
-	char c = advance(scanner);
-	if (isAlpha(c)) return identifier(scanner);
-	if (isDigit(c)) return number(scanner);
+	uint8_t charClass = CLASS_OF(c);
+	if (charClass & CHAR_ALPHA) return identifier(scanner);
+	if (charClass & CHAR_DIGIT) return number(scanner);
 
 	switch (c) {
 		case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "common.h"
+CPLUSPLUS_BEGIN
+
 typedef enum {
 	// Single character
 	TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
@@ -15,7 +18,7 @@ typedef enum {
 	TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 	// Keyword
 	TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-	TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
+	TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_NIL, TOKEN_OR,
 	TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
 	TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
 
@@ -32,8 +35,12 @@ typedef struct {
 typedef struct {
 	const char* start;
 	const char* current;
+	const char* end; // Terminating '\0' of the source
 	int line;
 } Scanner;
 
-void initScanner(Scanner* scanner, const char* source);
+// source[length] must be '\0'.
+void initScanner(Scanner* scanner, const char* source, size_t length);
 Token scanToken(Scanner* scanner);
+
+CPLUSPLUS_END
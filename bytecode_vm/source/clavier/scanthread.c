@@ -0,0 +1,157 @@
+#include "scanthread.h"
+#include "memory.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#endif
+
+#if defined(_WIN32)
+typedef volatile LONG AtomicIndex;
+#define LOAD_ACQUIRE(index) ((uint32_t)ReadAcquire(index))
+#define STORE_RELEASE(index, value) WriteRelease((index), (LONG)(value))
+#define YIELD_THREAD() SwitchToThread()
+#else
+typedef _Atomic uint32_t AtomicIndex;
+#define LOAD_ACQUIRE(index) atomic_load_explicit((index), memory_order_acquire)
+#define STORE_RELEASE(index, value) atomic_store_explicit((index), (value), memory_order_release)
+#define YIELD_THREAD() sched_yield()
+#endif
+
+#define SCAN_RING_MASK (SCAN_RING_SIZE - 1)
+#define CACHE_LINE_SIZE 64
+
+struct ScanThread {
+	ScannedToken ring[SCAN_RING_SIZE];
+
+	// Written by the worker thread
+	AtomicIndex head; // Count of tokens published
+	uint32_t cachedTail;
+	AtomicIndex stop;
+	Scanner scanner;
+	char padding0[CACHE_LINE_SIZE];
+
+	// Written by the parser thread
+	AtomicIndex tail; // Count of tokens consumed
+	uint32_t cachedHead;
+	uint32_t readIndex;
+	bool finished;
+	Token eof;
+	char padding1[CACHE_LINE_SIZE];
+
+#if defined(_WIN32)
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+};
+
+static void scanAll(ScanThread* scan) {
+	uint32_t head = 0;
+	uint32_t published = 0;
+
+	for (;;) {
+		while (head - scan->cachedTail == SCAN_RING_SIZE) {
+			STORE_RELEASE(&scan->head, head);
+			published = head;
+			scan->cachedTail = LOAD_ACQUIRE(&scan->tail);
+			if (head - scan->cachedTail < SCAN_RING_SIZE) break;
+			if (LOAD_ACQUIRE(&scan->stop)) return;
+			YIELD_THREAD();
+		}
+
+		ScannedToken* entry = &(scan->ring[head & SCAN_RING_MASK]);
+		entry->token = scanToken(&scan->scanner);
+		entry->next = scan->scanner.current;
+		entry->line = scan->scanner.line;
+		head++;
+
+		if (entry->token.type == TOKEN_EOF) {
+			STORE_RELEASE(&scan->head, head);
+			return;
+		}
+		if (head - published >= SCAN_PUBLISH_BATCH) {
+			STORE_RELEASE(&scan->head, head);
+			published = head;
+		}
+	}
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI scanThreadMain(LPVOID parameter) {
+	scanAll((ScanThread*)parameter);
+	return 0;
+}
+#else
+static void* scanThreadMain(void* parameter) {
+	scanAll((ScanThread*)parameter);
+	return NULL;
+}
+#endif
+
+ScanThread* startScanThread(const char* source, size_t length) {
+	ScanThread* scan = ALLOCATE(ScanThread, 1);
+	initScanner(&scan->scanner, source, length);
+	STORE_RELEASE(&scan->head, 0);
+	STORE_RELEASE(&scan->tail, 0);
+	STORE_RELEASE(&scan->stop, 0);
+	scan->cachedTail = 0;
+	scan->cachedHead = 0;
+	scan->readIndex = 0;
+	scan->finished = false;
+
+#if defined(_WIN32)
+	scan->thread = CreateThread(NULL, 0, scanThreadMain, scan, 0, NULL);
+	bool started = scan->thread != NULL;
+#else
+	bool started = pthread_create(&scan->thread, NULL, scanThreadMain, scan) == 0;
+#endif
+	if (!started) {
+		FREE(ScanThread, scan);
+		return NULL;
+	}
+	return scan;
+}
+
+Token nextScannedToken(ScanThread* scan, Scanner* scanner) {
+	if (scan->finished) return scan->eof;
+
+	if (scan->readIndex == scan->cachedHead) {
+		// Let the worker reuse the slots before waiting for it.
+		STORE_RELEASE(&scan->tail, scan->readIndex);
+		while ((scan->cachedHead = LOAD_ACQUIRE(&scan->head)) == scan->readIndex) {
+			YIELD_THREAD();
+		}
+	}
+
+	ScannedToken* entry = &(scan->ring[scan->readIndex & SCAN_RING_MASK]);
+	Token token = entry->token;
+	scanner->start = token.start;
+	scanner->current = entry->next;
+	scanner->line = entry->line;
+
+	scan->readIndex++;
+	if ((scan->readIndex & (SCAN_PUBLISH_BATCH - 1)) == 0) {
+		STORE_RELEASE(&scan->tail, scan->readIndex);
+	}
+
+	if (token.type == TOKEN_EOF) {
+		scan->finished = true;
+		scan->eof = token;
+	}
+	return token;
+}
+
+void stopScanThread(ScanThread* scan) {
+	STORE_RELEASE(&scan->stop, 1);
+#if defined(_WIN32)
+	WaitForSingleObject(scan->thread, INFINITE);
+	CloseHandle(scan->thread);
+#else
+	pthread_join(scan->thread, NULL);
+#endif
+	FREE(ScanThread, scan);
+}
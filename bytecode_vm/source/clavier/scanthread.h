@@ -0,0 +1,30 @@
+#pragma once
+
+#include "common.h"
+#include "scanner.h"
+CPLUSPLUS_BEGIN
+
+// Must be a power of 2.
+#define SCAN_RING_SIZE 4096
+// Indices are published to the other thread once per this many tokens.
+#define SCAN_PUBLISH_BATCH 64
+
+typedef struct {
+	Token token;
+	const char* next; // Where the scanner continues after this token.
+	int line;         // Line of the scanner after this token.
+} ScannedToken;
+
+// Scans a source on a worker thread, ahead of the parser.
+// Tokens go through a lock-free single producer single consumer ring buffer.
+typedef struct ScanThread ScanThread;
+
+// Returns NULL if the thread can't be started. Use the scanner on the calling thread then.
+ScanThread* startScanThread(const char* source, size_t length);
+// Returns the next token. After TOKEN_EOF, keeps returning it.
+// scanner is set to where a scanner would be after the token, so it can be copied to look ahead.
+Token nextScannedToken(ScanThread* scan, Scanner* scanner);
+// Waits for the thread to finish and frees it.
+void stopScanThread(ScanThread* scan);
+
+CPLUSPLUS_END
@@ -0,0 +1,276 @@
+#include "text.h"
+#include "memory.h"
+#include "object.h"
+#include "regex.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool checkArgCount(VM* vm, const char* name, int min, int max, int argCount) {
+	if (argCount < min || argCount > max) {
+		if (min == max) {
+			runtimeError(vm, "[%s] Invalid number of arguments: %d was expected, but %d was given", name, min, argCount);
+		} else {
+			runtimeError(vm, "[%s] Invalid number of arguments: %d to %d were expected, but %d was given", name, min, max, argCount);
+		}
+		return false;
+	}
+	return true;
+}
+
+bool textArgument(VM* vm, const char* name, Value* args, int index, Text* text) {
+	Value value = args[index];
+	if (IS_STRING(value)) {
+		text->chars = AS_STRING(value)->chars;
+		text->length = (size_t)AS_STRING(value)->length;
+	} else if (IS_MAPPED_STRING(value)) {
+		text->chars = AS_MAPPED_STRING(value)->chars;
+		text->length = AS_MAPPED_STRING(value)->length;
+	} else if (IS_STRING_VIEW(value)) {
+		text->chars = AS_STRING_VIEW(value)->chars;
+		text->length = AS_STRING_VIEW(value)->length;
+	} else {
+		runtimeError(vm, "[%s] Argument %d is not a string", name, index + 1);
+		return false;
+	}
+	text->object = AS_OBJ(value);
+	return true;
+}
+
+ObjString* stringArgument(VM* vm, const char* name, Value* args, int index) {
+	Text text;
+	if (!textArgument(vm, name, args, index, &text)) return NULL;
+	if (IS_STRING(args[index])) return AS_STRING(args[index]);
+
+	if (text.length > INT_MAX) {
+		runtimeError(vm, "[%s] Argument %d is too long", name, index + 1);
+		return NULL;
+	}
+	ObjString* string = allocateString(vm, (int)text.length);
+	memcpy_s(string->chars, text.length, text.chars, text.length);
+	return string;
+}
+
+// An index into a text of the given length, where length itself is the end.
+static bool indexArgument(VM* vm, const char* name, Value* args, int index, size_t length, size_t* result) {
+	Value value = args[index];
+	if (!IS_NUMBER(value)) {
+		runtimeError(vm, "[%s] Argument %d is not a number", name, index + 1);
+		return false;
+	}
+	double number = AS_NUMBER(value);
+	if (!(number >= 0 && number <= (double)length) || number != (double)(size_t)number) {
+		runtimeError(vm, "[%s] Index %g is not an integer from 0 to %zu", name, number, length);
+		return false;
+	}
+	*result = (size_t)number;
+	return true;
+}
+
+// The first needle in [chars, end), or NULL.
+// memchr finds where the needle may start, many bytes at a time, and memcmp checks the rest.
+static const char* findText(const char* chars, const char* end, const char* needle, size_t needleLength) {
+	if (needleLength == 0) return chars;
+	if ((size_t)(end - chars) < needleLength) return NULL;
+
+	const char* last = end - needleLength; // The needle doesn't fit after this.
+	while (chars <= last) {
+		chars = (const char*)memchr(chars, needle[0], (size_t)(last - chars) + 1);
+		if (chars == NULL) return NULL;
+		if (memcmp(chars + 1, needle + 1, needleLength - 1) == 0) return chars;
+		++chars;
+	}
+	return NULL;
+}
+
+Value sliceText(VM* vm, Text* text, const char* chars, size_t length) {
+	if (length == text->length) return OBJ_VAL(text->object);
+	if (length < STRING_VIEW_MIN) return stringValue(vm, chars, (int)length);
+	return OBJ_VAL(newStringView(vm, text->object, chars, length));
+}
+
+static bool isWhitespace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static Value indexOfNative(VM* vm, int argCount, Value* args) {
+	if (!checkArgCount(vm, "indexOfNative", 2, 3, argCount)) return NIL_VAL;
+	Text text, sub;
+	if (!textArgument(vm, "indexOfNative", args, 0, &text)) return NIL_VAL;
+	if (!textArgument(vm, "indexOfNative", args, 1, &sub)) return NIL_VAL;
+	size_t from = 0;
+	if (argCount == 3 && !indexArgument(vm, "indexOfNative", args, 2, text.length, &from)) return NIL_VAL;
+
+	const char* found = findText(text.chars + from, text.chars + text.length, sub.chars, sub.length);
+	return NUMBER_VAL(found != NULL ? (double)(found - text.chars) : -1);
+}
+
+static Value startsWithNative(VM* vm, int argCount, Value* args) {
+	if (!checkArgCount(vm, "startsWithNative", 2, 2, argCount)) return NIL_VAL;
+	Text text, prefix;
+	if (!textArgument(vm, "startsWithNative", args, 0, &text)) return NIL_VAL;
+	if (!textArgument(vm, "startsWithNative", args, 1, &prefix)) return NIL_VAL;
+
+	return BOOL_VAL(prefix.length <= text.length && memcmp(text.chars, prefix.chars, prefix.length) == 0);
+}
+
+static Value substringNative(VM* vm, int argCount, Value* args) {
+	if (!checkArgCount(vm, "substringNative", 2, 3, argCount)) return NIL_VAL;
+	Text text;
+	if (!textArgument(vm, "substringNative", args, 0, &text)) return NIL_VAL;
+	size_t start;
+	size_t end = text.length;
+	if (!indexArgument(vm, "substringNative", args, 1, text.length, &start)) return NIL_VAL;
+	if (argCount == 3 && !indexArgument(vm, "substringNative", args, 2, text.length, &end)) return NIL_VAL;
+	if (end < start) {
+		runtimeError(vm, "[substringNative] The end %zu is before the start %zu", end, start);
+		return NIL_VAL;
+	}
+
+	return sliceText(vm, &text, text.chars + start, end - start);
+}
+
+static Value trimNative(VM* vm, int argCount, Value* args) {
+	if (!checkArgCount(vm, "trimNative", 1, 1, argCount)) return NIL_VAL;
+	Text text;
+	if (!textArgument(vm, "trimNative", args, 0, &text)) return NIL_VAL;
+
+	const char* start = text.chars;
+	const char* end = text.chars + text.length;
+	while (start < end && isWhitespace(*start)) ++start;
+	while (end > start && isWhitespace(end[-1])) --end;
+	return sliceText(vm, &text, start, (size_t)(end - start));
+}
+
+// The next occurrence of old in text at or after from. old is a regex or a string.
+static bool findOccurrence(Value old, Text* oldText, Text* text, size_t from, size_t* start, size_t* end) {
+	if (IS_REGEX(old)) return findRegex(AS_REGEX(old)->regex, text->chars, text->length, from, start, end);
+
+	const char* found = findText(text->chars + from, text->chars + text->length, oldText->chars, oldText->length);
+	if (found == NULL) return false;
+	*start = (size_t)(found - text->chars);
+	*end = *start + oldText->length;
+	return true;
+}
+
+static Value replaceNative(VM* vm, int argCount, Value* args) {
+	if (!checkArgCount(vm, "replaceNative", 3, 3, argCount)) return NIL_VAL;
+	Text text, old, replacement;
+	if (!textArgument(vm, "replaceNative", args, 0, &text)) return NIL_VAL;
+	if (!IS_REGEX(args[1]) && !textArgument(vm, "replaceNative", args, 1, &old)) return NIL_VAL;
+	if (!textArgument(vm, "replaceNative", args, 2, &replacement)) return NIL_VAL;
+	if (!IS_REGEX(args[1]) && old.length == 0) {
+		runtimeError(vm, "[replaceNative] The string to replace is empty");
+		return NIL_VAL;
+	}
+
+	// Found first, so the result is allocated once.
+	// After an empty match, the search goes on from the next byte, which is kept.
+	size_t* ranges = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	size_t removed = 0;
+	size_t start, end;
+	for (size_t from = 0; from <= text.length && findOccurrence(args[1], &old, &text, from, &start, &end);
+		from = end > start ? end : end + 1) {
+		if (count == capacity) {
+			capacity = GROW_CAPACITY(capacity);
+			ranges = (size_t*)realloc(ranges, sizeof(size_t) * 2 * capacity);
+			if (ranges == NULL) exit(1); // Out of Memory
+		}
+		ranges[count * 2] = start;
+		ranges[count * 2 + 1] = end;
+		removed += end - start;
+		count++;
+	}
+	if (count == 0) return args[0];
+	size_t length = text.length - removed;
+	if (replacement.length > 0 && count > (INT_MAX - length) / replacement.length) {
+		free(ranges);
+		runtimeError(vm, "[replaceNative] String is too long.");
+		return NIL_VAL;
+	}
+	length += count * replacement.length;
+
+	char buffer[SHORT_STRING_MAX];
+	ObjString* string = NULL;
+	char* dest = buffer;
+	if (!FITS_SHORT_STRING(length)) {
+		string = allocateString(vm, (int)length);
+		dest = string->chars;
+	}
+	size_t kept = 0; // Start of the characters before the next match
+	for (size_t i = 0; i < count; ++i) {
+		size_t before = ranges[i * 2] - kept;
+		memcpy_s(dest, before, text.chars + kept, before);
+		dest += before;
+		memcpy_s(dest, replacement.length, replacement.chars, replacement.length);
+		dest += replacement.length;
+		kept = ranges[i * 2 + 1];
+	}
+	memcpy_s(dest, text.length - kept, text.chars + kept, text.length - kept);
+	free(ranges);
+
+	return string != NULL ? OBJ_VAL(string) : shortStringVal(buffer, (int)length);
+}
+
+static Value splitNative(VM* vm, int argCount, Value* args) {
+	if (!checkArgCount(vm, "splitNative", 2, 2, argCount)) return NIL_VAL;
+	Text text, separator;
+	if (!textArgument(vm, "splitNative", args, 0, &text)) return NIL_VAL;
+	if (!textArgument(vm, "splitNative", args, 1, &separator)) return NIL_VAL;
+	if (separator.length == 0) {
+		runtimeError(vm, "[splitNative] The separator is empty");
+		return NIL_VAL;
+	}
+
+	// The pieces are linked through their fields, as scripts have no lists.
+	// Everything made is kept on the stack or linked from the first piece, so GC doesn't collect it.
+	Value* slots = vm->stackTop;
+	push(vm, OBJ_VAL(copyString(vm, "value", 5)));
+	push(vm, OBJ_VAL(copyString(vm, "next", 4)));
+	push(vm, OBJ_VAL(copyString(vm, "Piece", 5)));
+	push(vm, OBJ_VAL(newClass(vm, AS_STRING(slots[2]))));
+	push(vm, NIL_VAL); // The first piece
+	ObjString* valueKey = AS_STRING(slots[0]);
+	ObjString* nextKey = AS_STRING(slots[1]);
+	ObjClass* klass = AS_CLASS(slots[3]);
+
+	ObjInstance* last = NULL;
+	const char* end = text.chars + text.length;
+	const char* chars = text.chars;
+	for (;;) {
+		const char* found = findText(chars, end, separator.chars, separator.length);
+		const char* pieceEnd = found != NULL ? found : end;
+		push(vm, sliceText(vm, &text, chars, (size_t)(pieceEnd - chars)));
+		ObjInstance* piece = newInstance(vm, klass);
+		push(vm, OBJ_VAL(piece));
+		tableSet(&piece->fields, valueKey, slots[5]);
+		tableSet(&piece->fields, nextKey, NIL_VAL);
+		if (last != NULL) {
+			tableSet(&last->fields, nextKey, OBJ_VAL(piece));
+		} else {
+			slots[4] = OBJ_VAL(piece);
+		}
+		last = piece;
+		pop(vm);
+		pop(vm);
+
+		if (found == NULL) break;
+		chars = found + separator.length;
+	}
+
+	Value first = slots[4];
+	vm->stackTop = slots;
+	return first;
+}
+
+void defineTextNatives(VM* vm) {
+	defineNative(vm, "indexOf", indexOfNative);
+	defineNative(vm, "startsWith", startsWithNative);
+	defineNative(vm, "substring", substringNative);
+	defineNative(vm, "trim", trimNative);
+	defineNative(vm, "replace", replaceNative);
+	defineNative(vm, "split", splitNative);
+}
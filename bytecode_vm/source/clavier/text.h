@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+CPLUSPLUS_BEGIN
+
+#include "vm.h"
+
+// Natives that search, slice and split strings. Indices count bytes from 0.
+//   indexOf(s, sub, from)      Index of the first sub in s at or after from, which is optional, or -1.
+//   startsWith(s, prefix)      Whether s starts with prefix.
+//   substring(s, start, end)   The characters from start up to end, which is optional.
+//   trim(s)                    s without the whitespace at either end.
+//   replace(s, old, new)       s with every old replaced by new. old may be a Regex. See regex.h.
+//   split(s, separator)        The first of the pieces of s between separators.
+//                              Each piece has the fields value and next, the next piece or nil.
+// Slices at least STRING_VIEW_MIN long are views sharing the characters of s. See ObjStringView.
+// Like other strings made at runtime, results aren't hashed nor interned.
+void defineTextNatives(VM* vm);
+
+// For natives //
+
+// Characters of a string argument.
+// Natives get ObjStrings for short strings and ropes, but mapped strings and views as they are.
+typedef struct {
+	Obj* object; // What slices are views of.
+	const char* chars;
+	size_t length;
+} Text;
+
+// Reports a runtime error and returns false if args[index] isn't a string. name is the native's.
+bool textArgument(VM* vm, const char* name, Value* args, int index, Text* text);
+// args[index] as an ObjString, whose characters end with a null, as paths given to the C library must.
+// Mapped strings and views are copied. Keep the result reachable by GC while it's used.
+// Reports a runtime error and returns NULL if it isn't a string.
+ObjString* stringArgument(VM* vm, const char* name, Value* args, int index);
+// length characters of text from chars. Long ones are views, so slicing doesn't copy them.
+// The text must be reachable by GC.
+Value sliceText(VM* vm, Text* text, const char* chars, size_t length);
+
+CPLUSPLUS_END
@@ -1,23 +1,101 @@
 #include "value.h"
 #include "object.h"
 #include "memory.h"
+#include "number.h"
 
 #include <stdio.h>
 #include <string.h>
 
+// Characters go from bits 0 to 39, a byte each, and the length in bits 40 to 42.
+// Unused bytes are zero, so equal short strings have the same bits.
+Value shortStringVal(const char* chars, int length) {
+#if NAN_BOXING
+	uint64_t bits = QNAN | TAG_SHORT_STRING | ((uint64_t)length << 40);
+	for (int i = 0; i < length; ++i) {
+		bits |= (uint64_t)(uint8_t)chars[i] << (i * 8);
+	}
+	return bits;
+#else
+	return NIL_VAL;
+#endif
+}
+
+int shortStringChars(Value value, char* chars) {
+#if NAN_BOXING
+	int length = (int)((value >> 40) & 7);
+	for (int i = 0; i < length; ++i) {
+		chars[i] = (char)(value >> (i * 8));
+	}
+	return length;
+#else
+	return 0;
+#endif
+}
+
+static bool isString(Value value) {
+	return IS_STRING(value) || IS_SHORT_STRING(value) || IS_MAPPED_STRING(value) || IS_STRING_VIEW(value);
+}
+
+// A short string's characters are copied to buffer.
+static const char* stringChars(Value value, char* buffer, size_t* length) {
+	if (IS_SHORT_STRING(value)) {
+		*length = (size_t)shortStringChars(value, buffer);
+		return buffer;
+	}
+	if (IS_MAPPED_STRING(value)) {
+		*length = AS_MAPPED_STRING(value)->length;
+		return AS_MAPPED_STRING(value)->chars;
+	}
+	if (IS_STRING_VIEW(value)) {
+		*length = AS_STRING_VIEW(value)->length;
+		return AS_STRING_VIEW(value)->chars;
+	}
+	*length = (size_t)AS_STRING(value)->length;
+	return AS_STRING(value)->chars;
+}
+
+// Equal interned strings are the same object, and equal short strings the same Value.
+// Strings made at runtime may be neither, so they are compared by their characters.
+static bool stringsEqual(Value a, Value b) {
+	if (!isString(a) || !isString(b)) return false;
+	if (IS_SHORT_STRING(a) && IS_SHORT_STRING(b)) return false;
+	if (IS_STRING(a) && IS_STRING(b) && AS_STRING(a)->interned && AS_STRING(b)->interned) return false;
+
+	char bufferA[SHORT_STRING_MAX];
+	char bufferB[SHORT_STRING_MAX];
+	size_t lengthA, lengthB;
+	const char* charsA = stringChars(a, bufferA, &lengthA);
+	const char* charsB = stringChars(b, bufferB, &lengthB);
+	return lengthA == lengthB && 0 == memcmp(charsA, charsB, lengthA);
+}
+
 bool valuesEqual(Value a, Value b) {
 #if NAN_BOXING
 	if (IS_NUMBER(a) && IS_NUMBER(b)) {
 		return AS_NUMBER(a) == AS_NUMBER(b); // NaN != NaN
 	}
-	return a == b;
+	return a == b || stringsEqual(a, b);
 #else
 	if (a.type != b.type) return false;
 	switch (a.type) {
 		case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NIL:    return true;
 		case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-		// All strings are interned, so comparing addresses is enough.
+		case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b) || stringsEqual(a, b);
+		default:         return false;
+	}
+#endif
+}
+
+bool valuesIdentical(Value a, Value b) {
+#if NAN_BOXING
+	return a == b;
+#else
+	if (a.type != b.type) return false;
+	switch (a.type) {
+		case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+		case VAL_NIL:    return true;
+		case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
 		case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
 		default:         return false;
 	}
@@ -45,32 +123,48 @@ void freeValueArray(ValueArray* array) {
 	initValueArray(array);
 }
 
-void printValue(Value value) {
+static void writeNumber(Output* output, double number) {
+	char buffer[NUMBER_BUFFER_SIZE];
+	int length = formatNumber(number, buffer);
+	writeOutput(output, buffer, length);
+}
+
+void writeValue(Output* output, Value value) {
 #if NAN_BOXING
 	if (IS_BOOL(value)) {
-		printf_s(AS_BOOL(value) ? "true" : "false");
+		writeOutputString(output, AS_BOOL(value) ? "true" : "false");
 	} else if (IS_NIL(value)) {
-		printf_s("nil");
+		writeOutputString(output, "nil");
 	} else if (IS_NUMBER(value)) {
-		printf_s("%g", AS_NUMBER(value));
+		writeNumber(output, AS_NUMBER(value));
 	} else if (IS_OBJ(value)) {
-		printObject(value);
+		writeObject(output, value);
+	} else if (IS_SHORT_STRING(value)) {
+		char chars[SHORT_STRING_MAX];
+		int length = shortStringChars(value, chars);
+		writeOutput(output, chars, length);
 	}
 #else
-	// %g specificer: https://en.cppreference.com/w/c/io/fprintf
 	switch (value.type) {
 		case VAL_BOOL:
-			printf_s(AS_BOOL(value) ? "true" : "false");
+			writeOutputString(output, AS_BOOL(value) ? "true" : "false");
 			break;
 		case VAL_NIL:
-			printf_s("nil");
+			writeOutputString(output, "nil");
 			break;
 		case VAL_NUMBER:
-			printf("%g", AS_NUMBER(value));
+			writeNumber(output, AS_NUMBER(value));
 			break;
 		case VAL_OBJ:
-			printObject(value);
+			writeObject(output, value);
 			break;
 	}
 #endif
 }
+
+void printValue(Value value) {
+	Output output;
+	initOutput(&output, NULL, NULL);
+	writeValue(&output, value);
+	flushOutput(&output);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "output.h"
 #include <string.h>
 
 typedef struct Obj Obj;
@@ -13,6 +14,8 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 /* 01 */
 #define TAG_FALSE 2 /* 10 */
 #define TAG_TRUE  3 /* 11 */
+// Bit 49, which QNAN leaves clear, marks a short string. See shortStringVal().
+#define TAG_SHORT_STRING ((uint64_t)0x0002000000000000)
 
 typedef uint64_t Value;
 
@@ -20,6 +23,7 @@ typedef uint64_t Value;
 #define IS_NIL(value)    ((value) == NIL_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_SHORT_STRING(value) (((value) & (SIGN_BIT | QNAN | TAG_SHORT_STRING)) == (QNAN | TAG_SHORT_STRING))
 
 #define AS_BOOL(value)   ((value) == TRUE_VAL)
 #define AS_NUMBER(value) valueToNum(value)
@@ -84,16 +88,32 @@ typedef struct {
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+// Short strings need NaN boxing.
+#define IS_SHORT_STRING(value) false
+
 #endif // NAN_BOXING
 
+// Strings up to this length are stored in the Value itself rather than in an ObjString.
+// GC neither traces nor sweeps them. Code that takes an ObjString* must handle them first.
+#define SHORT_STRING_MAX 5
+#define FITS_SHORT_STRING(length) (NAN_BOXING && (length) <= SHORT_STRING_MAX)
+
 typedef struct {
 	int capacity;
 	int count;
 	Value* values;
 } ValueArray;
 
+// length must fit, see FITS_SHORT_STRING().
+Value shortStringVal(const char* chars, int length);
+// Copies the characters to chars, which has room for SHORT_STRING_MAX of them. Returns the length.
+int shortStringChars(Value value, char* chars);
 bool valuesEqual(Value a, Value b);
+// Same type and same bits. Unlike valuesEqual(), 0 and -0 differ and NaN is identical to itself.
+bool valuesIdentical(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
+void writeValue(Output* output, Value value);
+// Writes to stdout without buffering. For debugging.
 void printValue(Value value);
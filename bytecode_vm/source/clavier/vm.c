@@ -2,8 +2,14 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "image.h"
+#include "json.h"
 #include "memory.h"
 #include "object.h"
+#include "profile.h"
+#include "reader.h"
+#include "regex.h"
+#include "text.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -12,7 +18,9 @@
 #include <time.h>
 #include <stdlib.h>
 
-VM* g_vm = NULL;
+THREAD_LOCAL VM* g_vm = NULL;
+
+static ObjFunction* loadModule(VM* vm, ObjString* path);
 
 static void resetStack(VM* vm) {
 	vm->stackTop = vm->stack;
@@ -20,7 +28,9 @@ static void resetStack(VM* vm) {
 	vm->openUpvalues = NULL;
 }
 
-static void runtimeError(VM* vm, const char* format, ...) {
+void runtimeError(VM* vm, const char* format, ...) {
+	flushOutput(&vm->output);
+
 	va_list args;
 	va_start(args, format);
 	vfprintf_s(stderr, format, args);
@@ -32,7 +42,7 @@ static void runtimeError(VM* vm, const char* format, ...) {
 		CallFrame* frame = &(vm->frames[i]);
 		ObjFunction* function = frame->closure->function;
 		size_t instruction = frame->ip - function->chunk.code - 1;
-		fprintf_s(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+		fprintf_s(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
 		if (function->name == NULL) {
 			fprintf_s(stderr, "screipt\n");
 		} else {
@@ -43,11 +53,12 @@ static void runtimeError(VM* vm, const char* format, ...) {
 	resetStack(vm);
 }
 
-static void defineNative(VM* vm, const char* name, NativeFn function) {
+void defineNative(VM* vm, const char* name, NativeFn function) {
 	// Push name and function to the stack to prevent from being GC'd.
 	push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
-	push(vm, OBJ_VAL(newNative(vm, function)));
+	push(vm, OBJ_VAL(newNative(vm, AS_STRING(vm->stack[0]), function)));
 	tableSet(&(vm->globals), AS_STRING(vm->stack[0]), vm->stack[1]);
+	tableSet(&(vm->natives), AS_STRING(vm->stack[0]), vm->stack[1]);
 	pop(vm);
 	pop(vm);
 }
@@ -56,6 +67,50 @@ static Value peek(VM* vm, int distance) {
 	return vm->stackTop[-1 - distance];
 }
 
+static bool isText(Value value) {
+	return IS_STRING(value) || IS_ROPE(value) || IS_SHORT_STRING(value) || IS_MAPPED_STRING(value) || IS_STRING_VIEW(value);
+}
+
+static size_t textLength(Value value) {
+	if (IS_SHORT_STRING(value)) {
+		char chars[SHORT_STRING_MAX];
+		return (size_t)shortStringChars(value, chars);
+	}
+	if (IS_MAPPED_STRING(value)) return AS_MAPPED_STRING(value)->length;
+	if (IS_STRING_VIEW(value)) return AS_STRING_VIEW(value)->length;
+	return (size_t)(IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length);
+}
+
+// Characters of a text other than a rope. A short string's are copied to buffer.
+static const char* textChars(Value value, char* buffer) {
+	if (IS_SHORT_STRING(value)) {
+		shortStringChars(value, buffer);
+		return buffer;
+	}
+	if (IS_MAPPED_STRING(value)) return AS_MAPPED_STRING(value)->chars;
+	if (IS_STRING_VIEW(value)) return AS_STRING_VIEW(value)->chars;
+	return AS_STRING(value)->chars;
+}
+
+// Replaces a short string in the slot with an ObjString, where an object is needed.
+static void allocateShortString(VM* vm, Value* slot) {
+	if (!IS_SHORT_STRING(*slot)) return;
+	char chars[SHORT_STRING_MAX];
+	int length = shortStringChars(*slot, chars);
+	ObjString* string = allocateString(vm, length);
+	memcpy_s(string->chars, length, chars, length);
+	*slot = OBJ_VAL(string);
+}
+
+// Ropes are flattened where their contents are compared or passed to natives.
+// The flattened string replaces the rope in the stack slot, and the rope keeps it too.
+static void flattenOperands(VM* vm, int count) {
+	for (int i = 1; i <= count; ++i) {
+		Value* slot = vm->stackTop - i;
+		if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(vm, AS_ROPE(*slot)));
+	}
+}
+
 static bool call(VM* vm, ObjClosure* closure, int argCount) {
 	if (argCount != closure->function->arity) {
 		runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
@@ -65,6 +120,15 @@ static bool call(VM* vm, ObjClosure* closure, int argCount) {
 		runtimeError(vm, "Stack overflow.");
 		return false;
 	}
+	// The closure is still on the stack, so GC won't collect the function while compiling.
+	if (closure->function->lazy != NULL && !compileLazyFunction(vm, closure->function)) {
+		runtimeError(vm, "Could not compile function '%s'.", closure->function->name->chars);
+		return false;
+	}
+	int site = closure->function->profileSite;
+	if (vm->recording != NULL && site >= 0 && site < vm->recording->count) {
+		vm->recording->entries[site].count++;
+	}
 	CallFrame* frame = &(vm->frames[vm->frameCount++]);
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
@@ -99,6 +163,11 @@ static bool callValue(VM* vm, Value callee, int argCount) {
 				return call(vm, AS_CLOSURE(callee), argCount);
 			case OBJ_NATIVE: {
 				NativeFn native = AS_NATIVE(callee);
+				// Natives take strings as ObjStrings.
+				flattenOperands(vm, argCount);
+				for (int i = 1; i <= argCount; ++i) {
+					allocateShortString(vm, vm->stackTop - i);
+				}
 				// #todo: Check arity
 				// #todo: Throw runtime error if any
 				Value result = native(vm, argCount, vm->stackTop - argCount);
@@ -207,18 +276,75 @@ static bool isFalsey(Value value) {
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)) || (IS_NUMBER(value) && AS_NUMBER(value) == 0.0);
 }
 
-static void concatenate(VM* vm) {
-	ObjString* b = AS_STRING(pop(vm));
-	ObjString* a = AS_STRING(pop(vm));
+// Concatenating strings this long or longer makes a rope instead of copying them.
+#define ROPE_MIN_LENGTH 64
 
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy_s(chars, a->length, a->chars, a->length);
-	memcpy_s(chars + a->length, b->length, b->chars, b->length);
-	chars[length] = '\0';
+// Operands stay on the stack until the result is made, so GC doesn't collect them.
+static bool concatenate(VM* vm) {
+	Value b = peek(vm, 0);
+	Value a = peek(vm, 1);
+	if (textLength(a) + textLength(b) > INT_MAX) {
+		runtimeError(vm, "String is too long.");
+		return false;
+	}
+	int length = (int)(textLength(a) + textLength(b));
+	int lengthA = (int)textLength(a);
 
-	ObjString* result = takeString(vm, chars, length);
-	push(vm, OBJ_VAL(result));
+	Value result;
+	if (length == lengthA) {
+		result = a;
+	} else if (lengthA == 0) {
+		result = b;
+	} else if (length >= ROPE_MIN_LENGTH || IS_ROPE(a) || IS_ROPE(b)) {
+		// Copying both every time makes building a string piece by piece quadratic.
+		// Ropes are made of objects, so short strings are allocated.
+		allocateShortString(vm, vm->stackTop - 1);
+		allocateShortString(vm, vm->stackTop - 2);
+		result = OBJ_VAL(newRope(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)), length));
+	} else {
+		char bufferA[SHORT_STRING_MAX];
+		char bufferB[SHORT_STRING_MAX];
+		const char* charsA = textChars(a, bufferA);
+		const char* charsB = textChars(b, bufferB);
+		if (FITS_SHORT_STRING(length)) {
+			char chars[SHORT_STRING_MAX];
+			memcpy_s(chars, SHORT_STRING_MAX, charsA, lengthA);
+			memcpy_s(chars + lengthA, SHORT_STRING_MAX - lengthA, charsB, length - lengthA);
+			result = shortStringVal(chars, length);
+		} else {
+			// Hashed and interned only if it becomes a table key.
+			ObjString* string = allocateString(vm, length);
+			memcpy_s(string->chars, length, charsA, lengthA);
+			memcpy_s(string->chars + lengthA, length - lengthA, charsB, length - lengthA);
+			result = OBJ_VAL(string);
+		}
+	}
+
+	pop(vm);
+	pop(vm);
+	push(vm, result);
+	return true;
+}
+
+// OP_ADD's stack effect is -1. (pop 2, push 1)
+static bool add(VM* vm) {
+	if (isText(peek(vm, 0)) && isText(peek(vm, 1))) {
+		return concatenate(vm);
+	} else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+		double b = AS_NUMBER(pop(vm));
+		double a = AS_NUMBER(pop(vm));
+		push(vm, NUMBER_VAL(a + b));
+	} else {
+		runtimeError(vm, "Operands must be two numbers or two strings.");
+		return false;
+	}
+	return true;
+}
+
+static uint32_t operandKinds(Value a, Value b) {
+	if (IS_NUMBER(a) && IS_NUMBER(b)) return PROFILE_NUMBERS;
+	if (isText(a) && isText(b)) return PROFILE_STRINGS;
+	return PROFILE_OTHER;
 }
 
 static InterpretResult run(VM* vm) {
@@ -255,6 +381,7 @@ static InterpretResult run(VM* vm) {
 		// Our VM believes that instructions are valid.
 		// Other VMs like JVM support execution of pre-compiled bytecode.
 		// Such code could be malicious, so JVM validates it first.
+		// So does loading an image here. See validCode() in image.c.
 
 		uint8_t instruction;
 
@@ -371,6 +498,7 @@ static InterpretResult run(VM* vm) {
 				break;
 			}
 			case OP_EQUAL: {
+				flattenOperands(vm, 2);
 				Value b = pop(vm);
 				Value a = pop(vm);
 				push(vm, BOOL_VAL(valuesEqual(a, b)));
@@ -379,19 +507,27 @@ static InterpretResult run(VM* vm) {
 			case OP_GREATER: BINARY_OP(vm, BOOL_VAL, >); break;
 			case OP_LESS: BINARY_OP(vm, BOOL_VAL, <); break;
 			case OP_ADD: {
-				// OP_ADD's stack effect is -1. (pop 2, push 1)
-				if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
-					concatenate(vm);
-				} else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+				if (!add(vm)) return INTERPRET_RUNTIME_ERROR;
+				break;
+			}
+			case OP_ADD_NUMBER: {
+				if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
 					double b = AS_NUMBER(pop(vm));
 					double a = AS_NUMBER(pop(vm));
 					push(vm, NUMBER_VAL(a + b));
-				} else {
-					runtimeError(vm, "Operands must be two numbers or two strings.");
+				} else if (!add(vm)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				break;
 			}
+			case OP_ADD_PROFILED: {
+				uint16_t site = READ_SHORT();
+				if (vm->recording != NULL && site < vm->recording->count) {
+					vm->recording->entries[site].count |= operandKinds(peek(vm, 1), peek(vm, 0));
+				}
+				if (!add(vm)) return INTERPRET_RUNTIME_ERROR;
+				break;
+			}
 			case OP_SUBTRACT: BINARY_OP(vm, NUMBER_VAL, -); break;
 			case OP_MULTIPLY: BINARY_OP(vm, NUMBER_VAL, *); break;
 			case OP_DIVIDE: BINARY_OP(vm, NUMBER_VAL, /); break;
@@ -406,8 +542,8 @@ static InterpretResult run(VM* vm) {
 			}
 			case OP_PRINT: {
 				// OP_PRINT's stack effect is zero.
-				printValue(pop(vm));
-				printf("\n");
+				writeValue(&vm->output, pop(vm));
+				writeOutput(&vm->output, "\n", 1);
 				break;
 			}
 			case OP_JUMP: {
@@ -504,6 +640,46 @@ static InterpretResult run(VM* vm) {
 			case OP_METHOD:
 				defineMethod(vm, READ_STRING());
 				break;
+			case OP_PEEK: {
+				uint8_t distance = READ_BYTE();
+				push(vm, peek(vm, distance));
+				break;
+			}
+			case OP_IMPORT: {
+				ObjString* path = READ_STRING();
+				Value imported;
+				if (tableGet(&vm->modules, path, &imported)) {
+					push(vm, NIL_VAL);
+					break;
+				}
+				ObjFunction* module = loadModule(vm, path);
+				if (module == NULL) return INTERPRET_RUNTIME_ERROR;
+				push(vm, OBJ_VAL(module));
+				ObjClosure* closure = newClosure(vm, module);
+				pop(vm);
+				push(vm, OBJ_VAL(closure));
+				// Recorded before it runs, so modules importing each other run once.
+				tableSet(&vm->modules, path, BOOL_VAL(true));
+				// The module's top-level code returns nil in place of the closure.
+				if (!call(vm, closure, 0)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame = &(vm->frames[vm->frameCount - 1]);
+				break;
+			}
+			case OP_POP_UNDER: {
+				uint8_t count = READ_BYTE();
+				Value result = pop(vm);
+				vm->stackTop -= count;
+				push(vm, result);
+				break;
+			}
+			case OP_CHECK_INLINED: {
+				ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+				Value callee = peek(vm, READ_BYTE());
+				push(vm, BOOL_VAL(IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function));
+				break;
+			}
 		}
 	}
 
@@ -518,17 +694,21 @@ static Value clockNative(VM* vm, int argCount, Value* args) {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static Value readFileNative(VM* vm, int argCount, Value* args) {
-	if (argCount != 1) {
-		runtimeError(vm, "[readFileNative] Invalid number of arguments: 1 was expected, but %d was given", argCount);
-		return NIL_VAL;
+static Value readFile(VM* vm, const char* filepath) {
+	// A large file isn't copied. The string is its mapping, and can be longer than INT_MAX.
+	size_t mappedSize;
+	const uint8_t* mapped = mapFile(filepath, &mappedSize);
+	if (mapped != NULL && mappedSize >= MAPPED_STRING_MIN) {
+		return OBJ_VAL(newMappedString(vm, (const char*)mapped, mappedSize));
 	}
-	if (IS_STRING(args[0]) == false) {
-		runtimeError(vm, "[readFileNative] The argument is not a string", argCount);
-		return NIL_VAL;
+	if (mapped != NULL) {
+		ObjString* string = allocateString(vm, (int)mappedSize);
+		memcpy_s(string->chars, mappedSize, mapped, mappedSize);
+		unmapFile(mapped, mappedSize);
+		return OBJ_VAL(string);
 	}
 
-	char* filepath = AS_CSTRING(args[0]);
+	// Empty files, and files that can't be mapped.
 	FILE* fp;
 	fopen_s(&fp, filepath, "rb");
 	if (!fp) {
@@ -546,35 +726,42 @@ static Value readFileNative(VM* vm, int argCount, Value* args) {
 		return NIL_VAL;
 	}
 	
-	char* contents = malloc(fsize + 1);
-	if (contents == NULL) {
-		runtimeError(vm, "[readFileNative] Out of memory while reading file: %s", filepath);
-		fclose(fp);
-		return NIL_VAL;
-	}
-
-	size_t bytesRead = fread(contents, sizeof(char), fsize, fp);
+	// Read into the string itself. It's hashed only if it becomes a table key.
+	ObjString* string = allocateString(vm, (int)fsize);
+	size_t bytesRead = fread(string->chars, sizeof(char), fsize, fp);
+	fclose(fp);
 	if (bytesRead < fsize) {
 		runtimeError(vm, "[readFileNative] Failed to read file: %s", filepath);
-		fclose(fp);
-		free(contents);
 		return NIL_VAL;
 	}
-	contents[fsize] = '\0';
-
-	// #todo-native: 1) Redundant malloc. 2) VM needs to hash the string.
-	ObjString* string = copyString(vm, contents, (int)fsize);
-	fclose(fp);
-	free(contents);
 
 	return OBJ_VAL(string);
 }
 
-void initVM(VM* vm) {
+static Value readFileNative(VM* vm, int argCount, Value* args) {
+	if (argCount != 1) {
+		runtimeError(vm, "[readFileNative] Invalid number of arguments: 1 was expected, but %d was given", argCount);
+		return NIL_VAL;
+	}
+	ObjString* path = stringArgument(vm, "readFileNative", args, 0);
+	if (path == NULL) return NIL_VAL;
+
+	// Reading allocates the string, so GC mustn't collect a copied path before.
+	push(vm, OBJ_VAL(path));
+	Value string = readFile(vm, path->chars);
+	// A runtime error resets the stack, path included. See callValue().
+	if (vm->frameCount == 0) return NIL_VAL;
+	pop(vm);
+	return string;
+}
+
+// Everything but the objects every VM starts with.
+static void initEmptyVM(VM* vm) {
 	g_vm = vm;
 
 	resetStack(vm);
 	vm->objects = NULL;
+	vm->sharedObjects = NULL;
 	vm->bytesAllocated = 0;
 	vm->nextGC = 1024 * 1024; // #todo-gc: Hard-coded initial value
 
@@ -582,34 +769,435 @@ void initVM(VM* vm) {
 	vm->grayCapacity = 0;
 	vm->grayStack = NULL;
 
+	initOutput(&vm->output, NULL, NULL);
+
+	vm->lazyCompile = false;
+	vm->scanThread = false;
+	vm->sources = NULL;
+	vm->sourceCount = 0;
+	vm->sourceCapacity = 0;
+	vm->images = NULL;
+	vm->profile = NULL;
+	vm->recording = NULL;
+	vm->cacheDirectory = NULL;
+	vm->compilingModule = false;
+	vm->compileSeconds = 0.0;
+	vm->cacheHit = false;
+
 	initTable(&vm->globals);
 	initTable(&vm->strings);
+	initTable(&vm->natives);
+	initTable(&vm->modules);
+	initTable(&vm->regexes);
 
 	vm->initString = NULL; // This is necessary as copyString() might trigger GC.
+}
+
+void initVM(VM* vm) {
+	initEmptyVM(vm);
 	vm->initString = copyString(vm, "init", 4);
 
 	defineNative(vm, "clock", clockNative);
 	defineNative(vm, "readFile", readFileNative);
+	defineReaderNatives(vm);
+	defineTextNatives(vm);
+	defineRegexNatives(vm);
+	defineJsonNatives(vm);
 }
 
 void freeVM(VM* vm) {
+	g_vm = vm;
+	flushOutput(&vm->output);
 	freeTable(&vm->globals);
 	freeTable(&vm->strings);
+	freeTable(&vm->natives);
+	freeTable(&vm->modules);
+	freeTable(&vm->regexes);
 	vm->initString = NULL;
 	freeObjects(vm);
+	for (int i = 0; i < vm->sourceCount; ++i) {
+		FREE_ARRAY(char, vm->sources[i], strlen(vm->sources[i]) + 1);
+	}
+	FREE_ARRAY(char*, vm->sources, vm->sourceCapacity);
+	freeImages(vm);
+	g_vm = NULL;
 }
 
-InterpretResult interpret(VM* vm, const char* source) {
-	ObjFunction* function = compile(vm, source);
-	if (function == NULL) return INTERPRET_COMPILE_ERROR;
+// Cloning //
 
+typedef struct {
+	Obj* original;
+	Obj* copy;
+} CopyEntry;
+
+typedef struct {
+	VM* vm;
+	// Copies by original, with open addressing.
+	CopyEntry* entries;
+	int count;
+	int capacity;
+	// Copies whose references are not filled in yet.
+	CopyEntry* pending;
+	int pendingCount;
+	int pendingCapacity;
+	// Keeps the copies reachable until the globals refer to them.
+	// GC marks the constants of a function like any other, so a function on the stack holds them.
+	ObjFunction* holder;
+} Copier;
+
+static uint32_t hashPointer(Obj* object) {
+	uint64_t bits = (uint64_t)(uintptr_t)object >> 3;
+	return (uint32_t)(bits ^ (bits >> 32)) * 0x9e3779b1u;
+}
+
+static CopyEntry* findCopy(CopyEntry* entries, int capacity, Obj* original) {
+	uint32_t index = hashPointer(original) & (capacity - 1);
+	for (;;) {
+		CopyEntry* entry = &entries[index];
+		if (entry->original == NULL || entry->original == original) return entry;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static void addCopy(Copier* copier, Obj* original, Obj* copy) {
+	if (copier->count + 1 > copier->capacity / 2) {
+		int capacity = GROW_CAPACITY(copier->capacity);
+		CopyEntry* entries = ALLOCATE(CopyEntry, capacity);
+		for (int i = 0; i < capacity; ++i) {
+			entries[i].original = NULL;
+		}
+		for (int i = 0; i < copier->capacity; ++i) {
+			if (copier->entries[i].original == NULL) continue;
+			*findCopy(entries, capacity, copier->entries[i].original) = copier->entries[i];
+		}
+		FREE_ARRAY(CopyEntry, copier->entries, copier->capacity);
+		copier->entries = entries;
+		copier->capacity = capacity;
+	}
+	CopyEntry* entry = findCopy(copier->entries, copier->capacity, original);
+	entry->original = original;
+	entry->copy = copy;
+	copier->count++;
+
+	if (copier->pendingCount + 1 > copier->pendingCapacity) {
+		int oldCapacity = copier->pendingCapacity;
+		copier->pendingCapacity = GROW_CAPACITY(oldCapacity);
+		copier->pending = GROW_ARRAY(CopyEntry, copier->pending, oldCapacity, copier->pendingCapacity);
+	}
+	copier->pending[copier->pendingCount++] = *entry;
+}
+
+// Creates the copy with its references left empty. fillCopy() fills them in.
+static Obj* createCopy(Copier* copier, Obj* original) {
+	VM* vm = copier->vm;
+	switch (original->type) {
+		case OBJ_BOUND_METHOD: return (Obj*)newBoundMethod(vm, NIL_VAL, NULL);
+		case OBJ_CLASS: return (Obj*)newClass(vm, ((ObjClass*)original)->name);
+		case OBJ_CLOSURE: return (Obj*)newClosure(vm, ((ObjClosure*)original)->function);
+		case OBJ_INSTANCE: return (Obj*)newInstance(vm, NULL);
+		// A file position can't be shared, so the copy is closed.
+		case OBJ_READER: return (Obj*)newReader(vm, NULL);
+		case OBJ_REGEX: {
+			// The DFA isn't shared, so the pattern is compiled again. It compiled before, so it can't fail.
+			ObjString* pattern = ((ObjRegex*)original)->pattern;
+			const char* error;
+			return (Obj*)newRegex(vm, pattern, compileRegex(pattern->chars, pattern->length, &error));
+		}
+		case OBJ_ROPE: return (Obj*)newRope(vm, NULL, NULL, ((ObjRope*)original)->length);
+		case OBJ_UPVALUE: {
+			ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+			upvalue->location = &upvalue->closed;
+			return (Obj*)upvalue;
+		}
+		default:
+			return NULL;
+	}
+}
+
+// Shared objects are returned as they are.
+static Value copyValue(Copier* copier, Value value) {
+	if (!IS_OBJ(value)) return value;
+	Obj* original = AS_OBJ(value);
+	switch (original->type) {
+		case OBJ_FUNCTION:
+		case OBJ_MAPPED_STRING:
+		case OBJ_NATIVE:
+		case OBJ_STRING:
+		case OBJ_STRING_VIEW:
+			return value;
+		default:
+			break;
+	}
+
+	if (copier->capacity > 0) {
+		CopyEntry* entry = findCopy(copier->entries, copier->capacity, original);
+		if (entry->original != NULL) return OBJ_VAL(entry->copy);
+	}
+	Obj* copy = createCopy(copier, original);
+	addConstant(copier->vm, &copier->holder->chunk, OBJ_VAL(copy));
+	addCopy(copier, original, copy);
+	return OBJ_VAL(copy);
+}
+
+static void copyTable(Copier* copier, Table* from, Table* to) {
+	for (int i = 0; i < from->capacity; ++i) {
+		Entry* entry = &from->entries[i];
+		if (entry->key == NULL) continue;
+		Value value = copyValue(copier, entry->value);
+		tableSet(to, entry->key, value);
+	}
+}
+
+static void fillCopy(Copier* copier, Obj* original, Obj* copy) {
+	switch (original->type) {
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod* bound = (ObjBoundMethod*)original;
+			Value receiver = copyValue(copier, bound->receiver);
+			((ObjBoundMethod*)copy)->receiver = receiver;
+			Value method = copyValue(copier, OBJ_VAL(bound->method));
+			((ObjBoundMethod*)copy)->method = (ObjClosure*)AS_OBJ(method);
+			break;
+		}
+		case OBJ_CLASS:
+			copyTable(copier, &((ObjClass*)original)->methods, &((ObjClass*)copy)->methods);
+			break;
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)original;
+			for (int i = 0; i < closure->upvalueCount; ++i) {
+				Value upvalue = copyValue(copier, OBJ_VAL(closure->upvalues[i]));
+				((ObjClosure*)copy)->upvalues[i] = (ObjUpvalue*)AS_OBJ(upvalue);
+			}
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance* instance = (ObjInstance*)original;
+			Value klass = copyValue(copier, OBJ_VAL(instance->klass));
+			((ObjInstance*)copy)->klass = (ObjClass*)AS_OBJ(klass);
+			copyTable(copier, &instance->fields, &((ObjInstance*)copy)->fields);
+			break;
+		}
+		case OBJ_ROPE: {
+			ObjRope* rope = (ObjRope*)original;
+			// Flattened strings are shared, and a flattened rope has no pieces.
+			((ObjRope*)copy)->string = rope->string;
+			if (rope->left != NULL) {
+				Value left = copyValue(copier, OBJ_VAL(rope->left));
+				((ObjRope*)copy)->left = AS_OBJ(left);
+				Value right = copyValue(copier, OBJ_VAL(rope->right));
+				((ObjRope*)copy)->right = AS_OBJ(right);
+			}
+			break;
+		}
+		case OBJ_UPVALUE: {
+			Value closed = copyValue(copier, *((ObjUpvalue*)original)->location);
+			((ObjUpvalue*)copy)->closed = closed;
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// Functions are shared by clones, so they must not change after cloning.
+static bool compileLazyFunctions(VM* vm) {
+	bool compiled;
+	do {
+		// Compiling a body creates the functions declared in it, which may be lazy as well.
+		compiled = false;
+		for (Obj* object = vm->objects; object != NULL; object = object->next) {
+			if (object->type != OBJ_FUNCTION || ((ObjFunction*)object)->lazy == NULL) continue;
+			if (!compileLazyFunction(vm, (ObjFunction*)object)) return false;
+			compiled = true;
+		}
+	} while (compiled);
+	return true;
+}
+
+bool cloneVM(VM* vm, VM* source) {
+	g_vm = source;
+	collectGarbage(source);
+	if (!compileLazyFunctions(source)) return false;
+	// Interning changes a string that has no equal interned string yet.
+	// Do that now, so interning a shared string in a clone finds the interned one instead.
+	for (Obj* object = source->objects; object != NULL; object = object->next) {
+		if (object->type == OBJ_STRING) internString(source, (ObjString*)object);
+	}
+	shareImmutableObjects(source);
+
+	initEmptyVM(vm);
+	vm->lazyCompile = source->lazyCompile;
+	vm->scanThread = source->scanThread;
+	vm->cacheDirectory = source->cacheDirectory;
+	vm->profile = source->profile;
+	// The strings are shared, so interning finds the same objects as in source.
+	tableAddAll(&source->strings, &vm->strings);
+	tableAddAll(&source->natives, &vm->natives);
+	tableAddAll(&source->modules, &vm->modules);
+	vm->initString = source->initString;
+
+	Copier copier;
+	copier.vm = vm;
+	copier.entries = NULL;
+	copier.count = 0;
+	copier.capacity = 0;
+	copier.pending = NULL;
+	copier.pendingCount = 0;
+	copier.pendingCapacity = 0;
+	copier.holder = newFunction(vm);
+	push(vm, OBJ_VAL(copier.holder));
+
+	copyTable(&copier, &source->globals, &vm->globals);
+	while (copier.pendingCount > 0) {
+		CopyEntry entry = copier.pending[--copier.pendingCount];
+		fillCopy(&copier, entry.original, entry.copy);
+	}
+
+	pop(vm);
+	FREE_ARRAY(CopyEntry, copier.entries, copier.capacity);
+	FREE_ARRAY(CopyEntry, copier.pending, copier.pendingCapacity);
+	return true;
+}
+
+static InterpretResult runScript(VM* vm, ObjFunction* function) {
 	push(vm, OBJ_VAL(function));
 	ObjClosure* closure = newClosure(vm, function);
 	pop(vm);
 	push(vm, OBJ_VAL(closure));
 	call(vm, closure, 0);
 
-	return run(vm);
+	InterpretResult result = run(vm);
+	flushOutput(&vm->output);
+	return result;
+}
+
+// Lazy functions are compiled after interpret() returns, so keep the source until freeVM().
+static const char* keepSource(VM* vm, const char* source) {
+	size_t length = strlen(source);
+	char* copy = ALLOCATE(char, length + 1);
+	memcpy_s(copy, length + 1, source, length + 1);
+
+	if (vm->sourceCapacity < vm->sourceCount + 1) {
+		int oldCapacity = vm->sourceCapacity;
+		vm->sourceCapacity = GROW_CAPACITY(oldCapacity);
+		vm->sources = GROW_ARRAY(char*, vm->sources, oldCapacity, vm->sourceCapacity);
+	}
+	vm->sources[vm->sourceCount++] = copy;
+	return copy;
+}
+
+static double now() {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return (double)time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Code compiled with profiles is specialized or instrumented for them, so it's not cached.
+static bool usesCache(VM* vm) {
+	return vm->cacheDirectory != NULL && vm->profile == NULL && vm->recording == NULL;
+}
+
+static ObjFunction* compileSource(VM* vm, const char* source) {
+	if (usesCache(vm)) {
+		// The cache stores every function compiled, so compiling lazily would only delay the work.
+		bool lazyCompile = vm->lazyCompile;
+		vm->lazyCompile = false;
+		ObjFunction* function = compile(vm, source);
+		vm->lazyCompile = lazyCompile;
+		return function;
+	}
+	if (vm->lazyCompile) {
+		source = keepSource(vm, source);
+	}
+	return compile(vm, source);
+}
+
+// Compiles the source, or loads it from the compilation cache when it's on.
+static ObjFunction* loadScript(VM* vm, const char* source) {
+	ObjFunction* function = NULL;
+	if (usesCache(vm)) {
+		function = loadCachedScript(vm, vm->cacheDirectory, source);
+	}
+	vm->cacheHit = function != NULL;
+
+	if (function == NULL) {
+		function = compileSource(vm, source);
+		if (function != NULL && usesCache(vm)) {
+			push(vm, OBJ_VAL(function));
+			storeCachedScript(vm, vm->cacheDirectory, source, function);
+			pop(vm);
+		}
+	}
+	return function;
+}
+
+// Returns NULL if the file can't be read. Free the source with free().
+static char* readSource(const char* path) {
+	FILE* file;
+	if (fopen_s(&file, path, "rb") != 0 || file == NULL) return NULL;
+
+	fseek(file, 0L, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	char* source = size >= 0 ? (char*)malloc((size_t)size + 1) : NULL;
+	if (source == NULL || fread(source, sizeof(char), (size_t)size, file) < (size_t)size) {
+		free(source);
+		fclose(file);
+		return NULL;
+	}
+	source[size] = '\0';
+	fclose(file);
+	return source;
+}
+
+// Module paths are relative to the working directory, like readFile().
+// A module has no namespace of its own: it defines and reads the VM's globals, as the importer does.
+// Other VMs reuse its compiled code through the compilation cache, and clones share its functions.
+// Reports the error and returns NULL if the module can't be read or doesn't compile.
+static ObjFunction* loadModule(VM* vm, ObjString* path) {
+	char* source = readSource(path->chars);
+	if (source == NULL) {
+		runtimeError(vm, "Could not read module \"%s\".", path->chars);
+		return NULL;
+	}
+	// A module is compiled like a script, so it's cached by the hash of its source as well.
+	bool cacheHit = vm->cacheHit;
+	vm->compilingModule = true;
+	ObjFunction* function = loadScript(vm, source);
+	vm->compilingModule = false;
+	vm->cacheHit = cacheHit;
+	free(source);
+
+	if (function == NULL) {
+		runtimeError(vm, "Could not compile module \"%s\".", path->chars);
+	}
+	return function;
+}
+
+InterpretResult interpret(VM* vm, const char* source) {
+	g_vm = vm;
+	double start = now();
+	ObjFunction* function = loadScript(vm, source);
+	vm->compileSeconds = now() - start;
+
+	if (function == NULL) return INTERPRET_COMPILE_ERROR;
+	return runScript(vm, function);
+}
+
+InterpretResult interpretImage(VM* vm, const char* path) {
+	g_vm = vm;
+	double start = now();
+	ObjFunction* function = loadImage(vm, path);
+	vm->cacheHit = false;
+	vm->compileSeconds = now() - start;
+
+	if (function == NULL) return INTERPRET_COMPILE_ERROR;
+	return runScript(vm, function);
+}
+
+void setOutput(VM* vm, WriteFn write, void* context) {
+	flushOutput(&vm->output);
+	initOutput(&vm->output, write, context);
 }
 
 void push(VM* vm, Value value) {
@@ -5,6 +5,7 @@ CPLUSPLUS_BEGIN
 
 #include "chunk.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 
@@ -26,17 +27,49 @@ typedef struct VM_t {
 	Value* stackTop; // location where in next value will be pushed
 	Table globals; // Store global variables
 	Table strings; // Store all strings in a hash table for string interning
+	Table natives; // Native functions by name, to relink heap snapshots
+	Table modules; // Paths of the modules imported
+	Table regexes; // Compiled patterns by pattern, up to REGEX_CACHE_MAX. See regexFor().
 	ObjString* initString; // Class initializer name
 	ObjUpvalue* openUpvalues;
 
 	size_t bytesAllocated;
 	size_t nextGC; // Threshold to trigger GC
 	Obj* objects;
+	// Immutable objects this VM shares with its clones. Never collected. See cloneVM().
+	Obj* sharedObjects;
 
 	// For GC
 	int grayCount;
 	int grayCapacity;
 	Obj** grayStack;
+
+	// print statements write here. See setOutput().
+	Output output;
+
+	// Compile function bodies on their first call. Set before interpret().
+	// A syntax error in such a body is then a runtime error of that call, and never reported if it's not called.
+	bool lazyCompile;
+	// Scan large sources on a worker thread while compiling. Set before interpret().
+	// Scanning is only a small share of compiling, so that bounds the gain, and with one core it's a loss.
+	bool scanThread;
+	// Copies of the interpreted sources. Lazy functions point into them.
+	char** sources;
+	int sourceCount;
+	int sourceCapacity;
+	// Images mapped by loadImage(). Loaded functions run their code from them.
+	struct LoadedImage* images;
+	// Observations of an earlier run the compiler uses, and of this run, if not NULL.
+	// Set before interpret(). The host owns them. See profile.h.
+	struct Profile* profile;
+	struct Profile* recording;
+	// Directory of the compilation cache. NULL disables it. See loadCachedScript().
+	const char* cacheDirectory;
+	// Compiling a module for an import statement. Modules don't inline functions. See loadModule().
+	bool compilingModule;
+	// Seconds the last interpret() spent compiling, or loading the script from the cache.
+	double compileSeconds;
+	bool cacheHit;
 } VM;
 
 typedef enum {
@@ -47,11 +80,34 @@ typedef enum {
 
 void initVM(VM* vm);
 void freeVM(VM* vm);
+// Initializes vm as a copy of source's globals, for running scripts in isolation from each other.
+// Strings, functions and natives are shared rather than copied: they are immutable,
+// and source keeps them until it's freed, so free the clones first.
+// Everything else reachable from the globals (closures, classes, instances...) is copied.
+// source must not be running. Its lazy functions are compiled first, so they are shared too.
+// Returns false and leaves vm uninitialized if one of them doesn't compile.
+// A VM is used by one thread at a time, and cloning uses source as well.
+// Clones can run on different threads: give each thread a clone to clone its requests from.
+bool cloneVM(VM* vm, VM* source);
+// Redirects the output of print statements. It's flushed when the buffer is full,
+// at the end of interpret() and before a runtime error is reported.
+// write == NULL writes to stdout.
+void setOutput(VM* vm, WriteFn write, void* context);
 InterpretResult interpret(VM* vm, const char* source);
+// Runs a bytecode image written by writeImage(). Returns INTERPRET_COMPILE_ERROR if it can't be loaded.
+InterpretResult interpretImage(VM* vm, const char* path);
 void push(VM* vm, Value value);
 Value pop(VM* vm);
 
+// For natives //
+
+// Makes a native callable by name from scripts.
+void defineNative(VM* vm, const char* name, NativeFn function);
+// Reports the error with the call stack, and ends the script. A native returns after calling it.
+void runtimeError(VM* vm, const char* format, ...);
+
 // #todo-gc: Temp var for GC. Don't use for other purpose.
-extern VM* g_vm;
+// The VM last initialized or run on this thread. NULL after it's freed.
+extern THREAD_LOCAL VM* g_vm;
 
 CPLUSPLUS_END
@@ -1,7 +1,10 @@
 ﻿#include "common.h"
 #include "chunk.h"
 #include "vm.h"
+#include "compiler.h"
 #include "debug.h"
+#include "image.h"
+#include "profile.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,22 +12,73 @@
 
 static void repl(VM* vm);
 static void runFile(VM* vm, const char* path);
+static void runImage(VM* vm, const char* path);
+static void compileFile(VM* vm, const char* path, const char* imagePath);
+static bool isImagePath(const char* path);
 static char* readFile(const char* path);
+static void reportTime(VM* vm);
+
+static bool timeCompile = false;
 
 int main(int argc, const char* argv[]) {
     VM vm;
     initVM(&vm);
 
-    if (argc == 1) {
+    const char* imagePath = NULL;
+    const char* snapshotPath = NULL;
+    const char* restorePath = NULL;
+    const char* recordPath = NULL;
+    int argi = 1;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; ++argi) {
+        if (strcmp(argv[argi], "--lazy") == 0) {
+            vm.lazyCompile = true;
+        } else if (strcmp(argv[argi], "--scan-thread") == 0) {
+            vm.scanThread = true;
+        } else if (strcmp(argv[argi], "--compile") == 0 && argi + 1 < argc) {
+            imagePath = argv[++argi];
+        } else if (strcmp(argv[argi], "--cache") == 0 && argi + 1 < argc) {
+            vm.cacheDirectory = argv[++argi];
+        } else if (strcmp(argv[argi], "--snapshot") == 0 && argi + 1 < argc) {
+            snapshotPath = argv[++argi];
+        } else if (strcmp(argv[argi], "--restore") == 0 && argi + 1 < argc) {
+            restorePath = argv[++argi];
+        } else if (strcmp(argv[argi], "--profile") == 0 && argi + 1 < argc) {
+            vm.profile = readProfile(argv[++argi]);
+            if (vm.profile == NULL) exit(74);
+        } else if (strcmp(argv[argi], "--record-profile") == 0 && argi + 1 < argc) {
+            recordPath = argv[++argi];
+            vm.recording = newProfile();
+        } else if (strcmp(argv[argi], "--time") == 0) {
+            timeCompile = true;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[argi]);
+            exit(64);
+        }
+    }
+
+    // Globals of the snapshot are defined before the script runs.
+    if (restorePath != NULL && !loadSnapshot(&vm, restorePath)) exit(74);
+
+    if (argi == argc && imagePath == NULL) {
         repl(&vm);
-    } else if (argc == 2) {
-        runFile(&vm, argv[1]);
+    } else if (argi + 1 == argc && imagePath != NULL) {
+        compileFile(&vm, argv[argi], imagePath);
+    } else if (argi + 1 == argc && isImagePath(argv[argi])) {
+        runImage(&vm, argv[argi]);
+    } else if (argi + 1 == argc) {
+        runFile(&vm, argv[argi]);
     } else {
         // #todo: Program name
-        fprintf(stderr, "Usage: Liszt [path]\n");
+        fprintf(stderr, "Usage: Liszt [--lazy] [--scan-thread] [--compile out.lbc] [--cache dir] [--snapshot out] [--restore in] [--profile in] [--record-profile out] [--time] [path]\n");
         exit(64);
     }
 
+    // Runs that failed have exited already.
+    if (snapshotPath != NULL && !writeSnapshot(&vm, snapshotPath)) exit(74);
+    if (recordPath != NULL && !writeProfile(vm.recording, recordPath)) exit(74);
+    if (vm.profile != NULL) freeProfile(vm.profile);
+    if (vm.recording != NULL) freeProfile(vm.recording);
+
     freeVM(&vm);
 
     return 0;
@@ -48,11 +102,41 @@ static void runFile(VM* vm, const char* path) {
     char* source = readFile(path);
     InterpretResult result = interpret(vm, source);
     free(source);
+    reportTime(vm);
+
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+// Bytecode images written by --compile are run without compiling.
+static bool isImagePath(const char* path) {
+    size_t length = strlen(path);
+    return length > 4 && strcmp(path + length - 4, ".lbc") == 0;
+}
+
+static void runImage(VM* vm, const char* path) {
+    InterpretResult result = interpretImage(vm, path);
+    reportTime(vm);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void compileFile(VM* vm, const char* path, const char* imagePath) {
+    char* source = readFile(path);
+    ObjFunction* function = compile(vm, source);
+    if (function == NULL) exit(65);
+    bool written = writeImage(vm, function, imagePath);
+    free(source);
+
+    if (!written) exit(74);
+}
+
+static void reportTime(VM* vm) {
+    if (!timeCompile) return;
+    fprintf(stderr, "Compiled in %.3f ms%s.\n", vm->compileSeconds * 1000.0, vm->cacheHit ? " (cache hit)" : "");
+}
+
 static char* readFile(const char* path) {
     FILE* file = fopen(path, "rb");
     if (file == NULL) {
@@ -1,12 +1,61 @@
 #include "pch.h"
 #include "CppUnitTest.h"
 
+#include "clavier/compiler.h"
+#include "clavier/image.h"
+#include "clavier/number.h"
+#include "clavier/profile.h"
+#include "clavier/regex.h"
+#include "clavier/scanner.h"
+#include "clavier/scanthread.h"
 #include "clavier/vm.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
 namespace UnitTest
 {
+	// Collects print output in the std::string context. See setOutput().
+	static void appendOutput(void* context, const char* chars, size_t length) {
+		static_cast<std::string*>(context)->append(chars, length);
+	}
+
+	// What source prints when it's run in a new VM. It must run without errors.
+	static std::string runSource(const char* source, bool lazyCompile = false) {
+		VM vm;
+		initVM(&vm);
+		vm.lazyCompile = lazyCompile;
+		std::string output;
+		setOutput(&vm, appendOutput, &output);
+		InterpretResult result = interpret(&vm, source);
+		freeVM(&vm);
+		Assert::AreEqual((int)INTERPRET_OK, (int)result);
+		return output;
+	}
+
+	// Code of the script chunk compiled from source, so after optimizing.
+	static std::vector<uint8_t> scriptCode(ObjFunction* function) {
+		Assert::IsNotNull(function);
+		return std::vector<uint8_t>(function->chunk.code, function->chunk.code + function->chunk.count);
+	}
+
+	// Number of op instructions in the chunk.
+	static int countInstructions(Chunk* chunk, OpCode op) {
+		int count = 0;
+		for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+			if (chunk->code[offset] == op) count++;
+		}
+		return count;
+	}
+
 	TEST_CLASS(UnitTest)
 	{
 	public:
@@ -19,5 +68,1149 @@ namespace UnitTest
 
 			Assert::IsTrue(true);
 		}
+
+		TEST_METHOD(ChunkLineTable)
+		{
+			VM vm;
+			initVM(&vm);
+
+			Chunk chunk;
+			initChunk(&chunk);
+			writeChunk(&chunk, OP_NIL, 1);
+			writeChunk(&chunk, OP_NIL, 1);
+			writeChunk(&chunk, OP_POP, 3);
+			writeChunk(&chunk, OP_POP, 3);
+			writeChunk(&chunk, OP_RETURN, 7);
+
+			Assert::AreEqual(3, chunk.lineCount);
+			Assert::AreEqual(1, getLine(&chunk, 0));
+			Assert::AreEqual(1, getLine(&chunk, 1));
+			Assert::AreEqual(3, getLine(&chunk, 2));
+			Assert::AreEqual(3, getLine(&chunk, 3));
+			Assert::AreEqual(7, getLine(&chunk, 4));
+
+			freeChunk(&chunk);
+			freeVM(&vm);
+		}
+
+		TEST_METHOD(ScanKeywords)
+		{
+			const char* source = "and class else false for fun if nil or print return super this true var while\n"
+				"an classy els fals fo funny i ni o prin returns supe th tru va whiles _and x1";
+			const TokenType expected[] = {
+				TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL,
+				TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+			};
+
+			Scanner scanner;
+			initScanner(&scanner, source, strlen(source));
+			for (TokenType type : expected) {
+				Token token = scanToken(&scanner);
+				Assert::AreEqual((int)type, (int)token.type);
+				Assert::AreEqual(1, token.line);
+			}
+			for (int i = 0; i < 18; ++i) {
+				Token token = scanToken(&scanner);
+				Assert::AreEqual((int)TOKEN_IDENTIFIER, (int)token.type);
+				Assert::AreEqual(2, token.line);
+			}
+			Assert::AreEqual((int)TOKEN_EOF, (int)scanToken(&scanner).type);
+		}
+
+		TEST_METHOD(ScannerThroughput)
+		{
+			const char* snippet =
+				"// Generated rule\n"
+				"fun rule(input, limit) {\n"
+				"        var total = 0; // running total\n"
+				"        while (total <= limit and input != nil) {\n"
+				"                total = total + input.weight * 1.5;\n"
+				"        }\n"
+				"        return \"rule\" + \"matched\";\n"
+				"}\n";
+			const int snippetTokens = 41;
+			const int repeat = 64 * 1024;
+
+			std::string source;
+			source.reserve(strlen(snippet) * repeat);
+			for (int i = 0; i < repeat; ++i) {
+				source += snippet;
+			}
+
+			auto begin = std::chrono::steady_clock::now();
+			Scanner scanner;
+			initScanner(&scanner, source.c_str(), source.size());
+			int count = 0;
+			while (scanToken(&scanner).type != TOKEN_EOF) {
+				count++;
+			}
+			std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+
+			Assert::AreEqual(snippetTokens * repeat, count);
+			Assert::AreEqual(8 * repeat + 1, scanner.line);
+
+			char message[128];
+			sprintf_s(message, "Scanned %.1f MB at %.1f MB/s\n",
+				source.size() / 1e6, source.size() / 1e6 / seconds.count());
+			Logger::WriteMessage(message);
+		}
+
+		TEST_METHOD(FormatNumber)
+		{
+			const struct { double value; const char* expected; } cases[] = {
+				{ 0.0, "0" }, { -0.0, "-0" }, { 1.0, "1" }, { -42.0, "-42" },
+				{ 0.1, "0.1" }, { 0.1 + 0.2, "0.30000000000000004" }, { 1.0 / 3.0, "0.3333333333333333" },
+				{ 100000000.0, "100000000" }, { 1e21, "1e+21" }, { 123456789012345680000.0, "123456789012345680000" },
+				{ 0.000001, "0.000001" }, { 1e-7, "1e-7" }, { 5e-324, "5e-324" },
+				{ 1.7976931348623157e308, "1.7976931348623157e+308" }, { 2.5, "2.5" },
+			};
+
+			char buffer[NUMBER_BUFFER_SIZE];
+			for (const auto& c : cases) {
+				int length = formatNumber(c.value, buffer);
+				Assert::AreEqual(c.expected, buffer);
+				Assert::AreEqual((int)strlen(c.expected), length);
+			}
+		}
+
+		TEST_METHOD(ParseNumber)
+		{
+			const char* literals[] = { "0", "7", "3.14", "0.1", "9007199254740993", "123456789012345678901234", "1.000000000000000000001" };
+			for (const char* literal : literals) {
+				Assert::AreEqual(strtod(literal, nullptr), parseNumber(literal, (int)strlen(literal)));
+			}
+		}
+
+		TEST_METHOD(OutputCallback)
+		{
+			VM vm;
+			initVM(&vm);
+
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "print 1 + 2; print \"a\" + \"b\"; print nil;"));
+			Assert::AreEqual("3\nab\nnil\n", output.c_str());
+
+			freeVM(&vm);
+		}
+
+		TEST_METHOD(ImageRoundTrip)
+		{
+			const char* source =
+				"class Counter { init(start) { this.count = start; } next() { this.count = this.count + 1; return this.count; } }\n"
+				"fun makeAdder(n) { fun add(x) { return x + n; } return add; }\n"
+				"var counter = Counter(10);\n"
+				"counter.next();\n"
+				"print counter.next();\n"
+				"print makeAdder(0.5)(2);\n"
+				"print \"image\" + \"d\";\n"
+				"print makeAdder;\n";
+			const char* path = "ImageRoundTrip.lbc";
+
+			std::string expected;
+			{
+				VM vm;
+				initVM(&vm);
+				setOutput(&vm, appendOutput, &expected);
+				ObjFunction* function = compile(&vm, source);
+				Assert::IsNotNull(function);
+				Assert::IsTrue(writeImage(&vm, function, path));
+				Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source));
+				freeVM(&vm);
+			}
+			Assert::AreEqual("12\n2.5\nimaged\n<fn makeAdder>\n", expected.c_str());
+
+			std::string output;
+			{
+				VM vm;
+				initVM(&vm);
+				setOutput(&vm, appendOutput, &output);
+				Assert::AreEqual((int)INTERPRET_OK, (int)interpretImage(&vm, path));
+				freeVM(&vm);
+			}
+			Assert::AreEqual(expected.c_str(), output.c_str());
+
+			std::remove(path);
+		}
+
+		TEST_METHOD(CorruptImageCode)
+		{
+			const char* path = "CorruptImageCode.lbc";
+			std::vector<uint8_t> image;
+			std::vector<uint8_t> code;
+			{
+				VM vm;
+				initVM(&vm);
+				ObjFunction* function = compile(&vm, "var x = 1; print x;");
+				code = scriptCode(function);
+				Assert::IsTrue(writeImage(&vm, function, path));
+				freeVM(&vm);
+
+				FILE* file = nullptr;
+				Assert::AreEqual(0, (int)fopen_s(&file, path, "rb"));
+				uint8_t buffer[4096];
+				size_t read = fread(buffer, 1, sizeof(buffer), file);
+				fclose(file);
+				image.assign(buffer, buffer + read);
+			}
+			std::vector<uint8_t> expected = {
+				OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_GET_GLOBAL, 0, OP_PRINT, OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == code);
+			size_t codeOffset = std::search(image.begin(), image.end(), code.begin(), code.end()) - image.begin();
+			Assert::IsTrue(codeOffset < image.size());
+
+			// Patches the code, and the checksum so only the code is wrong. The checksum is at offset 16
+			// of the 72 byte header, and covers everything after it. See ImageHeader in image.c.
+			auto run = [&](std::vector<uint8_t> patched, std::string* output) {
+				std::copy(patched.begin(), patched.end(), image.begin() + codeOffset);
+				uint64_t checksum = hashBytes(image.data() + 72, image.size() - 72);
+				memcpy(image.data() + 16, &checksum, sizeof(checksum));
+				FILE* file = nullptr;
+				Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+				fwrite(image.data(), 1, image.size(), file);
+				fclose(file);
+
+				VM vm;
+				initVM(&vm);
+				setOutput(&vm, appendOutput, output);
+				InterpretResult result = interpretImage(&vm, path);
+				freeVM(&vm);
+				return result;
+			};
+
+			std::string output;
+			Assert::AreEqual((int)INTERPRET_OK, (int)run(code, &output));
+			Assert::AreEqual("1\n", output.c_str());
+
+			const std::vector<uint8_t> corrupt[] = {
+				{ OP_CONSTANT, 200, OP_DEFINE_GLOBAL, 0, OP_GET_GLOBAL, 0, OP_PRINT, OP_NIL, OP_RETURN }, // No such constant
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 1, OP_GET_GLOBAL, 0, OP_PRINT, OP_NIL, OP_RETURN },   // Name is a number
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_GET_UPVALUE, 0, OP_PRINT, OP_NIL, OP_RETURN },  // No such upvalue
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_GET_LOCAL, 1, OP_PRINT, OP_NIL, OP_RETURN },    // Slot beyond the stack
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_GET_GLOBAL, 0, OP_PRINT, OP_POP, OP_RETURN },   // Pops too many
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_LOOP, 0, 2, OP_NIL, OP_RETURN },                // Into an instruction
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_JUMP, 0, 9, OP_NIL, OP_RETURN },                // Past the end
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_GET_GLOBAL, 0, OP_PRINT, OP_NIL, OP_NIL },      // Runs off the end
+				{ OP_CONSTANT, 1, OP_DEFINE_GLOBAL, 0, OP_GET_GLOBAL, 0, OP_PRINT, OP_NIL, 0xff },        // No such opcode
+			};
+			for (const std::vector<uint8_t>& patched : corrupt) {
+				output.clear();
+				Assert::AreEqual((int)INTERPRET_COMPILE_ERROR, (int)run(patched, &output));
+				Assert::AreEqual("", output.c_str());
+			}
+
+			std::remove(path);
+		}
+
+		TEST_METHOD(CompileCache)
+		{
+			std::string source;
+			for (int f = 0; f < 100; ++f) {
+				source += "fun f" + std::to_string(f) + "(a) {\n";
+				for (int k = 0; k < 100; ++k) {
+					source += "  var v" + std::to_string(k) + " = a + " + std::to_string(k) + ";\n";
+				}
+				source += "  return v99;\n}\n";
+			}
+			source += "print f7(1) + f99(2);\n";
+
+			double seconds[2];
+			bool hits[2];
+			for (int run = 0; run < 2; ++run) {
+				VM vm;
+				initVM(&vm);
+				std::string output;
+				setOutput(&vm, appendOutput, &output);
+				// The entry stays in the working directory, so the first run may hit as well.
+				vm.cacheDirectory = ".";
+				Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source.c_str()));
+				Assert::AreEqual("201\n", output.c_str());
+				seconds[run] = vm.compileSeconds;
+				hits[run] = vm.cacheHit;
+				freeVM(&vm);
+			}
+			Assert::IsTrue(hits[1]);
+
+			char message[128];
+			sprintf_s(message, "First run %.3f ms (%s), second run %.3f ms (hit)\n",
+				seconds[0] * 1000.0, hits[0] ? "hit" : "miss", seconds[1] * 1000.0);
+			Logger::WriteMessage(message);
+		}
+
+		TEST_METHOD(CacheFromThreads)
+		{
+			// VMs on several threads miss the same new entry at once, and each stores it.
+			const std::string source = "// " + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "\n"
+				"fun square(x) { return x * x; } print square(12);";
+			const int threadCount = 4;
+			const int runCount = 20;
+
+			std::vector<std::string> outputs(threadCount);
+			std::vector<int> hits(threadCount, 0);
+			std::vector<std::thread> threads;
+			for (int t = 0; t < threadCount; ++t) {
+				threads.emplace_back([&, t]() {
+					for (int r = 0; r < runCount; ++r) {
+						VM vm;
+						initVM(&vm);
+						vm.cacheDirectory = ".";
+						setOutput(&vm, appendOutput, &outputs[t]);
+						interpret(&vm, source.c_str());
+						hits[t] += vm.cacheHit ? 1 : 0;
+						freeVM(&vm);
+					}
+				});
+			}
+			for (std::thread& thread : threads) {
+				thread.join();
+			}
+
+			std::string expected;
+			for (int r = 0; r < runCount; ++r) {
+				expected += "144\n";
+			}
+			for (int t = 0; t < threadCount; ++t) {
+				Assert::AreEqual(expected.c_str(), outputs[t].c_str());
+				Assert::IsTrue(hits[t] > 0);
+			}
+			// Each writer renamed or removed its own temporary file.
+			for (const auto& entry : std::filesystem::directory_iterator(".")) {
+				Assert::IsFalse(entry.path().extension() == ".tmp");
+			}
+		}
+
+		TEST_METHOD(HeapSnapshot)
+		{
+			const char* setup =
+				"class Counter { init(n) { this.n = n; } inc() { this.n = this.n + 1; return this.n; } }\n"
+				"fun makeAdder(total) { fun add(x) { total = total + x; return total; } return add; }\n"
+				"var adder = makeAdder(10);\n"
+				"adder(5);\n"
+				"var counter = Counter(3);\n"
+				"var inc = counter.inc;\n"
+				"var time = clock;\n";
+			const char* use = "print adder(1); print inc(); print counter.n; print time() >= 0; print Counter(7).inc();";
+
+			const char* path = "HeapSnapshot.lsn";
+
+			VM vm;
+			initVM(&vm);
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, setup));
+			Assert::IsTrue(writeSnapshot(&vm, path));
+			freeVM(&vm);
+
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			Assert::IsTrue(loadSnapshot(&vm, path));
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, use));
+			freeVM(&vm);
+			std::remove(path);
+			Assert::AreEqual("16\n4\n4\ntrue\n8\n", output.c_str());
+		}
+
+		TEST_METHOD(CloneVM)
+		{
+			const char* setup =
+				"class Counter { init() { this.n = 0; } inc() { this.n = this.n + 1; return this.n; } }\n"
+				"fun makeNext() { var i = 0; fun next() { i = i + 1; return i; } return next; }\n"
+				"var counter = Counter();\n"
+				"var next = makeNext();\n"
+				"var inc = counter.inc;\n";
+			const char* request = "print counter.inc() + next() + inc(); print counter.n;";
+
+			VM source;
+			initVM(&source);
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&source, setup));
+
+			// Requests on other threads start from the same state and don't see each other's changes.
+			const int threadCount = 4;
+			const int requestCount = 100;
+			std::string outputs[threadCount];
+			double seconds[threadCount];
+			VM clones[threadCount];
+			for (int t = 0; t < threadCount; ++t) {
+				auto begin = std::chrono::steady_clock::now();
+				Assert::IsTrue(cloneVM(&clones[t], &source));
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+				seconds[t] = elapsed.count();
+			}
+			std::vector<std::thread> threads;
+			for (int t = 0; t < threadCount; ++t) {
+				threads.emplace_back([&, t]() {
+					for (int r = 0; r < requestCount; ++r) {
+						VM vm;
+						cloneVM(&vm, &clones[t]);
+						setOutput(&vm, appendOutput, &outputs[t]);
+						interpret(&vm, request);
+						freeVM(&vm);
+					}
+				});
+			}
+			for (std::thread& thread : threads) {
+				thread.join();
+			}
+
+			std::string expected;
+			for (int r = 0; r < requestCount; ++r) {
+				expected += "4\n2\n";
+			}
+			for (int t = 0; t < threadCount; ++t) {
+				Assert::AreEqual(expected.c_str(), outputs[t].c_str());
+				freeVM(&clones[t]);
+			}
+			freeVM(&source);
+
+			char message[128];
+			sprintf_s(message, "Cloned in %.1f us\n", seconds[threadCount - 1] * 1e6);
+			Logger::WriteMessage(message);
+		}
+
+		TEST_METHOD(ImportModule)
+		{
+			const char* path = "ImportModule.lox";
+			FILE* file = nullptr;
+			Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+			fputs("print \"loaded\"; fun square(x) { return x * x; }", file);
+			fclose(file);
+
+			std::string output = runSource("import \"ImportModule.lox\"; import \"ImportModule.lox\"; print square(7);");
+			std::remove(path);
+			Assert::AreEqual("loaded\n49\n", output.c_str());
+		}
+
+		TEST_METHOD(ImportRedefinesFunction)
+		{
+			// Modules share the globals, so calls on either side of an import see the latest definition.
+			const char* path = "ImportRedefinesFunction.lox";
+			FILE* file = nullptr;
+			Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+			fputs("fun f() { return 2; } fun g() { return 3; } fun callG() { return g(); }", file);
+			fclose(file);
+
+			std::string output = runSource("fun f() { return 1; } import \"ImportRedefinesFunction.lox\";\n"
+				"var h = f; print h(); print f(); fun g() { return 4; } print callG();");
+			std::remove(path);
+			Assert::AreEqual("2\n2\n4\n", output.c_str());
+		}
+
+		TEST_METHOD(ProfileWarmStart)
+		{
+			// Bodies shorter than LAZY_COMPILE_MIN_BODY are compiled at declaration anyway.
+			const std::string pad = "\n  // " + std::string(LAZY_COMPILE_MIN_BODY, '-') + "\n";
+			const std::string source =
+				"fun sum(n) { var total = 0;" + pad + "for (var i = 0; i < n; i = i + 1) total = total + i; return total; }\n"
+				"fun cold(n) {" + pad + "return n + 1; }\n"
+				"fun greet(name) { return \"hello \" + name; }\n"
+				"print sum(100); print greet(\"profile\");";
+			const char* path = "ProfileWarmStart.prof";
+
+			VM vm;
+			initVM(&vm);
+			vm.lazyCompile = true;
+			vm.recording = newProfile();
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source.c_str()));
+			Assert::IsTrue(writeProfile(vm.recording, path));
+			freeProfile(vm.recording);
+			freeVM(&vm);
+
+			initVM(&vm);
+			vm.lazyCompile = true;
+			vm.profile = readProfile(path);
+			Assert::IsNotNull(vm.profile);
+			// Calls of sum(), and its two additions of numbers. greet() is inlined, so only its addition of strings counts.
+			Assert::AreEqual(4, vm.profile->count);
+
+			// sum() was called, so it's compiled now despite lazyCompile, with both of its additions specialized.
+			// cold() was never called, so it stays lazy.
+			ObjFunction* script = compile(&vm, source.c_str());
+			Assert::IsNotNull(script);
+			ObjFunction* sum = NULL;
+			ObjFunction* cold = NULL;
+			for (int i = 0; i < script->chunk.constants.count; ++i) {
+				Value constant = script->chunk.constants.values[i];
+				if (!IS_FUNCTION(constant)) continue;
+				if (strcmp(AS_FUNCTION(constant)->name->chars, "sum") == 0) sum = AS_FUNCTION(constant);
+				if (strcmp(AS_FUNCTION(constant)->name->chars, "cold") == 0) cold = AS_FUNCTION(constant);
+			}
+			Assert::IsNotNull(sum);
+			Assert::IsNull(sum->lazy);
+			Assert::AreEqual(2, countInstructions(&sum->chunk, OP_ADD_NUMBER));
+			Assert::AreEqual(0, countInstructions(&sum->chunk, OP_ADD));
+			Assert::IsNotNull(cold);
+			Assert::IsNotNull(cold->lazy);
+			// The inlined addition of strings is not specialized.
+			Assert::AreEqual(1, countInstructions(&script->chunk, OP_ADD));
+			Assert::AreEqual(0, countInstructions(&script->chunk, OP_ADD_NUMBER));
+
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source.c_str()));
+			freeProfile(vm.profile);
+			freeVM(&vm);
+			std::remove(path);
+
+			Assert::AreEqual("4950\nhello profile\n", output.c_str());
+		}
+
+		TEST_METHOD(RopeConcatenation)
+		{
+			// 100000 appends would copy about 10 GB if each one copied the whole string.
+			const char* source =
+				"var s = \"\"; var t = \"\";\n"
+				"for (var i = 0; i < 100000; i = i + 1) { s = s + \"ab\"; t = \"ab\" + t; }\n"
+				"print s == t; print s == t + \"!\";\n"
+				"var short = \"\"; for (var i = 0; i < 3; i = i + 1) short = short + \"ab\";\n"
+				"print short; print short == \"ababab\";";
+
+			Assert::AreEqual("true\nfalse\nababab\ntrue\n", runSource(source).c_str());
+		}
+
+		TEST_METHOD(LazyInterning)
+		{
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "var x = \"abc\"; var y = x + \"def\"; print y == \"abc\" + \"def\";"));
+			Assert::AreEqual("true\n", output.c_str());
+
+			Value y;
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "y", 1), &y));
+			ObjString* string = AS_STRING(y);
+			Assert::IsFalse(string->interned);
+			// "abcdef" is interned already, since the optimizer folded the constants.
+			Assert::IsTrue(internString(&vm, string) == copyString(&vm, "abcdef", 6));
+			Assert::IsFalse(string->interned);
+			freeVM(&vm);
+		}
+
+		TEST_METHOD(FoldConstants)
+		{
+			VM vm;
+			initVM(&vm);
+
+			ObjFunction* function = compile(&vm, "print 1 + 2 * 3; print \"a\" + \"b\"; print -(4 - 6); print !nil;");
+			std::vector<uint8_t> expected = {
+				OP_CONSTANT, 2, OP_PRINT,
+				OP_CONSTANT, 1, OP_PRINT,
+				OP_CONSTANT, 0, OP_PRINT,
+				OP_TRUE, OP_PRINT,
+				OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(function));
+			// Operands of the folded operations are dropped from the table.
+			Value* constants = function->chunk.constants.values;
+			Assert::AreEqual(3, function->chunk.constants.count);
+			Assert::AreEqual(7.0, AS_NUMBER(constants[2]));
+			Assert::AreEqual("ab", AS_CSTRING(constants[1]));
+			Assert::AreEqual(2.0, AS_NUMBER(constants[0]));
+
+			// These are runtime errors, which folding would hide or raise too early.
+			function = compile(&vm, "print \"a\" + 1; print -\"s\"; print nil < 1;");
+			expected = {
+				OP_CONSTANT, 0, OP_CONSTANT, 1, OP_ADD, OP_PRINT,
+				OP_CONSTANT, 2, OP_NEGATE, OP_PRINT,
+				OP_NIL, OP_CONSTANT, 1, OP_LESS, OP_PRINT,
+				OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(function));
+
+			freeVM(&vm);
+		}
+
+		TEST_METHOD(EliminateDeadCode)
+		{
+			VM vm;
+			initVM(&vm);
+
+			// The branches never taken go, and then the condition pushed only to be popped.
+			std::vector<uint8_t> expected = { OP_CONSTANT, 0, OP_PRINT, OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(compile(&vm, "if (false) print 1; print 2;")));
+			Assert::IsTrue(expected == scriptCode(compile(&vm, "while (false) print 1; print 2;")));
+			Assert::IsTrue(expected == scriptCode(compile(&vm, "if (true) print 2; else print 1;")));
+
+			// Folding in the branches shrinks them, so the jumps over them are shorter.
+			const char* source = "var a = true; if (a) print 1 + 2; else print 3; print 4;";
+			expected = {
+				OP_TRUE, OP_DEFINE_GLOBAL, 0,
+				OP_GET_GLOBAL, 0, OP_JUMP_IF_FALSE, 0, 7,
+				OP_POP, OP_CONSTANT, 1, OP_PRINT, OP_JUMP, 0, 4,
+				OP_POP, OP_CONSTANT, 1, OP_PRINT,
+				OP_CONSTANT, 2, OP_PRINT,
+				OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(compile(&vm, source)));
+			freeVM(&vm);
+
+			Assert::AreEqual("3\n4\n", runSource(source).c_str());
+		}
+
+		TEST_METHOD(ThreadJumps)
+		{
+			// The jump at the end of the inner then branch lands on the jump at the end of the outer one.
+			const char* source = "var a = true; var b = false; if (a) { if (b) print 1; } else print 2; print 3;";
+
+			VM vm;
+			initVM(&vm);
+			std::vector<uint8_t> expected = {
+				OP_TRUE, OP_DEFINE_GLOBAL, 0,
+				OP_FALSE, OP_DEFINE_GLOBAL, 1,
+				OP_GET_GLOBAL, 0, OP_JUMP_IF_FALSE, 0, 17,
+				OP_POP, OP_GET_GLOBAL, 1, OP_JUMP_IF_FALSE, 0, 7,
+				OP_POP, OP_CONSTANT, 2, OP_PRINT, OP_JUMP, 0, 8, // Straight to print 3.
+				OP_POP, OP_JUMP, 0, 4,
+				OP_POP, OP_CONSTANT, 3, OP_PRINT,
+				OP_CONSTANT, 4, OP_PRINT,
+				OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(compile(&vm, source)));
+			freeVM(&vm);
+
+			Assert::AreEqual("3\n", runSource(source).c_str());
+			Assert::AreEqual("2\n3\n", runSource("var a = false; var b = false; if (a) { if (b) print 1; } else print 2; print 3;").c_str());
+		}
+
+		TEST_METHOD(DeduplicateConstants)
+		{
+			VM vm;
+			initVM(&vm);
+
+			// Literals share a slot with the same earlier literal, and folded values with any identical constant.
+			// -0 is equal to 0 but prints differently, and NaN is not equal even to itself.
+			ObjFunction* function = compile(&vm,
+				"print 1.5; print \"s\"; print 1.5; print \"s\"; print 0; print -0; print 0 * -1; print 0 / 0; print 0 / 0;");
+			std::vector<uint8_t> expected = {
+				OP_CONSTANT, 0, OP_PRINT, OP_CONSTANT, 1, OP_PRINT,
+				OP_CONSTANT, 0, OP_PRINT, OP_CONSTANT, 1, OP_PRINT,
+				OP_CONSTANT, 2, OP_PRINT, OP_CONSTANT, 3, OP_PRINT, OP_CONSTANT, 3, OP_PRINT,
+				OP_CONSTANT, 4, OP_PRINT, OP_CONSTANT, 4, OP_PRINT,
+				OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(function));
+			Assert::AreEqual(5, function->chunk.constants.count);
+			Value* constants = function->chunk.constants.values;
+			Assert::IsFalse(std::signbit(AS_NUMBER(constants[2])));
+			Assert::IsTrue(std::signbit(AS_NUMBER(constants[3])));
+			Assert::IsTrue(std::isnan(AS_NUMBER(constants[4])));
+			freeVM(&vm);
+
+			const char* source = "print 0 == -0; print 1 / -0; print 0 / 0 == 0 / 0; var n = 0 / 0; print n == n;";
+			Assert::AreEqual("true\n-inf\nfalse\nfalse\n", runSource(source).c_str());
+		}
+
+		TEST_METHOD(InlineCalls)
+		{
+			VM vm;
+			initVM(&vm);
+
+			// An inlined call in the argument of another one.
+			// Each one calls sq() instead if it's no longer the function inlined.
+			std::vector<uint8_t> expected = {
+				OP_CLOSURE, 1, OP_DEFINE_GLOBAL, 0,
+				OP_CONSTANT, 3, OP_DEFINE_GLOBAL, 2,
+				OP_GET_GLOBAL, 0, OP_GET_GLOBAL, 0, OP_GET_GLOBAL, 2,
+				OP_CHECK_INLINED, 1, 1, OP_JUMP_IF_FALSE, 0, 11, OP_POP,
+				OP_PEEK, 0, OP_PEEK, 1, OP_MULTIPLY, OP_POP_UNDER, 2, OP_JUMP, 0, 3,
+				OP_POP, OP_CALL, 1,
+				OP_CHECK_INLINED, 1, 1, OP_JUMP_IF_FALSE, 0, 11, OP_POP,
+				OP_PEEK, 0, OP_PEEK, 1, OP_MULTIPLY, OP_POP_UNDER, 2, OP_JUMP, 0, 3,
+				OP_POP, OP_CALL, 1,
+				OP_PRINT, OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(compile(&vm, "fun sq(x) { return x * x; } var y = 3; print sq(sq(y));")));
+
+			// Calls with the wrong number of arguments are left for the runtime error.
+			expected = {
+				OP_CLOSURE, 1, OP_DEFINE_GLOBAL, 0,
+				OP_GET_GLOBAL, 0, OP_CONSTANT, 2, OP_CALL, 1,
+				OP_PRINT, OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(compile(&vm, "fun add(a, b) { return a + b; } print add(1);")));
+			Assert::AreEqual((int)INTERPRET_RUNTIME_ERROR, (int)interpret(&vm, "fun add(a, b) { return a + b; } print add(1);"));
+
+			// So are calls of a function assigned anywhere in the source, even after them.
+			expected = {
+				OP_CLOSURE, 1, OP_DEFINE_GLOBAL, 0,
+				OP_GET_GLOBAL, 0, OP_CALL, 0, OP_PRINT,
+				OP_NIL, OP_SET_GLOBAL, 0, OP_POP,
+				OP_NIL, OP_RETURN };
+			Assert::IsTrue(expected == scriptCode(compile(&vm, "fun f() { return 1; } print f(); f = nil;")));
+			freeVM(&vm);
+
+			// Each argument is evaluated once, from left to right, however many times the body reads it.
+			const char* source =
+				"fun sub(a, b) { return a - b; } fun twice(x) { return x + x; }\n"
+				"var n = 0; fun next() { n = n + 1; return n; }\n"
+				"print sub(next(), next()); print twice(next()); print n;";
+			Assert::AreEqual("-1\n6\n3\n", runSource(source).c_str());
+			Assert::AreEqual("9\n81\n", runSource("fun sq(x) { return x * x; } var y = 3; print sq(y); print sq(sq(y));").c_str());
+
+			// A later interpret() on the same VM, as in the REPL, can redefine an inlined function.
+			std::string output;
+			initVM(&vm);
+			setOutput(&vm, appendOutput, &output);
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "fun price(x) { return x * 2; } fun total(x) { return price(x) + 1; } print total(3);"));
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "fun price(x) { return x * 10; } print total(3);"));
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "fun price(x, y) { return x + y; }"));
+			Assert::AreEqual((int)INTERPRET_RUNTIME_ERROR, (int)interpret(&vm, "print total(3);"));
+			freeVM(&vm);
+			Assert::AreEqual("7\n31\n", output.c_str());
+		}
+
+		TEST_METHOD(LazyCompile)
+		{
+			// Bodies shorter than LAZY_COMPILE_MIN_BODY are compiled at declaration anyway.
+			const std::string pad = "\n  // " + std::string(LAZY_COMPILE_MIN_BODY, '-') + "\n";
+			const std::string source =
+				"class Shape { init(name) { this.name = name;" + pad + "} area() { return 0; }\n"
+				"  describe() {" + pad + "print this.name; print this.area(); } }\n"
+				"class Square < Shape { init(side) { super.init(\"square\"); this.side = side;" + pad + "}\n"
+				"  area() {" + pad + "return this.side * this.side; } }\n"
+				"fun makeCounter(step) { var count = 0;" + pad + "fun next() {" + pad + "count = count + step; return count; } return next; }\n"
+				"var counter = makeCounter(3); counter(); print counter();\n"
+				"fun outer() { var x = \"before\"; fun get() {" + pad + "return x; } fun set(v) {" + pad + "x = v; }\n"
+				"  x = \"after\"; print get(); set(\"set\"); print get(); }\n"
+				"outer();\n"
+				"Square(4).describe();\n"
+				"fun fib(n) {" + pad + "if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+				"print fib(15);\n"
+				"var f = nil; for (var i = 0; i < 3; i = i + 1) { var j = i; fun g() {" + pad + "return j * 10; } f = g; } print f();\n";
+
+			VM vm;
+			initVM(&vm);
+			vm.lazyCompile = true;
+			ObjFunction* script = compile(&vm, source.c_str());
+			Assert::IsNotNull(script);
+			int lazyCount = 0;
+			for (int i = 0; i < script->chunk.constants.count; ++i) {
+				Value constant = script->chunk.constants.values[i];
+				if (IS_FUNCTION(constant) && AS_FUNCTION(constant)->lazy != NULL) lazyCount++;
+			}
+			Assert::AreEqual(8, lazyCount); // All declared in the script but the short Shape.area(). next(), get() and set() are in lazy bodies.
+			freeVM(&vm);
+
+			// Closures compiled on their first call capture the same variables as when compiled with their enclosing functions.
+			const char* expected = "6\nafter\nset\nsquare\n16\n610\n20\n";
+			Assert::AreEqual(expected, runSource(source.c_str()).c_str());
+			Assert::AreEqual(expected, runSource(source.c_str(), true).c_str());
+
+			// A syntax error in a lazy body is found on its first call.
+			const std::string broken = "fun never() {" + pad + "var = 1; }\nprint \"ran\";\n";
+			initVM(&vm);
+			Assert::AreEqual((int)INTERPRET_COMPILE_ERROR, (int)interpret(&vm, broken.c_str()));
+			freeVM(&vm);
+			Assert::AreEqual("ran\n", runSource(broken.c_str(), true).c_str());
+			initVM(&vm);
+			vm.lazyCompile = true;
+			Assert::AreEqual((int)INTERPRET_RUNTIME_ERROR, (int)interpret(&vm, (broken + "never();").c_str()));
+			freeVM(&vm);
+		}
+
+		TEST_METHOD(CompileThroughput)
+		{
+			// Machine generated style: functions with many locals, and a closure capturing them.
+			// The script chunk can hold up to 256 constants, so the number of functions is limited.
+			const int functionCount = 100;
+			const int localCount = 250;
+			const int assignmentCount = 100;
+
+			std::string source;
+			int lines = 0;
+			for (int f = 0; f < functionCount; ++f) {
+				source += "fun f" + std::to_string(f) + "(a, b) {\n";
+				source += "  var v0 = a;\n";
+				for (int k = 1; k < localCount; ++k) {
+					source += "  var v" + std::to_string(k) + " = v" + std::to_string((k * 7 + f) % k) + " + a;\n";
+				}
+				source += "  fun inner() {\n";
+				for (int k = 0; k < assignmentCount; ++k) {
+					source += "    v" + std::to_string((k * 13) % localCount) + " = v" + std::to_string((k * 31 + f) % localCount) + " + b;\n";
+				}
+				source += "  }\n  return inner;\n}\n";
+				lines += localCount + assignmentCount + 5;
+			}
+
+			VM vm;
+			initVM(&vm);
+
+			auto begin = std::chrono::steady_clock::now();
+			InterpretResult result = interpret(&vm, source.c_str());
+			std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+			Assert::AreEqual((int)INTERPRET_OK, (int)result);
+
+			char message[128];
+			sprintf_s(message, "Compiled %d lines at %.0f lines/s\n", lines, lines / seconds.count());
+			Logger::WriteMessage(message);
+
+			freeVM(&vm);
+		}
+
+		TEST_METHOD(ShortStrings)
+		{
+			const char* source =
+				"var a = \"a\"; var chars = a + \"bcd\"; var word = chars + \"e\"; var longer = word + \"f\";\n"
+				"print chars; print chars == \"abcd\"; print word == \"abcde\"; print word == \"abcdf\";\n"
+				"print longer; print longer == \"abcdef\"; print clock() > 0;";
+
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source));
+			Assert::AreEqual("abcd\ntrue\ntrue\nfalse\nabcdef\ntrue\ntrue\n", output.c_str());
+
+			Value word;
+			Value longer;
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "word", 4), &word));
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "longer", 6), &longer));
+#if NAN_BOXING
+			Assert::IsTrue(IS_SHORT_STRING(word));
+#endif
+			Assert::IsTrue(IS_STRING(longer));
+			freeVM(&vm);
+		}
+
+		TEST_METHOD(MappedReadFile)
+		{
+			const char* path = "MappedReadFile.txt";
+			FILE* file = nullptr;
+			Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+			for (int i = 0; i < MAPPED_STRING_MIN; ++i) fputs("ab", file);
+			fclose(file);
+
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			std::string source = "var file = readFile(\"MappedReadFile.txt\"); var built = \"\";\n"
+				"for (var i = 0; i < " + std::to_string(MAPPED_STRING_MIN) + "; i = i + 1) built = built + \"ab\";\n"
+				"print file == built; print file + \"!\" == built + \"!\"; print file == built + \"!\";";
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source.c_str()));
+
+			Value value;
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "file", 4), &value));
+			Assert::IsTrue(IS_MAPPED_STRING(value));
+			Assert::AreEqual((size_t)MAPPED_STRING_MIN * 2, AS_MAPPED_STRING(value)->length);
+			freeVM(&vm);
+			std::remove(path);
+
+			Assert::AreEqual("true\ntrue\nfalse\n", output.c_str());
+		}
+
+		TEST_METHOD(StreamReader)
+		{
+			// A line longer than the buffer, line breaks of both kinds and a last line without one.
+			const char* path = "StreamReader.txt";
+			std::string longLine(READER_BUFFER_SIZE + 10, 'x');
+			FILE* file = nullptr;
+			Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+			fputs("first\r\n\n", file);
+			fputs(longLine.c_str(), file);
+			fputs("\nlast", file);
+			fclose(file);
+
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			const char* source = "var reader = openReader(\"StreamReader.txt\");\n"
+				"print readLine(reader); print readLine(reader) == \"\"; var long = readLine(reader);\n"
+				"print readChunk(reader, 2); print readChunk(reader, 100); print readLine(reader);\n"
+				"closeReader(reader); print readChunk(openReader(\"StreamReader.txt\"), 5);";
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source));
+
+			Value value;
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "long", 4), &value));
+			Assert::IsTrue(IS_STRING(value));
+			Assert::AreEqual(longLine.c_str(), AS_CSTRING(value));
+			freeVM(&vm);
+			std::remove(path);
+
+			Assert::AreEqual("first\ntrue\nla\nst\nnil\nfirst\n", output.c_str());
+		}
+
+		TEST_METHOD(PathFromView)
+		{
+			// Paths of 32 characters or more sliced from other strings are views, without a terminating null.
+			const char* path = "PathFromView_0123456789abcdef.txt";
+			FILE* file = nullptr;
+			Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+			fputs("line", file);
+			fclose(file);
+
+			std::string output = runSource("var path = trim(\"  PathFromView_0123456789abcdef.txt  \");\n"
+				"print readFile(path); print readLine(openReader(substring(path + \"!\", 0, 33)));");
+			std::remove(path);
+			Assert::AreEqual("line\nline\n", output.c_str());
+		}
+
+		TEST_METHOD(NativeErrorKeepsVM)
+		{
+			// A runtime error in a native resets the stack, so the native mustn't pop what it pushed afterwards.
+			const char* failing[] = {
+				"readFile(\"NativeErrorKeepsVM/missing.txt\");",
+				"find(\"(\", \"abc\");",
+				"match(\"a\" + \"[\", \"abc\");",
+				"jsonParse(\"[1,\");",
+				"jsonStringify(clock);",
+				"jsonStringify(1 / 0);",
+				"class A {} var a = A(); a.self = a; jsonStringify(a);",
+			};
+			for (const char* source : failing) {
+				VM vm;
+				initVM(&vm);
+				std::string output;
+				setOutput(&vm, appendOutput, &output);
+				Assert::AreEqual((int)INTERPRET_RUNTIME_ERROR, (int)interpret(&vm, source));
+				Assert::IsTrue(vm.stackTop == vm.stack);
+				Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "print 1;"));
+				Assert::AreEqual("1\n", output.c_str());
+				freeVM(&vm);
+			}
+		}
+
+		TEST_METHOD(StringNatives)
+		{
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			// The view outlives the only other reference to its parent, across collections.
+			const char* source = "var s = \"  key = \"; for (var i = 0; i < 8; i = i + 1) s = s + \"0123456789\";\n"
+				"var value = trim(substring(s, indexOf(s, \"=\") + 1)); s = nil;\n"
+				"var g = \"garbage \"; for (var i = 0; i < 10000; i = i + 1) s = g + g;\n"
+				"print startsWith(value, \"0123\"); print indexOf(value, \"9012\", 10);\n"
+				"print replace(substring(value, 0, 12), \"01\", \"-\");\n"
+				"for (var p = split(\"a,,b\", \",\"); p != nil; p = p.next) print \"<\" + p.value + \">\";";
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source));
+
+			Value value;
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "value", 5), &value));
+			Assert::IsTrue(IS_STRING_VIEW(value));
+			Assert::AreEqual((size_t)80, AS_STRING_VIEW(value)->length);
+			Assert::AreEqual(0, memcmp(AS_STRING_VIEW(value)->chars, "0123456789", 10));
+			freeVM(&vm);
+
+			Assert::AreEqual("true\n19\n-23456789-\n<a>\n<>\n<b>\n", output.c_str());
+		}
+
+		TEST_METHOD(Regexes)
+		{
+			const char* error;
+			Regex* regex = compileRegex("(a|b)*abb", 9, &error);
+			Assert::IsNotNull(regex);
+			Assert::IsTrue(matchRegex(regex, "babaabb", 7));
+			Assert::IsFalse(matchRegex(regex, "babaab", 6));
+			size_t start, end;
+			Assert::IsTrue(findRegex(regex, "xxabbabb", 8, 0, &start, &end));
+			Assert::AreEqual((size_t)2, start);
+			Assert::AreEqual((size_t)8, end); // The longest of the leftmost matches.
+			freeRegex(regex);
+			Assert::IsNull(compileRegex("a(", 2, &error));
+
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			// Patterns given as strings in the loop are compiled once.
+			const char* source = "var r = Regex(\"[0-9]+\"); var n = 0;\n"
+				"for (var i = 0; i < 1000; i = i + 1) if (match(\"k[0-9]\", \"k7\")) n = n + 1;\n"
+				"print n; print find(r, \"ab 42 c\"); print find(\"^b\", \"ab\"); print replace(\"a1b22\", r, \"#\");";
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source));
+			Assert::AreEqual(3, vm.regexes.count);
+			Assert::AreEqual((int)INTERPRET_RUNTIME_ERROR, (int)interpret(&vm, "Regex(\"[a\");"));
+			freeVM(&vm);
+
+			Assert::AreEqual("1000\n42\nnil\na#b#\n", output.c_str());
+		}
+
+		TEST_METHOD(Json)
+		{
+			const char* path = "Json.json";
+			FILE* file = nullptr;
+			Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+			fputs("{\"name\": \"caf\\u00e9 \\\"q\\\"\", \"n\": -12.5e2, \"list\": [1, true, null, []], "
+				"\"long\": \"0123456789012345678901234567890123456789\"}", file);
+			fclose(file);
+
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			const char* source = "var v = jsonParse(readFile(\"Json.json\")); var long = v.long;\n"
+				"print v.name; print v.n; print v.list.length; print v.list.first.next.value;\n"
+				"print jsonStringify(v.list); print jsonStringify(v.name);";
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, source));
+			// Strings without escapes aren't copied.
+			Value value;
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "long", 4), &value));
+			Assert::IsTrue(IS_STRING_VIEW(value));
+			Assert::AreEqual((int)INTERPRET_RUNTIME_ERROR, (int)interpret(&vm, "jsonParse(\"[1,]\");"));
+			Assert::AreEqual((int)INTERPRET_RUNTIME_ERROR, (int)interpret(&vm, "class A {} var a = A(); a.a = a; jsonStringify(a);"));
+			freeVM(&vm);
+			std::remove(path);
+
+			Assert::AreEqual("caf\xc3\xa9 \"q\"\n-1250\n4\ntrue\n[1,true,null,[]]\n\"caf\xc3\xa9 \\\"q\\\"\"\n", output.c_str());
+		}
+
+		TEST_METHOD(JsonBenchmark)
+		{
+			// Records as services exchange them.
+			const char* path = "JsonBenchmark.json";
+			const int recordCount = 100000;
+			FILE* file = nullptr;
+			Assert::AreEqual(0, (int)fopen_s(&file, path, "wb"));
+			fputc('[', file);
+			for (int i = 0; i < recordCount; ++i) {
+				fprintf_s(file, "%s{\"id\": %d, \"name\": \"user%d\", \"score\": %d.%02d, \"tags\": [\"a\", \"bb\"], \"active\": %s, "
+					"\"bio\": \"Lorem ipsum dolor sit amet, consectetur adipiscing elit %d\"}",
+					i > 0 ? ",\n" : "", i, i, i % 100, i % 97, i % 2 == 0 ? "true" : "false", i);
+			}
+			fputc(']', file);
+			fclose(file);
+
+			VM vm;
+			initVM(&vm);
+			std::string output;
+			setOutput(&vm, appendOutput, &output);
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "var text = readFile(\"JsonBenchmark.json\");"));
+			Value text;
+			Assert::IsTrue(tableGet(&vm.globals, copyString(&vm, "text", 4), &text));
+			double megabytes = (double)AS_MAPPED_STRING(text)->length / (1024 * 1024);
+
+			auto begin = std::chrono::steady_clock::now();
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "var value = jsonParse(text);"));
+			std::chrono::duration<double> parseSeconds = std::chrono::steady_clock::now() - begin;
+			begin = std::chrono::steady_clock::now();
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "var json = jsonStringify(value);"));
+			std::chrono::duration<double> stringifySeconds = std::chrono::steady_clock::now() - begin;
+			Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, "print value.length; print jsonParse(json).length;"));
+			freeVM(&vm);
+			std::remove(path);
+
+			char message[128];
+			sprintf_s(message, "Parsed %.1f MB of JSON at %.0f MB/s, and wrote it at %.0f MB/s\n",
+				megabytes, megabytes / parseSeconds.count(), megabytes / stringifySeconds.count());
+			Logger::WriteMessage(message);
+			Assert::AreEqual("100000\n100000\n", output.c_str());
+		}
+
+		TEST_METHOD(StringHashBenchmark)
+		{
+			// Identifiers, then payloads like lines and files.
+			const int lengths[] = { 8, 24, 256, 64 * 1024 };
+			for (int length : lengths) {
+				std::string text(length, 'x');
+				for (int i = 0; i < length; ++i) text[i] = (char)('a' + (i * 7) % 26);
+				const int repeat = 64 * 1024 * 1024 / length;
+				uint32_t sink = 0;
+				auto begin = std::chrono::steady_clock::now();
+				for (int i = 0; i < repeat; ++i) {
+					text[i % length] ^= 1; // Stops the compiler from hoisting the hash out of the loop.
+					sink += hashString(text.c_str(), length);
+				}
+				std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+
+				char message[128];
+				sprintf_s(message, "Hashed %d byte strings at %.0f MB/s (%08x)\n",
+					length, (double)repeat * length / (1024 * 1024) / seconds.count(), sink);
+				Logger::WriteMessage(message);
+			}
+
+			// Probe lengths of a table filled with similar keys, as generated code has.
+			// No VM is current, so the table doesn't collect garbage and the keys needn't be real objects.
+			const int keyCount = 100000;
+			std::vector<ObjString*> keys(keyCount);
+			Table table;
+			initTable(&table);
+			for (int i = 0; i < keyCount; ++i) {
+				std::string name = "value" + std::to_string(i);
+				ObjString* key = static_cast<ObjString*>(malloc(sizeof(ObjString) + name.size() + 1));
+				key->length = (int)name.size();
+				memcpy(key->chars, name.c_str(), name.size() + 1);
+				key->hash = hashString(key->chars, key->length);
+				key->interned = true;
+				keys[i] = key;
+				tableSet(&table, key, NIL_VAL);
+			}
+
+			int histogram[8] = { 0 };
+			long long total = 0;
+			int longest = 0;
+			for (int i = 0; i < table.capacity; ++i) {
+				ObjString* key = table.entries[i].key;
+				if (key == NULL) continue;
+				int probes = (int)((i - (key->hash & (table.capacity - 1))) & (table.capacity - 1));
+				total += probes;
+				if (probes > longest) longest = probes;
+				histogram[probes < 7 ? probes : 7]++;
+			}
+			double average = (double)total / keyCount;
+			char message[256];
+			sprintf_s(message, "%d keys in %d slots: %.2f probes on average, %d at most. 0:%d 1:%d 2:%d 3:%d 4:%d 5:%d 6:%d 7+:%d\n",
+				keyCount, table.capacity, average, longest,
+				histogram[0], histogram[1], histogram[2], histogram[3], histogram[4], histogram[5], histogram[6], histogram[7]);
+			Logger::WriteMessage(message);
+
+			// Uniform hashing would average about 0.5 / (1 - load) - 0.5 with linear probing.
+			double load = (double)keyCount / table.capacity;
+			freeTable(&table);
+			for (ObjString* key : keys) free(key);
+			Assert::IsTrue(average < 0.5 / (1 - load));
+		}
+
+		TEST_METHOD(ScanThreadTokens)
+		{
+			std::string source;
+			for (int i = 0; i < 20000; ++i) {
+				source += "var x" + std::to_string(i) + " = \"s\" + 1.5; // note\n";
+			}
+
+			Scanner scanner;
+			initScanner(&scanner, source.c_str(), source.size());
+			ScanThread* scan = startScanThread(source.c_str(), source.size());
+			Assert::IsNotNull(scan);
+
+			Scanner mirror;
+			initScanner(&mirror, source.c_str(), source.size());
+			for (;;) {
+				Token expected = scanToken(&scanner);
+				Token token = nextScannedToken(scan, &mirror);
+				Assert::AreEqual((int)expected.type, (int)token.type);
+				Assert::IsTrue(expected.start == token.start);
+				Assert::AreEqual(expected.length, token.length);
+				Assert::AreEqual(expected.line, token.line);
+				Assert::IsTrue(scanner.current == mirror.current);
+				if (token.type == TOKEN_EOF) break;
+			}
+			Assert::AreEqual((int)TOKEN_EOF, (int)nextScannedToken(scan, &mirror).type);
+			stopScanThread(scan);
+
+			// Compile a large source with and without the thread. Best of a few runs, as starting threads is noisy.
+			std::string program;
+			for (int f = 0; f < 100; ++f) {
+				program += "fun f" + std::to_string(f) + "(a) {\n";
+				for (int k = 0; k < 200; ++k) {
+					program += "  var v" + std::to_string(k) + " = a * \"s\" + " + std::to_string(k) + "; // note\n";
+				}
+				program += "  return v199;\n}\n";
+			}
+			program += "print f3;\n";
+			Assert::IsTrue(program.size() >= SCAN_THREAD_MIN_SOURCE);
+
+			double seconds[2] = { 1e9, 1e9 };
+			for (int run = 0; run < 6; ++run) {
+				bool threaded = run % 2 == 1;
+				VM vm;
+				initVM(&vm);
+				std::string output;
+				setOutput(&vm, appendOutput, &output);
+				vm.scanThread = threaded;
+				Assert::AreEqual((int)INTERPRET_OK, (int)interpret(&vm, program.c_str()));
+				Assert::AreEqual("<fn f3>\n", output.c_str());
+				seconds[threaded] = std::min(seconds[threaded], vm.compileSeconds);
+				freeVM(&vm);
+			}
+
+			char message[128];
+			sprintf_s(message, "Compiled %.1f MB in %.3f ms on one thread, %.3f ms with the scan thread\n",
+				program.size() / 1e6, seconds[0] * 1000.0, seconds[1] * 1000.0);
+			Logger::WriteMessage(message);
+		}
 	};
 }